@@ -1,5 +1,7 @@
 #pragma once
 
+#include <stddef.h>
+
 // Including this so frontends have access to SERV_MAX_MSG_LEN etcetera
 #include "server.h"
 
@@ -10,7 +12,9 @@ enum client_errcode {
     CLIENT_ERR_CON_REFUSED, // Server refused connection
     CLIENT_ERR_INVALID_MSG, // Attempt to send an invalid message (maybe exceeding the size limit etc.)
     CLIENT_ERR_ARGCOUNT, // The client has received more arguments in a message than expected
-    CLIENT_ERR_NOREC // Nothing to receive in a non-blocking receive function
+    CLIENT_ERR_NOREC, // Nothing to receive in a non-blocking receive function
+    CLIENT_ERR_QUEUE_FULL, // The outbound queue of the asynchronous sending mode is full, try again later
+    CLIENT_ERR_RECONNECTING // The connection has been lost and the client is reconnecting, try again later
 };
 
 enum client_msg_type {
@@ -23,7 +27,21 @@ enum client_msg_type {
     // Note that this doesn't guarantee that the nick will be changed
     // The actual nick that the server will use is always sent back to the client
     // Although usually, the server just sends back the same nick as a confirmation
-    CLIENT_MSG_NICK
+    CLIENT_MSG_NICK,
+    // Only received when reconnecting is enabled (see client_set_auto_reconnect)
+    // The connection has been lost and the client is trying to reconnect
+    CLIENT_MSG_RECONNECTING,
+    // The client has reconnected, the messages that were missed in the meantime follow
+    CLIENT_MSG_RECONNECTED,
+    // A user offers us a file, accept it with client_accept_file or decline it with client_cancel_file
+    CLIENT_MSG_OFFER,
+    // The next part of a file that we are receiving, the file is complete once offset+len is its size
+    CLIENT_MSG_CHUNK,
+    // A file transfer has ended, either the whole file has been sent or one of the sides has cancelled it
+    CLIENT_MSG_TRANSFER_END,
+    // Someone has come, left or changed their nick, or the whole list of users has arrived,
+    // see client_get_users
+    CLIENT_MSG_PRESENCE
 } type;
 
 // A "generic" message, either sent or receceived from the server
@@ -38,7 +56,11 @@ struct client_msg {
         union {
             // Corresponds to CLIENT_MSG_MSG
             struct {
-                char* sender;
+                // Assigned by the server, it increases with every message
+                unsigned long seq;
+                // The nicks are interned by the library, they are shared and
+                // mustn't be freed, they stay valid until the next client_connect
+                const char* sender;
                 char* text;
             } msg;
 
@@ -46,6 +68,44 @@ struct client_msg {
             struct {
                 char* newnick;
             } nick;
+
+            // CLIENT_MSG_OFFER
+            struct {
+                // The transfer's id, used by client_accept_file etcetera
+                unsigned long id;
+                // Interned just like the sender of CLIENT_MSG_MSG
+                const char* sender;
+                char* name;
+                unsigned long long size;
+            } offer;
+
+            // CLIENT_MSG_CHUNK
+            struct {
+                unsigned long id;
+                // The position of the data in the file, the chunks arrive in order
+                unsigned long long offset;
+                // Binary data, it isn't null-terminated
+                char* data;
+                size_t len;
+            } chunk;
+
+            // CLIENT_MSG_TRANSFER_END
+            struct {
+                unsigned long id;
+                // Set if the whole file has been sent, otherwise the transfer was cancelled
+                // (CLIENT_MSG_CHUNK tells the recipient when it has got the whole file)
+                int complete;
+            } transfer;
+
+            // CLIENT_MSG_PRESENCE
+            struct {
+                // The user that has changed, 0 when the whole list has arrived
+                unsigned long id;
+                // The user's new nick (interned), NULL if the user has left or the id is 0
+                const char* nick;
+                // Increases by one with every change on the server
+                unsigned long version;
+            } presence;
         } rec;
 
         // Data sent to the server
@@ -67,14 +127,152 @@ struct client_msg {
 // Can return protlib error codes as well as client error codes
 // Only disconnects the client when returning protlib errors (aka values < 0)
 // It does all the necessary checks for message validity before sending
+// In the asynchronous sending mode, it only queues the message up and returns immediately,
+// it can return CLIENT_ERR_QUEUE_FULL and a protlib error only means that a previous write failed
 int client_send(const struct client_msg* msg);
 
+// Send count messages at once, they are coalesced into as few writes as possible
+// Stops at the first message that fails, the number of messages sent (or queued) is stored in sent
+// The return value is the same as with client_send
+int client_send_many(const struct client_msg* msgs, const size_t count, size_t* sent);
+
+// Called by the background sending thread for every queued message once it has been written
+// to the socket (status is CLIENT_ERR_OK) or once it's clear that it won't be (a protlib error)
+// The messages are completed in the same order as they were queued
+// Just like client_notify_fn, it must not call any of the client functions
+typedef void (*client_sent_fn)(void* data, unsigned long id, int status);
+
+// Switch to the asynchronous sending mode, call this after client_init and before client_connect
+// In this mode, client_send only appends the message to a bounded outbound queue and a background
+// thread writes out everything that has been queued since its last write at once, so sending never
+// blocks. When a message is done, sent is called with data (unless it's NULL)
+// Can be called again to change the callback, returns either OK or CLIENT_ERR_INIT
+int client_set_async_send(client_sent_fn sent, void* data);
+
+// In the asynchronous sending mode, returns the id that the next queued message will get
+// The messages are numbered in the order in which they are queued, starting from 1 after connecting
+// Returns 0 otherwise
+unsigned long client_next_send_id();
+
+// Wait at max timeout milliseconds until everything that has been queued is written out
+// Returns CLIENT_ERR_OK, CLIENT_ERR_QUEUE_FULL on timeout or a protlib error (and disconnects)
+// if a write has failed, does nothing in the synchronous mode
+int client_flush(const unsigned int timeout);
+
 // Receive a message from the server (waiting at max for timeout milliseconds)
+// The strings in msg are malloc-ated and have to be freed, except for the sender's nick
+// (the data of CLIENT_MSG_CHUNK is malloc-ated as well)
 // Can return protlib error codes as well as client error codes
 // Disconnects whenever the return value isn't CLIENT_ERR_OK
-// Checks for valid argument count but not for the argument length
+// Rejects a message whose head, argument count or argument lengths don't fit the
+// message table in messages.h
 int client_receive(struct client_msg* msg, const unsigned int timeout);
 
+// Called whenever the recipient of an offered file is ready for the next len bytes at offset,
+// copy them into buf and return 0, or return -1 to cancel the transfer
+typedef int (*client_read_fn)(void* data, unsigned long id, unsigned long long offset, char* buf, size_t len);
+
+// Returns the id of the user with the nick, or 0 if there isn't any such user
+unsigned long client_find_user(const char* nick);
+
+// A user that is online right now
+struct client_user {
+    unsigned long id;
+    // Interned just like the sender of CLIENT_MSG_MSG
+    const char* nick;
+};
+
+// Store at max max of the users that are online in users (including ourselves) and return
+// how many of them there are, the server sends the list once after connecting and then only
+// the changes, CLIENT_MSG_PRESENCE tells the frontend about each of them
+// Only call it from the thread that calls client_receive
+size_t client_get_users(struct client_user* users, const size_t max);
+
+// Offer a file of size bytes to the user (see client_find_user), the id of the transfer is stored in id
+// Once the recipient accepts it, the file is sent in chunks as the messages are received, read is
+// called with data for each chunk and the recipient acknowledges them as they arrive, only up to
+// SERV_TRANSFER_WINDOW bytes are on their way at once. The server sends the chunks to the recipient
+// only when there's no chat traffic waiting, so even a big file doesn't hold up the messages
+// The transfer ends with CLIENT_MSG_TRANSFER_END, losing the connection (even with reconnecting) ends
+// all the transfers without it
+// Returns CLIENT_ERR_OK, CLIENT_ERR_INVALID_MSG, CLIENT_ERR_QUEUE_FULL when there are too many transfers,
+// CLIENT_ERR_RECONNECTING or a protlib error (and disconnects)
+// The transfer functions and read are only ever called from the thread that calls client_receive
+int client_offer_file(const unsigned long user, const char* name, const unsigned long long size,
+                      client_read_fn read, void* data, unsigned long* id);
+
+// Accept the file offered with CLIENT_MSG_OFFER, its chunks start arriving as CLIENT_MSG_CHUNK
+// Returns the same as client_send
+int client_accept_file(const unsigned long id);
+
+// Decline an offer or cancel a transfer in either direction, there's no CLIENT_MSG_TRANSFER_END for it
+// Returns the same as client_send
+int client_cancel_file(const unsigned long id);
+
+// Called by the background I/O thread of the asynchronous mode whenever new messages arrive
+// It must not call any of the client functions, it should only wake up the frontend
+typedef void (*client_notify_fn)(void* data);
+
+// Switch to the asynchronous mode, call this after client_init and before client_connect
+// In this mode, a background thread receives the messages as soon as they arrive and
+// stores them in a queue, client_receive then just takes them out of the queue
+// (still waiting at max for timeout milliseconds if it's empty).
+// Whenever new messages arrive, notify is called with data (unless it's NULL) and the
+// descriptor returned by client_event_fd becomes readable
+// When the server runs on the same machine (at 127.0.0.1), the thread asks it to send the
+// messages through shared memory instead of the socket, this only works on Linux
+// Can be called again to change the callback, returns either OK or CLIENT_ERR_INIT
+int client_set_async(client_notify_fn notify, void* data);
+
+// Enable reconnecting automatically when the connection is lost, only in the asynchronous mode
+// The client tries to connect again at max attempts times (0 disables it) with an increasing delay
+// and resumes the session, the server sends it the messages it has missed in the meantime and
+// the nick stays the same. The frontend gets CLIENT_MSG_RECONNECTING and CLIENT_MSG_RECONNECTED
+// instead of an error and sending returns CLIENT_ERR_RECONNECTING in the meantime
+// (in the asynchronous sending mode, the queued messages wait until reconnected)
+// Only when all the attempts fail, client_receive returns an error
+// Always succeeds
+void client_set_auto_reconnect(const unsigned int attempts);
+
+// Ask the server to compress everything it sends, if it can, for slow connections
+// It's negotiated whenever the client (re)connects, so it applies from the next client_connect
+// The frontend doesn't see any difference, except that the history after reconnecting
+// and the other bulk traffic arrive sooner
+// Always succeeds
+void client_set_compression(const int enabled);
+
+// In the asynchronous mode on Linux, returns an eventfd that is readable
+// whenever there are messages waiting for client_receive, -1 otherwise
+// Don't read from it, client_receive resets it once all the messages are taken out
+int client_event_fd();
+
+// The strings of the messages returned by client_receive_batch are stored in an arena,
+// a single block of memory that is reused by every batch
+// Zero-initialise it before the first use
+struct client_arena {
+    char* data;
+    size_t size;
+    size_t used;
+};
+
+// The initial size of an arena, it's enough for a couple of the biggest possible messages
+#define CLIENT_ARENA_MIN_SIZE 65536
+
+// Receive all the messages that are pending right now (at max max of them), waiting
+// at max timeout milliseconds for the first one, the number of messages is stored in count
+// The strings in msgs aren't malloc-ated, they point into the arena instead and stay valid
+// until client_arena_reset, reset it after processing each batch so that the next one fits
+// Can return protlib error codes as well as client error codes
+// Disconnects whenever the return value isn't CLIENT_ERR_OK or CLIENT_ERR_NOREC, note that
+// the count messages received before the error are still valid in that case
+int client_receive_batch(struct client_msg* msgs, const size_t max, size_t* count, struct client_arena* arena, const unsigned int timeout);
+
+// Release all the strings stored in the arena at once, the memory is kept for the next batch
+void client_arena_reset(struct client_arena* arena);
+
+// Free the arena's memory
+void client_arena_free(struct client_arena* arena);
+
 // Initialise the backend, call this before using any other functions
 // Returns either OK or CLIENT_ERR_INIT
 int client_init();
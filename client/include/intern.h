@@ -0,0 +1,22 @@
+#pragma once
+
+// The server refers to users by numeric ids in messages and tells the clients which
+// nick belongs to which id, these tables keep track of it
+// Every distinct nick is stored only once and the strings never change, so they
+// can be handed out to the frontend and shared by any number of messages
+
+// Returns the interned copy of nick (allocating it when it's new) or NULL when out of memory
+const char* intern_nick(const char* nick);
+
+// Remember that the user id has the nick, a NULL nick forgets the id
+// Returns 0 on success or -1 when out of memory
+int intern_set_user(const unsigned long id, const char* nick);
+
+// Returns the interned nick of the user id or NULL if it's unknown
+const char* intern_get_user(const unsigned long id);
+
+// Returns the id of a user with the nick or 0 if there's nobody like that
+unsigned long intern_find_user(const char* nick);
+
+// Forget all the users and free all the interned nicks, they become invalid
+void intern_clear();
@@ -0,0 +1,52 @@
+#pragma once
+
+// A lock-free single-producer single-consumer queue of received messages
+// The background I/O thread pushes decoded frames and the frontend's thread pops them
+
+#include <SDL.h>
+
+#include "protocol.h"
+
+// The size of the ring buffer in bytes, the messages are stored in it
+// back to back, so this is the maximum amount of data waiting for the frontend
+#define CLIENT_QUEUE_SIZE 65536
+
+struct client_queue {
+    // The ring buffer itself, every entry is aligned to 4 bytes
+    char buf[CLIENT_QUEUE_SIZE];
+    // Byte offsets into buf, read is only written by the consumer
+    // and write only by the producer
+    SDL_atomic_t read;
+    SDL_atomic_t write;
+    // Counts the entries in the queue, used for waiting with a timeout
+    SDL_sem* pending;
+    // Set by the producer when the queue is full, the consumer then posts space once it releases an entry
+    SDL_atomic_t waiting;
+    SDL_sem* space;
+    // Set by queue_peek, the consumer already holds the entry at read
+    int peeked;
+};
+
+// Returns 0 on success, -1 when the semaphores couldn't be created
+int queue_init(struct client_queue* queue);
+
+void queue_destroy(struct client_queue* queue);
+
+// Throw away all entries, must only be called when no producer is running
+void queue_clear(struct client_queue* queue);
+
+// Producer: copy the message (or only the status if it's negative) into the queue
+// Returns 0 on success or -1 if there isn't enough space at the moment
+int queue_push(struct client_queue* queue, const struct prot_msg* msg);
+
+// Producer: after queue_push has failed, wait at max timeout milliseconds for the consumer
+// to release an entry (it might still not be enough space)
+void queue_wait_space(struct client_queue* queue, const unsigned int timeout);
+
+// Consumer: wait at max timeout milliseconds for an entry and return it in msg,
+// the arguments point directly into the queue and stay valid until queue_release
+// Returns 0 on success or -1 if the queue is still empty
+int queue_peek(struct client_queue* queue, struct prot_msg* msg, const unsigned int timeout);
+
+// Consumer: remove the entry returned by the last successful queue_peek
+void queue_release(struct client_queue* queue);
@@ -0,0 +1,179 @@
+#include "intern.h"
+
+#include <stdlib.h>
+#include <string.h>
+
+// Both tables are open addressing hash tables with linear probing,
+// their capacities are powers of two and they are kept at most half full
+#define INTERN_MIN_CAPACITY 32
+
+// The interned nicks, NULL marks an empty slot
+static struct {
+    char** slots;
+    size_t capacity;
+    size_t count;
+} nicks;
+
+// The users, id 0 marks an empty slot (the server numbers connections from 1)
+static struct {
+    struct user {
+        unsigned long id;
+        const char* nick;
+    }* slots;
+    size_t capacity;
+    size_t count;
+} users;
+
+// FNV-1a
+static size_t hash_string(const char* str) {
+    size_t hash = 2166136261u;
+    for (; *str; str++)
+        hash = (hash ^ (unsigned char)*str) * 16777619u;
+    return hash;
+}
+
+static size_t hash_id(const unsigned long id) {
+    return (size_t)(id * 2654435761u);
+}
+
+// Find the slot of nick, either the one containing it or the empty one where it belongs
+static size_t find_nick(char** slots, const size_t capacity, const char* nick) {
+    size_t i = hash_string(nick) & (capacity-1);
+    while (slots[i] != NULL && strcmp(slots[i], nick))
+        i = (i+1) & (capacity-1);
+    return i;
+}
+
+static size_t find_user(const struct user* slots, const size_t capacity, const unsigned long id) {
+    size_t i = hash_id(id) & (capacity-1);
+    while (slots[i].id != 0 && slots[i].id != id)
+        i = (i+1) & (capacity-1);
+    return i;
+}
+
+const char* intern_nick(const char* nick) {
+
+    if (nicks.capacity > 0) {
+        size_t i = find_nick(nicks.slots, nicks.capacity, nick);
+        if (nicks.slots[i] != NULL)
+            return nicks.slots[i];
+    }
+
+    // The nick is new, make sure that there's space for it
+    if ((nicks.count+1)*2 > nicks.capacity) {
+        size_t capacity = nicks.capacity ? nicks.capacity*2 : INTERN_MIN_CAPACITY;
+        char** slots = calloc(capacity, sizeof(char*));
+        if (!slots) return NULL;
+
+        for (size_t i = 0; i < nicks.capacity; i++)
+            if (nicks.slots[i] != NULL)
+                slots[find_nick(slots, capacity, nicks.slots[i])] = nicks.slots[i];
+
+        free(nicks.slots);
+        nicks.slots = slots;
+        nicks.capacity = capacity;
+    }
+
+    char* copy = strdup(nick);
+    if (!copy) return NULL;
+
+    nicks.slots[find_nick(nicks.slots, nicks.capacity, copy)] = copy;
+    nicks.count++;
+
+    return copy;
+}
+
+int intern_set_user(const unsigned long id, const char* nick) {
+
+    if (id == 0) return -1;
+
+    if (nick == NULL) {
+        if (users.capacity == 0) return 0;
+
+        size_t i = find_user(users.slots, users.capacity, id);
+        if (users.slots[i].id == 0) return 0;
+
+        // Remove the user and shift back the following ones that would
+        // become unreachable because of the new hole
+        users.slots[i].id = 0;
+        users.count--;
+
+        for (size_t j = (i+1) & (users.capacity-1); users.slots[j].id != 0; j = (j+1) & (users.capacity-1)) {
+            size_t home = hash_id(users.slots[j].id) & (users.capacity-1);
+
+            // Move it if its home slot isn't cyclically within (i, j]
+            if ((j > i && (home <= i || home > j)) || (j < i && (home <= i && home > j))) {
+                users.slots[i] = users.slots[j];
+                users.slots[j].id = 0;
+                i = j;
+            }
+        }
+
+        return 0;
+    }
+
+    const char* interned = intern_nick(nick);
+    if (!interned) return -1;
+
+    if ((users.count+1)*2 > users.capacity) {
+        size_t capacity = users.capacity ? users.capacity*2 : INTERN_MIN_CAPACITY;
+        struct user* slots = calloc(capacity, sizeof(struct user));
+        if (!slots) return -1;
+
+        for (size_t i = 0; i < users.capacity; i++)
+            if (users.slots[i].id != 0)
+                slots[find_user(slots, capacity, users.slots[i].id)] = users.slots[i];
+
+        free(users.slots);
+        users.slots = slots;
+        users.capacity = capacity;
+    }
+
+    size_t i = find_user(users.slots, users.capacity, id);
+    if (users.slots[i].id == 0) {
+        users.slots[i].id = id;
+        users.count++;
+    }
+    users.slots[i].nick = interned;
+
+    return 0;
+}
+
+const char* intern_get_user(const unsigned long id) {
+
+    if (users.capacity == 0 || id == 0) return NULL;
+
+    size_t i = find_user(users.slots, users.capacity, id);
+    return users.slots[i].id != 0 ? users.slots[i].nick : NULL;
+}
+
+unsigned long intern_find_user(const char* nick) {
+
+    if (nicks.capacity == 0) return 0;
+
+    const char* interned = nicks.slots[find_nick(nicks.slots, nicks.capacity, nick)];
+    if (!interned) return 0;
+
+    // The nicks are interned, so comparing the pointers is enough
+    for (size_t i = 0; i < users.capacity; i++)
+        if (users.slots[i].id != 0 && users.slots[i].nick == interned)
+            return users.slots[i].id;
+
+    return 0;
+}
+
+void intern_clear() {
+
+    for (size_t i = 0; i < nicks.capacity; i++)
+        free(nicks.slots[i]);
+
+    free(nicks.slots);
+    nicks.slots = NULL;
+    nicks.capacity = 0;
+    nicks.count = 0;
+
+    free(users.slots);
+    users.slots = NULL;
+    users.capacity = 0;
+    users.count = 0;
+}
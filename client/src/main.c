@@ -4,18 +4,481 @@
 #include <SDL_net.h>
 #include <string.h>
 
+#ifdef __linux__
+#include <sys/eventfd.h>
+#include <unistd.h>
+#endif
+
 #include "client.h"
+#include "intern.h"
+#include "messages.h"
 #include "protocol.h"
+#include "queue.h"
+#include "shm.h"
+
+// How often the I/O thread checks whether it should exit, in milliseconds
+#define CLIENT_IO_POLL_INTERVAL 50
+
+// The size of each of the two buffers of queued messages in the asynchronous sending mode,
+// and of the buffer that client_send_many uses to coalesce messages in the synchronous one
+#define CLIENT_SEND_QUEUE_SIZE 8192
+
+// The delay before the first reconnection attempt, it doubles with every failed attempt
+// up to the maximum, in milliseconds
+#define CLIENT_RECONNECT_MIN_DELAY 250
+#define CLIENT_RECONNECT_MAX_DELAY 8000
+// How long to wait for the server to accept a reconnection, in milliseconds
+#define CLIENT_RECONNECT_TIMEOUT 5000
+
+// The buffer that the bytes from the shared memory are decoded in, it
+// holds the biggest possible message with room to spare
+#define CLIENT_SHM_BUF_SIZE (2 * PROT_MAX_ARGS * PROT_MAX_ARG_SIZE)
+
+// The maximum number of file transfers going on at once, in both directions
+#define CLIENT_MAX_TRANSFERS 16
+
+// Heads of the messages that the I/O thread puts into the queue itself, they
+// are lowercase so that they can't be confused with the protocol's heads
+#define CLIENT_HEAD_RECONNECTING "rcn"
+#define CLIENT_HEAD_RECONNECTED "rcd"
+#define CLIENT_HEAD_RECONNECTING_ID PROT_HEAD_ID('r','c','n')
+#define CLIENT_HEAD_RECONNECTED_ID PROT_HEAD_ID('r','c','d')
 
 // The global TCP socket, either NULL or connected to a server
 static TCPsocket socket;
+// Receives the messages from the socket, by client_receive or by the I/O thread
+static struct prot_reader reader;
 // This socket set contains only our socket, it is used for non-blocking IO (polling)
 static SDLNet_SocketSet sset;
+// The address of the server, kept for reconnecting
+static IPaddress server_addr;
+// Set by client_set_compression
+static int compression;
 
-// Send a message to the server
-int client_send(const struct client_msg* msg) {
+// Held while writing to the socket and while the I/O thread replaces it
+static SDL_mutex* socket_lock;
+// Set while the I/O thread is reconnecting, the socket is NULL in the meantime
+static SDL_atomic_t reconnecting;
+// The number of reconnection attempts, 0 disables reconnecting, set by client_set_auto_reconnect
+static unsigned int reconnect_attempts;
 
-    struct prot_msg raw_msg;
+// The asynchronous mode, set by client_set_async
+static int async;
+static client_notify_fn notify;
+static void* notify_data;
+// An eventfd signalled along with notify, -1 if unavailable
+static int event_fd = -1;
+
+// The background I/O thread, only running while connected in the asynchronous mode
+static SDL_Thread* io_thread;
+// Set to tell the I/O thread to exit
+static SDL_atomic_t io_stop;
+// The last sequence number and nick that the I/O thread has received and the id of the
+// connection and the run of the server, used for resuming (the server starts the sequence numbers in ACC)
+static unsigned long last_seq;
+static char last_nick[SERV_MAX_NICK_LEN];
+static unsigned long last_id;
+static unsigned long last_run;
+// The messages received by the I/O thread, waiting for client_receive
+static struct client_queue queue;
+
+// When the server is on the same machine, the I/O thread asks it to send the messages
+// through shared memory, the socket is then only used for sending and noticing a lost connection
+// All of these belong to the I/O thread
+static struct prot_shm* shm;
+// Set once the server has switched to it
+static int shm_active;
+// The bytes read from the shared memory, [shm_start, shm_used) haven't been decoded yet
+static char shm_buf[CLIENT_SHM_BUF_SIZE];
+static size_t shm_start;
+static size_t shm_used;
+
+// The asynchronous sending, set by client_set_async_send
+static int async_send;
+static client_sent_fn sent;
+static void* sent_data;
+
+// The sending thread, only running while connected with asynchronous sending
+static SDL_Thread* send_thread;
+// Protects everything below
+static SDL_mutex* send_lock;
+// Signalled when there's something to send and whenever a write finishes
+static SDL_cond* send_cond;
+
+// Two buffers of encoded messages, the frontend appends to the pending one
+// while the sending thread writes out the other one
+static struct send_buffer {
+    char data[CLIENT_SEND_QUEUE_SIZE];
+    size_t used;
+    // The ids of the messages in the buffer, first_id to first_id+count-1,
+    // the library's own messages in between (see send_now) don't get any
+    unsigned long first_id;
+    size_t count;
+} send_buffers[2];
+static struct send_buffer* send_pending = &send_buffers[0];
+// The sending thread is writing at the moment
+static int send_busy;
+// Tells the sending thread to exit
+static int send_stop;
+// Set by the sending thread when a write fails, it's not protected by send_lock
+static SDL_atomic_t send_failed;
+
+// The file transfers, they only belong to the frontend's thread
+static struct transfer {
+    // The id that the frontend knows the transfer by, 0 marks an unused entry
+    unsigned long id;
+    // The id used in the messages, the server's one for the files we receive
+    unsigned long remote;
+    int outgoing;
+    unsigned long long size;
+    // The bytes sent (or received) so far and how many of them the recipient has acknowledged
+    unsigned long long done;
+    unsigned long long acked;
+    // Reads the file that we are sending
+    client_read_fn read;
+    void* read_data;
+} transfers[CLIENT_MAX_TRANSFERS];
+// The id of the last transfer that has been added
+static unsigned long last_transfer_id;
+
+// The users that are online, the server sends the whole list (ONL) and then the changes (PRS)
+// They only belong to the frontend's thread
+static struct client_user presence[SERV_MAX_CLIENTS];
+static size_t presence_count;
+// The version of the list, the next change has the version one higher
+static unsigned long presence_version;
+// Unset while waiting for the list
+static int presence_synced;
+
+// Let the frontend know that there are new messages in the queue
+static void signal_frontend() {
+#ifdef __linux__
+    if (event_fd >= 0)
+        (void)!write(event_fd, &(Uint64){1}, sizeof(Uint64));
+#endif
+    if (notify)
+        notify(notify_data);
+}
+
+// Reset the event fd once the frontend has taken everything out of the queue
+static void reset_event_fd() {
+#ifdef __linux__
+    if (event_fd < 0) return;
+
+    Uint64 value;
+    (void)!read(event_fd, &value, sizeof(value));
+
+    // A message might have arrived in the meantime, don't lose the wakeup
+    if (SDL_SemValue(queue.pending) > 0)
+        (void)!write(event_fd, &(Uint64){1}, sizeof(Uint64));
+#endif
+}
+
+// Reconnecting only works with the I/O thread
+static int reconnect_enabled() {
+    return async && reconnect_attempts > 0;
+}
+
+// Push a message into the queue, if it's full, wait for the frontend to catch up
+// Returns -1 if the I/O thread should exit in the meantime
+static int push_queued(const struct prot_msg* msg) {
+
+    while (queue_push(&queue, msg) < 0) {
+        if (SDL_AtomicGet(&io_stop)) return -1;
+
+        // Woken up as soon as the frontend releases a message, io_stop is checked in between
+        queue_wait_space(&queue, CLIENT_IO_POLL_INTERVAL);
+    }
+
+    return 0;
+}
+
+// Write len bytes to the socket unless the I/O thread is reconnecting at the moment
+// Returns CLIENT_ERR_OK, CLIENT_ERR_RECONNECTING or PROT_ERR_ERR
+static int write_socket(const char* buf, const size_t len) {
+
+    SDL_LockMutex(socket_lock);
+
+    int status = CLIENT_ERR_OK;
+    if (SDL_AtomicGet(&reconnecting))
+        status = CLIENT_ERR_RECONNECTING;
+    else if (SDLNet_TCP_Send(socket, buf, (int)len) != (int)len)
+        status = PROT_ERR_ERR;
+
+    SDL_UnlockMutex(socket_lock);
+
+    return status;
+}
+
+// Whether the server has listed the feature in the arguments of ACC
+static int has_feature(const struct prot_msg* accepted, const char* feature) {
+
+    if (accepted->status < 4)
+        return 0;
+
+    size_t len = strlen(feature);
+    for (const char* features = accepted->args[3]; *features; features += strcspn(features, " ")) {
+        features += strspn(features, " ");
+        if (strncmp(features, feature, len) == 0 && (features[len] == ' ' || features[len] == '\0'))
+            return 1;
+    }
+
+    return 0;
+}
+
+// Ask the server to compress the rest of the stream if it can, its answer (CMP) is
+// the last message that isn't compressed and the reader is switched right after it
+// Returns the same as prot_send, PROT_ERR_OK if it isn't asked for
+static int request_compression(TCPsocket sock, const struct prot_msg* accepted) {
+    if (compression && has_feature(accepted, SERV_FEATURE_COMPRESSION))
+        return prot_send(sock, prot_make_msg("CMP", 0));
+    return PROT_ERR_OK;
+}
+
+// Ask a server on the same machine for shared memory, the answer is handled by handle_shm
+static void request_shm() {
+
+    if (server_addr.host != SDL_SwapBE32(0x7F000001))
+        return;
+
+    char buf[PROT_HEAD_SIZE + 1];
+    int len = prot_encode(prot_make_msg("SHM", 0), buf, sizeof(buf));
+    if (len > 0)
+        write_socket(buf, (size_t)len);
+}
+
+static void close_shm() {
+    prot_shm_close(shm);
+    shm = NULL;
+    shm_active = 0;
+    shm_start = 0;
+    shm_used = 0;
+}
+
+// The server either offers a segment (with its name) or switches to it (without arguments)
+static void handle_shm(const struct prot_msg* msg) {
+
+    if (msg->status == 0) {
+        if (shm) shm_active = 1;
+        return;
+    }
+
+    // If we can't open it, the server just keeps using the socket
+    if (shm || NULL == (shm = prot_shm_open(msg->args[0])))
+        return;
+
+    char buf[PROT_HEAD_SIZE + PROT_SHM_NAME_LEN + 1];
+    int len = prot_encode(prot_make_msg("SHM", 1, msg->args[0]), buf, sizeof(buf));
+    if (len < 0 || write_socket(buf, (size_t)len) != CLIENT_ERR_OK)
+        close_shm();
+}
+
+// Decode the next message from the shared memory, the arguments point into shm_buf
+// and stay valid until the next call
+// Returns 1 with a message, 0 if there isn't any at the moment and -1 if the server has
+// closed the shared memory or sent something invalid
+static int next_shm_msg(struct prot_msg* msg) {
+
+    while (1) {
+        int len = prot_decode(&shm_buf[shm_start], shm_used - shm_start, msg);
+        if (len < 0)
+            return -1;
+        if (len > 0) {
+            shm_start += (size_t)len;
+            return 1;
+        }
+
+        // Keep the incomplete message and read the rest
+        memmove(shm_buf, &shm_buf[shm_start], shm_used - shm_start);
+        shm_used -= shm_start;
+        shm_start = 0;
+
+        size_t read = prot_shm_read(shm, &shm_buf[shm_used], sizeof(shm_buf) - shm_used);
+        if (read == 0)
+            return prot_shm_closed(shm) ? -1 : 0;
+        shm_used += read;
+    }
+}
+
+// Try to connect to the server again after the connection has been lost and resume the session,
+// the frontend is told about it with the two synthetic messages
+// Returns 0 on success or -1 when giving up or when the I/O thread should exit
+static int reconnect() {
+
+    // Nobody writes to the socket from now on
+    SDL_LockMutex(socket_lock);
+    SDL_AtomicSet(&reconnecting, 1);
+    SDLNet_TCP_DelSocket(sset, socket);
+    SDLNet_TCP_Close(socket);
+    socket = NULL;
+    SDL_UnlockMutex(socket_lock);
+
+    // The server gives the new connection a new segment
+    close_shm();
+
+    if (push_queued(&(struct prot_msg){ .status = 0, .head = CLIENT_HEAD_RECONNECTING }) < 0)
+        return -1;
+    signal_frontend();
+
+    Uint32 delay = CLIENT_RECONNECT_MIN_DELAY;
+    for (unsigned int attempt = 0; attempt < reconnect_attempts; attempt++) {
+
+        // Wait before every attempt, but keep checking whether we should exit
+        for (Uint32 waited = 0; waited < delay; waited += CLIENT_IO_POLL_INTERVAL) {
+            if (SDL_AtomicGet(&io_stop)) return -1;
+            SDL_Delay(CLIENT_IO_POLL_INTERVAL);
+        }
+        delay = delay * 2 < CLIENT_RECONNECT_MAX_DELAY ? delay * 2 : CLIENT_RECONNECT_MAX_DELAY;
+
+        TCPsocket new_socket = SDLNet_TCP_Open(&server_addr);
+        if (!new_socket)
+            continue;
+
+        if (SDLNet_TCP_AddSocket(sset, new_socket) < 0) {
+            SDLNet_TCP_Close(new_socket);
+            continue;
+        }
+
+        // The server accepts the connection first and then we resume the session with
+        // the last sequence number we have seen, the server sends us what we've missed
+        // except for what we have sent ourselves through the previous connection
+        // The compression is asked for before, so that all of that is compressed already
+        struct prot_msg msg;
+        char seq[24], id[24], run[24];
+        snprintf(seq, sizeof(seq), "%lu", last_seq);
+        snprintf(id, sizeof(id), "%lu", last_id);
+        snprintf(run, sizeof(run), "%lu", last_run);
+
+        prot_reader_reset(&reader, new_socket);
+
+        if (SDLNet_CheckSockets(sset, CLIENT_RECONNECT_TIMEOUT) <= 0 ||
+            (msg = prot_read(&reader)).status < 0 ||
+            prot_head_id(msg.head) != SERV_ACC_OUT ||
+            request_compression(new_socket, &msg) < 0 ||
+            prot_send(new_socket, prot_make_msg("RES", 4, seq, id, run, last_nick[0] ? last_nick : "Anonymous")) < 0) {
+
+            SDLNet_TCP_DelSocket(sset, new_socket);
+            SDLNet_TCP_Close(new_socket);
+            continue;
+        }
+
+        // The arguments of ACC are still in the reader
+        last_id = strtoul(msg.args[1], NULL, 10);
+        last_run = strtoul(msg.args[2], NULL, 10);
+
+        SDL_LockMutex(socket_lock);
+        socket = new_socket;
+        SDL_AtomicSet(&reconnecting, 0);
+        SDL_UnlockMutex(socket_lock);
+
+        if (push_queued(&(struct prot_msg){ .status = 0, .head = CLIENT_HEAD_RECONNECTED }) < 0)
+            return -1;
+        signal_frontend();
+
+        request_shm();
+        return 0;
+    }
+
+    return -1;
+}
+
+// The I/O thread receives messages as soon as they arrive and pushes them into the queue
+// An error is pushed into the queue as well (unless we manage to reconnect), the thread exits right after it
+static int io_thread_main(void* data) {
+    (void)data;
+
+    request_shm();
+
+    while (!SDL_AtomicGet(&io_stop)) {
+
+        // With shared memory, the socket only becomes readable when the connection is lost
+        if (shm_active) {
+            if (!prot_shm_wait(shm, CLIENT_IO_POLL_INTERVAL) && SDLNet_CheckSockets(sset, 0) <= 0)
+                continue;
+        } else if (!prot_reader_ready(&reader) && SDLNet_CheckSockets(sset, CLIENT_IO_POLL_INTERVAL) <= 0)
+            continue;
+
+        // Receive everything that's available right now and only then wake the frontend up once
+        do {
+            struct prot_msg msg;
+            int from_shm = shm_active ? next_shm_msg(&msg) : 0;
+
+            if (from_shm < 0)
+                msg.status = PROT_ERR_ERR;
+            else if (from_shm == 0) {
+                if (shm_active && !prot_reader_ready(&reader) && SDLNet_CheckSockets(sset, 0) <= 0)
+                    break;
+                msg = prot_read(&reader);
+            }
+
+            // Everything after it comes in compressed blocks
+            if (msg.status >= 0 && prot_head_id(msg.head) == SERV_CMP_OUT) {
+                if (prot_reader_compress(&reader) == PROT_ERR_OK)
+                    continue;
+                msg.status = PROT_ERR_ERR;
+            }
+
+            if (msg.status < 0 && reconnect_enabled()) {
+                if (reconnect() == 0)
+                    break;
+                if (SDL_AtomicGet(&io_stop))
+                    return 0;
+            }
+
+            if (msg.status >= 0 && prot_head_id(msg.head) == SERV_SHM_OUT) {
+                handle_shm(&msg);
+                continue;
+            }
+
+            // Remember where we are in case we have to resume
+            if (msg.status >= 0 && prot_head_id(msg.head) == SERV_MSG_OUT)
+                last_seq = strtoul(msg.args[0], NULL, 10);
+            else if (msg.status >= 0 && prot_head_id(msg.head) == SERV_NIC_OUT)
+                snprintf(last_nick, sizeof(last_nick), "%s", msg.args[0]);
+
+            if (push_queued(&msg) < 0)
+                return 0;
+
+            if (msg.status < 0) {
+                signal_frontend();
+                return 0;
+            }
+        } while (shm_active || prot_reader_ready(&reader) || SDLNet_CheckSockets(sset, 0) > 0);
+
+        signal_frontend();
+    }
+
+    return 0;
+}
+
+// Reallocate the arguments of the message so that the result is the same as with prot_recv
+static void dup_args(struct prot_msg* msg) {
+    for (size_t i = 0; i < (size_t)(msg->status > 0 ? msg->status : 0); i++)
+        if ( NULL == (msg->args[i] = strdup(msg->args[i])) ) {
+            while (i-- > 0) free(msg->args[i]);
+            msg->status = PROT_ERR_ERR;
+            break;
+        }
+}
+
+// Take the next message out of the queue, with reallocated arguments
+static struct prot_msg receive_queued(const unsigned int timeout) {
+
+    struct prot_msg msg;
+    if (queue_peek(&queue, &msg, timeout) < 0) {
+        reset_event_fd();
+        msg.status = CLIENT_ERR_NOREC;
+        return msg;
+    }
+
+    dup_args(&msg);
+
+    queue_release(&queue);
+    return msg;
+}
+
+// Make a raw message out of msg, checking its validity
+static int encode_msg(const struct client_msg* msg, struct prot_msg* raw_msg) {
 
     switch (msg->type) {
         case CLIENT_MSG_MSG:
@@ -23,87 +486,852 @@ int client_send(const struct client_msg* msg) {
             if (strlen(msg->u.send.msg.text)+1 > SERV_MAX_MSG_LEN)
                 return CLIENT_ERR_INVALID_MSG;
 
-            raw_msg = prot_make_msg("MSG", 1, msg->u.send.msg.text);
+            *raw_msg = prot_make_msg("MSG", 1, msg->u.send.msg.text);
         break;
         case CLIENT_MSG_NICK:
 
             if (strlen(msg->u.send.nick.newnick)+1 > SERV_MAX_NICK_LEN)
                 return CLIENT_ERR_INVALID_MSG;
 
-            raw_msg = prot_make_msg("NIC", 1, msg->u.send.nick.newnick);
+            *raw_msg = prot_make_msg("NIC", 1, msg->u.send.nick.newnick);
         break;
         default:
             return CLIENT_ERR_INVALID_MSG;
         break;
     }
 
-    int status = prot_send(socket, raw_msg);
-    if (status < 0)
-        client_disconnect();
+    return CLIENT_ERR_OK;
+}
+
+// Append an encoded message to the pending send buffer, send_lock has to be locked
+// Only the frontend's messages are counted, they get an id
+static int queue_send(const struct prot_msg raw_msg, const int counted) {
+
+    int len = prot_encode(raw_msg, &send_pending->data[send_pending->used], CLIENT_SEND_QUEUE_SIZE - send_pending->used);
+    if (len < 0)
+        return CLIENT_ERR_QUEUE_FULL;
+
+    send_pending->used += (size_t)len;
+    if (counted)
+        send_pending->count++;
+
+    return CLIENT_ERR_OK;
+}
+
+// The sending thread writes everything that has been queued since its last write at once
+// A failed write fails all the following messages as well, the frontend is told
+// about it by client_send, which disconnects (unless reconnecting is enabled)
+static int send_thread_main(void* data) {
+    (void)data;
+
+    SDL_LockMutex(send_lock);
+
+    while (1) {
+
+        while (send_pending->used == 0 && !send_stop)
+            SDL_CondWait(send_cond, send_lock);
+
+        if (send_stop)
+            break;
+
+        // Take the pending buffer and let the frontend fill the other one in the meantime
+        struct send_buffer* batch = send_pending;
+        send_pending = batch == &send_buffers[0] ? &send_buffers[1] : &send_buffers[0];
+        send_pending->used = 0;
+        send_pending->count = 0;
+        send_pending->first_id = batch->first_id + batch->count;
+        send_busy = 1;
+
+        SDL_UnlockMutex(send_lock);
+
+        int status = SDL_AtomicGet(&send_failed) ? PROT_ERR_ERR : write_socket(batch->data, batch->used);
+
+        // While reconnecting, hold on to the batch and send it afterwards
+        while (status == CLIENT_ERR_RECONNECTING) {
+            SDL_Delay(CLIENT_IO_POLL_INTERVAL);
+
+            SDL_LockMutex(send_lock);
+            int stop = send_stop;
+            SDL_UnlockMutex(send_lock);
+
+            status = stop ? PROT_ERR_ERR : write_socket(batch->data, batch->used);
+        }
+
+        // When reconnecting is enabled, only this batch is lost, the I/O thread takes care of the rest
+        if (status != CLIENT_ERR_OK && !reconnect_enabled())
+            SDL_AtomicSet(&send_failed, 1);
+
+        if (sent)
+            for (size_t i = 0; i < batch->count; i++)
+                sent(sent_data, batch->first_id + i, status);
+
+        SDL_LockMutex(send_lock);
+        send_busy = 0;
+        SDL_CondBroadcast(send_cond);
+    }
+
+    // Whatever is still waiting won't be sent anymore
+    if (sent)
+        for (size_t i = 0; i < send_pending->count; i++)
+            sent(sent_data, send_pending->first_id + i, PROT_ERR_ERR);
+    send_pending->used = 0;
+    send_pending->count = 0;
+
+    SDL_UnlockMutex(send_lock);
+
+    return 0;
+}
+
+// Send a message to the server
+int client_send(const struct client_msg* msg) {
+    size_t sent_count;
+    return client_send_many(msg, 1, &sent_count);
+}
+
+// Send or queue up count messages, in the synchronous mode, as many of them
+// as possible are sent with one write
+int client_send_many(const struct client_msg* msgs, const size_t count, size_t* sent_count) {
+
+    *sent_count = 0;
+
+    struct prot_msg raw_msg;
+    int status = CLIENT_ERR_OK;
+
+    if (send_thread) {
+
+        // A previous write has failed
+        if (SDL_AtomicGet(&send_failed)) {
+            client_disconnect();
+            return PROT_ERR_ERR;
+        }
+
+        SDL_LockMutex(send_lock);
+
+        for (size_t i = 0; i < count; i++) {
+            if ((status = encode_msg(&msgs[i], &raw_msg)) != CLIENT_ERR_OK) break;
+            if ((status = queue_send(raw_msg, 1)) != CLIENT_ERR_OK) break;
+            (*sent_count)++;
+        }
+
+        if (*sent_count > 0)
+            SDL_CondSignal(send_cond);
+
+        SDL_UnlockMutex(send_lock);
+
+        return status;
+    }
+
+    char buf[CLIENT_SEND_QUEUE_SIZE];
+    size_t used = 0;
+    // The number of messages in buf
+    size_t buffered = 0;
+
+    for (size_t i = 0; i <= count; i++) {
+
+        int len = -1;
+        if (i < count) {
+            if ((status = encode_msg(&msgs[i], &raw_msg)) != CLIENT_ERR_OK) break;
+            len = prot_encode(raw_msg, &buf[used], sizeof(buf) - used);
+        }
+
+        // Send the buffer once it's full or when we're done
+        if (len < 0 && buffered > 0) {
+            if ((status = write_socket(buf, used)) != CLIENT_ERR_OK)
+                goto err;
+
+            *sent_count += buffered;
+            used = 0;
+            buffered = 0;
+
+            if (i < count)
+                len = prot_encode(raw_msg, buf, sizeof(buf));
+        }
+
+        if (i < count) {
+            if (len < 0) {
+                status = CLIENT_ERR_INVALID_MSG;
+                break;
+            }
+
+            used += (size_t)len;
+            buffered++;
+        }
+    }
+
+    // Messages that were encoded before an invalid one are still sent
+    if (buffered > 0) {
+        int write_status = write_socket(buf, used);
+        if (write_status != CLIENT_ERR_OK) {
+            status = write_status;
+            goto err;
+        }
+        *sent_count += buffered;
+    }
 
     return status;
+
+    err:
+
+    // The I/O thread is going to reconnect, the frontend can try again later
+    if (status == CLIENT_ERR_RECONNECTING || reconnect_enabled())
+        return CLIENT_ERR_RECONNECTING;
+
+    client_disconnect();
+    return status;
 }
 
-// Wait for max timeout milliseconds when waiting for data to arrive
-//TODO: this function doesn't check for validity of the input other than
-// the number of arguments (for example length)
-int client_receive(struct client_msg* msg, const unsigned int timeout) {
+unsigned long client_next_send_id() {
+
+    if (!send_thread)
+        return 0;
+
+    SDL_LockMutex(send_lock);
+    unsigned long id = send_pending->first_id + send_pending->count;
+    SDL_UnlockMutex(send_lock);
 
-    // This call is non-blocking, thus if there is no new activity, return immediately after timeout milliseconds
-    if (SDLNet_CheckSockets(sset, timeout) <= 0)
-        return CLIENT_ERR_NOREC;
+    return id;
+}
+
+int client_flush(const unsigned int timeout) {
+
+    if (!send_thread)
+        return CLIENT_ERR_OK;
+
+    Uint32 start = SDL_GetTicks();
 
-    struct prot_msg raw_msg = prot_recv(socket);
-    if (raw_msg.status < 0) {
+    SDL_LockMutex(send_lock);
+    while ((send_pending->used > 0 || send_busy) && SDL_GetTicks() - start < timeout)
+        SDL_CondWaitTimeout(send_cond, send_lock, timeout - (SDL_GetTicks() - start));
+    int status = send_pending->used > 0 || send_busy ? CLIENT_ERR_QUEUE_FULL : CLIENT_ERR_OK;
+    SDL_UnlockMutex(send_lock);
+
+    if (SDL_AtomicGet(&send_failed)) {
         client_disconnect();
-        return raw_msg.status;
+        return PROT_ERR_ERR;
     }
 
-    int ret;
-    if (!strncmp(raw_msg.head, "MSG", PROT_HEAD_SIZE)) {
-        if (raw_msg.status != 2) {
-            ret = CLIENT_ERR_ARGCOUNT;
-            goto err;
+    return status;
+}
+
+// Encode and send a message of the library itself (the file transfers), in the asynchronous
+// sending mode it's queued behind the frontend's messages without an id, waiting for space
+// if it has to, the transfers are paced by the acknowledgements anyway
+// Returns CLIENT_ERR_OK, CLIENT_ERR_INVALID_MSG, CLIENT_ERR_RECONNECTING or PROT_ERR_ERR
+static int send_now(const struct prot_msg raw_msg) {
+
+    if (send_thread) {
+        if (SDL_AtomicGet(&send_failed))
+            return PROT_ERR_ERR;
+
+        SDL_LockMutex(send_lock);
+
+        int status;
+        while ((status = queue_send(raw_msg, 0)) == CLIENT_ERR_QUEUE_FULL) {
+            // It doesn't even fit into an empty buffer
+            if (send_pending->used == 0) {
+                status = CLIENT_ERR_INVALID_MSG;
+                break;
+            }
+            if (SDL_AtomicGet(&send_failed) || send_stop) {
+                status = PROT_ERR_ERR;
+                break;
+            }
+            if (SDL_AtomicGet(&reconnecting)) {
+                status = CLIENT_ERR_RECONNECTING;
+                break;
+            }
+
+            // Every finished write is signalled
+            SDL_CondWait(send_cond, send_lock);
         }
 
-        msg->type = CLIENT_MSG_MSG;
-        msg->u.rec.msg.sender = raw_msg.args[0];
-        msg->u.rec.msg.text = raw_msg.args[1];
-    } else if (!strncmp(raw_msg.head, "NIC", PROT_HEAD_SIZE)) {
-        if (raw_msg.status != 1) {
-            ret = CLIENT_ERR_ARGCOUNT;
-            goto err;
+        if (status == CLIENT_ERR_OK)
+            SDL_CondBroadcast(send_cond);
+
+        SDL_UnlockMutex(send_lock);
+        return status;
+    }
+
+    char buf[PROT_HEAD_SIZE + 2*SERV_MAX_NUM_LEN + SERV_MAX_CHUNK_LEN + 1];
+    int len = prot_encode(raw_msg, buf, sizeof(buf));
+    if (len < 0)
+        return CLIENT_ERR_INVALID_MSG;
+
+    return write_socket(buf, (size_t)len);
+}
+
+// Turn the status of send_now into what the client functions return, just like client_send_many does
+static int sent_status(const int status) {
+
+    if (status == CLIENT_ERR_OK || status == CLIENT_ERR_INVALID_MSG)
+        return status;
+
+    if (status == CLIENT_ERR_RECONNECTING || reconnect_enabled())
+        return CLIENT_ERR_RECONNECTING;
+
+    client_disconnect();
+    return status;
+}
+
+static struct transfer* find_transfer(const unsigned long id) {
+    for (size_t i = 0; i < CLIENT_MAX_TRANSFERS; i++)
+        if (id != 0 && transfers[i].id == id)
+            return &transfers[i];
+    return NULL;
+}
+
+// Find a transfer by the id that the messages use
+static struct transfer* find_remote_transfer(const unsigned long remote, const int outgoing) {
+    for (size_t i = 0; i < CLIENT_MAX_TRANSFERS; i++)
+        if (transfers[i].id != 0 && transfers[i].remote == remote && transfers[i].outgoing == outgoing)
+            return &transfers[i];
+    return NULL;
+}
+
+// Returns the new transfer or NULL if there are too many of them,
+// the outgoing ones use their own id in the messages
+static struct transfer* add_transfer(const unsigned long remote, const int outgoing, const unsigned long long size) {
+    for (size_t i = 0; i < CLIENT_MAX_TRANSFERS; i++)
+        if (transfers[i].id == 0) {
+            transfers[i] = (struct transfer){ .id = ++last_transfer_id, .outgoing = outgoing, .size = size };
+            transfers[i].remote = outgoing ? transfers[i].id : remote;
+            return &transfers[i];
         }
+    return NULL;
+}
 
-        msg->type = CLIENT_MSG_NICK;
-        msg->u.rec.nick.newnick = raw_msg.args[0]; 
-    } else if (!strncmp(raw_msg.head, "ACC", PROT_HEAD_SIZE)) {
-        if (raw_msg.status != 0) {
-            ret = CLIENT_ERR_ARGCOUNT;
-            goto err;
+static void remove_transfer(struct transfer* transfer) {
+    transfer->id = 0;
+}
+
+// Tell the other side that the transfer won't go on and forget it, the sender
+// cancels it with CHK and the recipient with ACK, both without the number of bytes
+static int cancel_transfer(struct transfer* transfer) {
+
+    char remote[24];
+    snprintf(remote, sizeof(remote), "%lu", transfer->remote);
+    remove_transfer(transfer);
+
+    return send_now(prot_make_msg(transfer->outgoing ? "CHK" : "ACK", 1, remote));
+}
+
+// Send the next chunks of an outgoing file until a whole window of them is on its way
+// Returns the same as send_now
+static int send_chunks(struct transfer* transfer) {
+
+    char remote[24];
+    snprintf(remote, sizeof(remote), "%lu", transfer->remote);
+
+    while (transfer->done < transfer->size && transfer->done - transfer->acked < SERV_TRANSFER_WINDOW) {
+
+        char data[SERV_CHUNK_LEN];
+        char escaped[SERV_MAX_CHUNK_LEN];
+        char offset[24];
+
+        size_t len = transfer->size - transfer->done < SERV_CHUNK_LEN ? (size_t)(transfer->size - transfer->done) : SERV_CHUNK_LEN;
+        if (transfer->read(transfer->read_data, transfer->id, transfer->done, data, len) < 0)
+            return cancel_transfer(transfer);
+
+        prot_escape(data, len, escaped);
+        snprintf(offset, sizeof(offset), "%llu", transfer->done);
+
+        int status = send_now(prot_make_msg("CHK", 3, remote, offset, escaped));
+        if (status != CLIENT_ERR_OK)
+            return status;
+
+        transfer->done += len;
+    }
+
+    return CLIENT_ERR_OK;
+}
+
+// The nick of the user with the id in the message, or "#id" when we don't know it
+// Returns NULL when out of memory
+static const char* user_nick(const char* id_str) {
+
+    unsigned long id = strtoul(id_str, NULL, 10);
+
+    const char* nick = intern_get_user(id);
+    if (!nick) {
+        char unknown[24];
+        snprintf(unknown, sizeof(unknown), "#%lu", id);
+        nick = intern_nick(unknown);
+    }
+
+    return nick;
+}
+
+// Replace the users with the lines of "id nick" in list (NULL if there's nobody)
+// Returns 0 on success or -1 when out of memory
+static int set_presence(char* list) {
+
+    presence_count = 0;
+
+    while (list && *list && presence_count < SERV_MAX_CLIENTS) {
+
+        char* end = strchr(list, '\n');
+        if (!end) break;
+        *end = '\0';
+
+        char* nick;
+        unsigned long id = strtoul(list, &nick, 10);
+        if (id != 0 && *nick == ' ') {
+            if (intern_set_user(id, nick+1) < 0)
+                return -1;
+            presence[presence_count++] = (struct client_user){ id, intern_get_user(id) };
         }
 
-        msg->type = CLIENT_MSG_ACCEPTED;
-    } else if (!strncmp(raw_msg.head, "REF", PROT_HEAD_SIZE)) {
-        if (raw_msg.status != 0) {
-            ret = CLIENT_ERR_ARGCOUNT;
-            goto err;
+        list = end+1;
+    }
+
+    return 0;
+}
+
+// Fill msg from a received raw message, the strings point to the raw arguments
+// (except for the sender, which is interned)
+// Returns CLIENT_ERR_NOREC for messages that are only meant for the library
+// and for the ones that this client doesn't know about
+static int decode_msg(const struct prot_msg* raw_msg, struct client_msg* msg) {
+
+    // protlib has already checked the number of arguments and their lengths (see messages.h)
+    switch (prot_head_id(raw_msg->head)) {
+        case SERV_MSG_OUT: {
+
+            msg->type = CLIENT_MSG_MSG;
+            msg->u.rec.msg.seq = strtoul(raw_msg->args[0], NULL, 10);
+            msg->u.rec.msg.text = raw_msg->args[2];
+
+            // The sender is just an id, the server has told us its nick before
+            if ( NULL == (msg->u.rec.msg.sender = user_nick(raw_msg->args[1])) )
+                return PROT_ERR_ERR;
+        } break;
+        case SERV_OFR_OUT: {
+
+            // Args: the transfer, the sender's id, the file name, the file size
+            struct transfer* transfer = add_transfer(strtoul(raw_msg->args[0], NULL, 10), 0, strtoull(raw_msg->args[3], NULL, 10));
+            if (!transfer) {
+                // Too many transfers, decline it
+                int status = send_now(prot_make_msg("ACK", 1, raw_msg->args[0]));
+                return status < 0 && !reconnect_enabled() ? status : CLIENT_ERR_NOREC;
+            }
+
+            msg->type = CLIENT_MSG_OFFER;
+            msg->u.rec.offer.id = transfer->id;
+            msg->u.rec.offer.name = raw_msg->args[2];
+            msg->u.rec.offer.size = transfer->size;
+            if ( NULL == (msg->u.rec.offer.sender = user_nick(raw_msg->args[1])) )
+                return PROT_ERR_ERR;
+        } break;
+        case SERV_CHK_OUT: {
+
+            // Args: the transfer, the position of the chunk, the escaped chunk
+            // or only the transfer when the sender has cancelled it
+            struct transfer* transfer = find_remote_transfer(strtoul(raw_msg->args[0], NULL, 10), 0);
+            if (!transfer)
+                return CLIENT_ERR_NOREC;
+
+            msg->type = CLIENT_MSG_TRANSFER_END;
+            msg->u.rec.transfer.id = transfer->id;
+            msg->u.rec.transfer.complete = 0;
+
+            if (raw_msg->status == 1) {
+                remove_transfer(transfer);
+                break;
+            }
+
+            // The chunks have to follow each other and fit into the file
+            unsigned long long offset = raw_msg->status == 3 ? strtoull(raw_msg->args[1], NULL, 10) : 0;
+            long len = raw_msg->status == 3 ? prot_unescape(raw_msg->args[2]) : -1;
+            if (len <= 0 || offset != transfer->done || (unsigned long long)len > transfer->size - transfer->done) {
+                int status = cancel_transfer(transfer);
+                if (status < 0 && !reconnect_enabled())
+                    return status;
+                break;
+            }
+
+            transfer->done += (unsigned long long)len;
+
+            msg->type = CLIENT_MSG_CHUNK;
+            msg->u.rec.chunk.id = transfer->id;
+            msg->u.rec.chunk.offset = offset;
+            msg->u.rec.chunk.data = raw_msg->args[2];
+            msg->u.rec.chunk.len = (size_t)len;
+
+            // Acknowledging every half a window lets the sender go on without waiting for each chunk
+            if (transfer->done == transfer->size || transfer->done - transfer->acked >= SERV_TRANSFER_WINDOW/2) {
+                char done[24];
+                snprintf(done, sizeof(done), "%llu", transfer->done);
+                transfer->acked = transfer->done;
+
+                int status = send_now(prot_make_msg("ACK", 2, raw_msg->args[0], done));
+                if (status < 0 && !reconnect_enabled())
+                    return status;
+            }
+
+            if (transfer->done == transfer->size)
+                remove_transfer(transfer);
+        } break;
+        case SERV_ACK_OUT: {
+
+            // Args: our transfer, the number of bytes that the recipient has
+            // or only the transfer when the recipient has declined or cancelled it
+            struct transfer* transfer = find_remote_transfer(strtoul(raw_msg->args[0], NULL, 10), 1);
+            if (!transfer)
+                return CLIENT_ERR_NOREC;
+
+            unsigned long long acked = raw_msg->status == 2 ? strtoull(raw_msg->args[1], NULL, 10) : 0;
+
+            if (raw_msg->status == 1 || acked == transfer->size) {
+                msg->type = CLIENT_MSG_TRANSFER_END;
+                msg->u.rec.transfer.id = transfer->id;
+                msg->u.rec.transfer.complete = raw_msg->status == 2;
+                remove_transfer(transfer);
+                break;
+            }
+
+            // It can't have more than we've sent, otherwise the next chunks can go
+            int status;
+            if (acked < transfer->acked || acked > transfer->done)
+                status = cancel_transfer(transfer);
+            else {
+                transfer->acked = acked;
+                status = send_chunks(transfer);
+            }
+
+            return status < 0 && !reconnect_enabled() ? status : CLIENT_ERR_NOREC;
         }
+        case SERV_USR_OUT:
+
+            // A user has a new nick or is gone
+            if (intern_set_user(strtoul(raw_msg->args[0], NULL, 10), raw_msg->status == 2 ? raw_msg->args[1] : NULL) < 0)
+                return PROT_ERR_ERR;
+
+            return CLIENT_ERR_NOREC;
+        case SERV_ONL_OUT:
+
+            // Args: the version, the list of users (unless there's nobody)
+            if (set_presence(raw_msg->status == 2 ? raw_msg->args[1] : NULL) < 0)
+                return PROT_ERR_ERR;
+
+            presence_version = strtoul(raw_msg->args[0], NULL, 10);
+            presence_synced = 1;
+
+            msg->type = CLIENT_MSG_PRESENCE;
+            msg->u.rec.presence.id = 0;
+            msg->u.rec.presence.nick = NULL;
+            msg->u.rec.presence.version = presence_version;
+        break;
+        case SERV_PRS_OUT: {
+
+            // Args: the version, the user's id, the nick unless the user is gone
+            unsigned long version = strtoul(raw_msg->args[0], NULL, 10);
+            unsigned long id = strtoul(raw_msg->args[1], NULL, 10);
+
+            // The list that we're waiting for (or have) already contains it
+            if (!presence_synced || version <= presence_version)
+                return CLIENT_ERR_NOREC;
+
+            // A change has got lost, ask for the whole list again
+            if (version != presence_version+1) {
+                presence_synced = 0;
+                int status = send_now(prot_make_msg("ONL", 0));
+                return status < 0 && !reconnect_enabled() ? status : CLIENT_ERR_NOREC;
+            }
+            presence_version = version;
+
+            if (intern_set_user(id, raw_msg->status == 3 ? raw_msg->args[2] : NULL) < 0)
+                return PROT_ERR_ERR;
+
+            size_t i = 0;
+            while (i < presence_count && presence[i].id != id) i++;
+
+            if (raw_msg->status == 3) {
+                if (i < SERV_MAX_CLIENTS) {
+                    presence[i] = (struct client_user){ id, intern_get_user(id) };
+                    if (i == presence_count) presence_count++;
+                }
+            } else if (i < presence_count)
+                presence[i] = presence[--presence_count];
+
+            msg->type = CLIENT_MSG_PRESENCE;
+            msg->u.rec.presence.id = id;
+            msg->u.rec.presence.nick = raw_msg->status == 3 ? intern_get_user(id) : NULL;
+            msg->u.rec.presence.version = version;
+        } break;
+        case SERV_NIC_OUT:
+
+            msg->type = CLIENT_MSG_NICK;
+            msg->u.rec.nick.newnick = raw_msg->args[0];
+        break;
+        case SERV_ACC_OUT:
+
+            // It's only received like this right after connecting, before the I/O thread starts
+            // Args: the sequence number of the last message sent before we joined, our id, the run, the features
+            last_seq = strtoul(raw_msg->args[0], NULL, 10);
+            last_id = strtoul(raw_msg->args[1], NULL, 10);
+            last_run = strtoul(raw_msg->args[2], NULL, 10);
+
+            // The session starts with the list of users, after the compression has been asked for
+            if (request_compression(socket, raw_msg) < 0 || prot_send(socket, prot_make_msg("ONL", 0)) < 0)
+                return PROT_ERR_ERR;
+            msg->type = CLIENT_MSG_ACCEPTED;
+        break;
+        case SERV_CMP_OUT:
+
+            // Without the I/O thread, everything after it comes in compressed blocks from now on
+            if (prot_reader_compress(&reader) < 0)
+                return PROT_ERR_ERR;
+            return CLIENT_ERR_NOREC;
+        case SERV_REF_OUT:
+
+            msg->type = CLIENT_MSG_REFUSED;
+        break;
+        case CLIENT_HEAD_RECONNECTING_ID:
+
+            if (!io_thread) return CLIENT_ERR_NOREC;
+            msg->type = CLIENT_MSG_RECONNECTING;
+
+            // The server has cancelled them with the old connection
+            memset(transfers, 0, sizeof(transfers));
+        break;
+        case CLIENT_HEAD_RECONNECTED_ID:
 
-        msg->type = CLIENT_MSG_REFUSED;
+            if (!io_thread) return CLIENT_ERR_NOREC;
+            msg->type = CLIENT_MSG_RECONNECTED;
+        break;
+        default:
+            return CLIENT_ERR_NOREC;
     }
 
     return CLIENT_ERR_OK;
+}
 
-    err:
+unsigned long client_find_user(const char* nick) {
+    return intern_find_user(nick);
+}
+
+size_t client_get_users(struct client_user* users, const size_t max) {
+    memcpy(users, presence, (presence_count < max ? presence_count : max) * sizeof(*users));
+    return presence_count;
+}
 
-    // When an error occurs, free the arguments
-    for (size_t i = 0; i < (size_t)raw_msg.status; i++) 
-        free(raw_msg.args[i]);
+int client_offer_file(const unsigned long user, const char* name, const unsigned long long size,
+                      client_read_fn read, void* data, unsigned long* id) {
 
-    client_disconnect();
+    if (strlen(name) == 0 || strlen(name)+1 > SERV_MAX_FILE_NAME_LEN || size == 0 || !read)
+        return CLIENT_ERR_INVALID_MSG;
+
+    struct transfer* transfer = add_transfer(0, 1, size);
+    if (!transfer)
+        return CLIENT_ERR_QUEUE_FULL;
+
+    transfer->read = read;
+    transfer->read_data = data;
+
+    char remote[24], recipient[24], size_str[24];
+    snprintf(remote, sizeof(remote), "%lu", transfer->remote);
+    snprintf(recipient, sizeof(recipient), "%lu", user);
+    snprintf(size_str, sizeof(size_str), "%llu", size);
+
+    int status = send_now(prot_make_msg("OFR", 4, remote, recipient, name, size_str));
+    if (status != CLIENT_ERR_OK) {
+        remove_transfer(transfer);
+        return sent_status(status);
+    }
+
+    *id = transfer->id;
+    return CLIENT_ERR_OK;
+}
+
+int client_accept_file(const unsigned long id) {
+
+    // Only an offer that hasn't been accepted yet
+    struct transfer* transfer = find_transfer(id);
+    if (!transfer || transfer->outgoing || transfer->acked > 0 || transfer->done > 0)
+        return CLIENT_ERR_INVALID_MSG;
+
+    char remote[24];
+    snprintf(remote, sizeof(remote), "%lu", transfer->remote);
+
+    return sent_status(send_now(prot_make_msg("ACK", 2, remote, "0")));
+}
+
+int client_cancel_file(const unsigned long id) {
+
+    struct transfer* transfer = find_transfer(id);
+    if (!transfer)
+        return CLIENT_ERR_INVALID_MSG;
+
+    return sent_status(cancel_transfer(transfer));
+}
+
+// Wait for max timeout milliseconds when waiting for data to arrive
+int client_receive(struct client_msg* msg, const unsigned int timeout) {
+
+    // Only the first message is waited for, the ones that are meant
+    // for the library itself are skipped
+    unsigned int wait = timeout;
+
+    while (1) {
+
+        struct prot_msg raw_msg;
+
+        if (io_thread) {
+            // In the asynchronous mode, the message has already been received by the I/O thread
+            raw_msg = receive_queued(wait);
+            if (raw_msg.status == CLIENT_ERR_NOREC)
+                return CLIENT_ERR_NOREC;
+        } else {
+            // This call is non-blocking, thus if there is no new activity, return immediately after timeout milliseconds
+            if (!prot_reader_ready(&reader) && SDLNet_CheckSockets(sset, wait) <= 0)
+                return CLIENT_ERR_NOREC;
+
+            raw_msg = prot_read(&reader);
+            dup_args(&raw_msg);
+        }
+
+        if (raw_msg.status < 0) {
+            client_disconnect();
+            return raw_msg.status;
+        }
+
+        int ret = decode_msg(&raw_msg, msg);
+
+        // Free the arguments that aren't handed out to the frontend
+        // (or all of them when an error occurs)
+        for (size_t i = 0; i < (size_t)raw_msg.status; i++) {
+            if (ret == CLIENT_ERR_OK && msg->type == CLIENT_MSG_MSG && raw_msg.args[i] == msg->u.rec.msg.text) continue;
+            if (ret == CLIENT_ERR_OK && msg->type == CLIENT_MSG_NICK && raw_msg.args[i] == msg->u.rec.nick.newnick) continue;
+            if (ret == CLIENT_ERR_OK && msg->type == CLIENT_MSG_OFFER && raw_msg.args[i] == msg->u.rec.offer.name) continue;
+            if (ret == CLIENT_ERR_OK && msg->type == CLIENT_MSG_CHUNK && raw_msg.args[i] == msg->u.rec.chunk.data) continue;
+            free(raw_msg.args[i]);
+        }
+
+        if (ret == CLIENT_ERR_OK)
+            return CLIENT_ERR_OK;
+
+        if (ret != CLIENT_ERR_NOREC) {
+            client_disconnect();
+            return ret;
+        }
+
+        wait = 0;
+    }
+}
+
+// Make sure that the arena has at least size free bytes
+// It can only grow while empty because reallocating moves the strings
+static int arena_reserve(struct client_arena* arena, const size_t size) {
+
+    if (arena->size - arena->used >= size)
+        return 0;
+
+    if (arena->used > 0)
+        return -1;
+
+    size_t newsize = size > CLIENT_ARENA_MIN_SIZE ? size : CLIENT_ARENA_MIN_SIZE;
+    char* data = realloc(arena->data, newsize);
+    if (!data)
+        return -1;
+
+    arena->data = data;
+    arena->size = newsize;
+    return 0;
+}
+
+// Copy the arguments of the message to the end of the arena, there has to be enough space
+static void copy_args(struct prot_msg* msg, struct client_arena* arena) {
+    for (size_t i = 0; i < (size_t)(msg->status > 0 ? msg->status : 0); i++) {
+        size_t len = strlen(msg->args[i])+1;
+        msg->args[i] = memcpy(&arena->data[arena->used], msg->args[i], len);
+        arena->used += len;
+    }
+}
+
+// Receive all the pending messages at once, the strings are stored in the arena
+int client_receive_batch(struct client_msg* msgs, const size_t max, size_t* count, struct client_arena* arena, const unsigned int timeout) {
+
+    *count = 0;
+
+    // Only the first message is waited for
+    unsigned int wait = timeout;
+    int ret = CLIENT_ERR_OK;
+
+    while (*count < max) {
+
+        struct prot_msg raw_msg;
+
+        if (io_thread) {
+            if (queue_peek(&queue, &raw_msg, wait) < 0) {
+                reset_event_fd();
+                break;
+            }
+
+            size_t size = 0;
+            for (size_t i = 0; i < (size_t)(raw_msg.status > 0 ? raw_msg.status : 0); i++)
+                size += strlen(raw_msg.args[i])+1;
+
+            // If the arena is full, the message stays in the queue for the next batch
+            if (arena_reserve(arena, size) < 0) {
+                if (arena->used == 0)
+                    ret = PROT_ERR_ERR;
+                break;
+            }
+
+            // Copy the arguments out of the queue
+            copy_args(&raw_msg, arena);
+
+            queue_release(&queue);
+        } else {
+            if (!prot_reader_ready(&reader) && SDLNet_CheckSockets(sset, wait) <= 0)
+                break;
+
+            // There has to be enough space for the biggest possible message
+            // because it can't be put back once it's read
+            if (arena_reserve(arena, PROT_MAX_ARGS * PROT_MAX_ARG_SIZE) < 0) {
+                if (arena->used == 0)
+                    ret = PROT_ERR_ERR;
+                break;
+            }
+
+            raw_msg = prot_read(&reader);
+            copy_args(&raw_msg, arena);
+        }
+
+        if (raw_msg.status < 0) {
+            ret = raw_msg.status;
+            break;
+        }
+
+        int status = decode_msg(&raw_msg, &msgs[*count]);
+        if (status == CLIENT_ERR_NOREC)
+            continue;
+        if (status != CLIENT_ERR_OK) {
+            ret = status;
+            break;
+        }
+
+        (*count)++;
+        wait = 0;
+    }
+
+    if (ret != CLIENT_ERR_OK) {
+        client_disconnect();
+        return ret;
+    }
+
+    return *count > 0 ? CLIENT_ERR_OK : CLIENT_ERR_NOREC;
+}
 
-    return ret;
+void client_arena_reset(struct client_arena* arena) {
+    arena->used = 0;
+}
+
+void client_arena_free(struct client_arena* arena) {
+    free(arena->data);
+    arena->data = NULL;
+    arena->size = 0;
+    arena->used = 0;
 }
 
 int client_init() {
@@ -125,11 +1353,100 @@ int client_init() {
         return CLIENT_ERR_INIT;
     }
 
+    socket_lock = SDL_CreateMutex();
+    if (!socket_lock) {
+        SDLNet_FreeSocketSet(sset);
+        SDLNet_Quit();
+        SDL_Quit();
+        return CLIENT_ERR_INIT;
+    }
+
+    if (prot_reader_init(&reader, NULL) < 0) {
+        SDL_DestroyMutex(socket_lock);
+        SDLNet_FreeSocketSet(sset);
+        SDLNet_Quit();
+        SDL_Quit();
+        return CLIENT_ERR_INIT;
+    }
+
+    // Let protlib check the messages from the server
+    prot_set_schema(serv_schema, SDL_arraysize(serv_schema), SERV_DIR_OUT);
+
+    return CLIENT_ERR_OK;
+}
+
+int client_set_async(client_notify_fn notify_fn, void* data) {
+
+    if (!async) {
+        if (queue_init(&queue) < 0)
+            return CLIENT_ERR_INIT;
+
+#ifdef __linux__
+        event_fd = eventfd(0, EFD_NONBLOCK | EFD_CLOEXEC);
+#endif
+        async = 1;
+    }
+
+    notify = notify_fn;
+    notify_data = data;
+
+    return CLIENT_ERR_OK;
+}
+
+void client_set_auto_reconnect(const unsigned int attempts) {
+    reconnect_attempts = attempts;
+}
+
+void client_set_compression(const int enabled) {
+    compression = enabled;
+}
+
+int client_event_fd() {
+    return event_fd;
+}
+
+int client_set_async_send(client_sent_fn sent_fn, void* data) {
+
+    if (!async_send) {
+        send_lock = SDL_CreateMutex();
+        send_cond = SDL_CreateCond();
+        if (!send_lock || !send_cond) {
+            SDL_DestroyMutex(send_lock);
+            SDL_DestroyCond(send_cond);
+            return CLIENT_ERR_INIT;
+        }
+
+        async_send = 1;
+    }
+
+    sent = sent_fn;
+    sent_data = data;
+
     return CLIENT_ERR_OK;
 }
 
 void client_deinit() {
     client_disconnect();
+    intern_clear();
+
+    if (async) {
+        queue_destroy(&queue);
+#ifdef __linux__
+        if (event_fd >= 0)
+            close(event_fd);
+#endif
+        event_fd = -1;
+        async = 0;
+    }
+
+    if (async_send) {
+        SDL_DestroyMutex(send_lock);
+        SDL_DestroyCond(send_cond);
+        async_send = 0;
+    }
+
+    prot_reader_free(&reader);
+    SDL_DestroyMutex(socket_lock);
     SDLNet_FreeSocketSet(sset);
     SDLNet_Quit();
     SDL_Quit();
@@ -141,9 +1458,16 @@ int client_connect(const char* url, const unsigned short port, const unsigned in
     // If the socket already exists, i.e. we are reconnecting, close the socket
     client_disconnect();
 
+    // A new session, the server is going to tell us about the nicks again
+    intern_clear();
+    memset(transfers, 0, sizeof(transfers));
+    presence_count = 0;
+    presence_synced = 0;
+
     IPaddress addr;
     if (SDLNet_ResolveHost(&addr, url, port) < 0)
         return CLIENT_ERR_CON_FAILED;
+    server_addr = addr;
 
     // Open the actual server socket
     socket = SDLNet_TCP_Open(&addr);
@@ -156,6 +1480,7 @@ int client_connect(const char* url, const unsigned short port, const unsigned in
         socket = NULL;
         return CLIENT_ERR_CON_FAILED;
     }
+    prot_reader_reset(&reader, socket);
 
     // wait for the first answer (with the specified timeout)
     struct client_msg response;
@@ -165,6 +1490,34 @@ int client_connect(const char* url, const unsigned short port, const unsigned in
             client_disconnect();
             return CLIENT_ERR_CON_REFUSED;
         }
+
+        // Messages are numbered from 1 for every connection
+        if (async_send) {
+            send_pending = &send_buffers[0];
+            send_pending->used = 0;
+            send_pending->count = 0;
+            send_pending->first_id = 1;
+            send_stop = 0;
+            SDL_AtomicSet(&send_failed, 0);
+
+            send_thread = SDL_CreateThread(send_thread_main, "client_send", NULL);
+            if (!send_thread) {
+                client_disconnect();
+                return CLIENT_ERR_INIT;
+            }
+        }
+
+        // From now on, the I/O thread takes care of receiving
+        if (async) {
+            SDL_AtomicSet(&io_stop, 0);
+            SDL_AtomicSet(&reconnecting, 0);
+            last_nick[0] = '\0';
+            io_thread = SDL_CreateThread(io_thread_main, "client_io", NULL);
+            if (!io_thread) {
+                client_disconnect();
+                return CLIENT_ERR_INIT;
+            }
+        }
     } else
         client_disconnect();
 
@@ -176,6 +1529,29 @@ int client_connect(const char* url, const unsigned short port, const unsigned in
 // Note that this only closes the socket but doesn't cleanup the whole system, use client_deinit for final cleanup 
 // (which also calls this function)
 void client_disconnect() {
+
+    // Stop the background threads first, they use the socket
+    if (send_thread) {
+        SDL_LockMutex(send_lock);
+        send_stop = 1;
+        SDL_CondBroadcast(send_cond);
+        SDL_UnlockMutex(send_lock);
+
+        SDL_WaitThread(send_thread, NULL);
+        send_thread = NULL;
+    }
+
+    if (io_thread) {
+        SDL_AtomicSet(&io_stop, 1);
+        SDL_WaitThread(io_thread, NULL);
+        io_thread = NULL;
+        close_shm();
+
+        queue_clear(&queue);
+        reset_event_fd();
+    }
+
+    // The I/O thread might have given up reconnecting
     if (socket == NULL) return;
 
     SDLNet_TCP_DelSocket(sset, socket);
@@ -0,0 +1,172 @@
+#include "queue.h"
+
+#include <string.h>
+
+// Every entry starts with this header, the arguments follow right after it
+struct entry_header {
+    // The size of the whole entry including the header and padding,
+    // 0 marks the end of the used part of the buffer (the producer wrapped around)
+    Uint32 size;
+    // Either the number of arguments or a negative prot_errcode
+    Sint32 status;
+    char head[PROT_HEAD_SIZE];
+};
+
+#define ALIGN4(x) (((x) + 3) & ~(size_t)3)
+
+// Marks that an entry doesn't fit
+#define NO_PLACE CLIENT_QUEUE_SIZE
+
+// Where an entry of size bytes can be written, at write or at the beginning
+static size_t find_place(const size_t read, const size_t write, const size_t size) {
+
+    // write must never catch up with read because write == read means that the queue is empty
+    if (write >= read) {
+        // It fits at the end
+        if (write + size < CLIENT_QUEUE_SIZE || (write + size == CLIENT_QUEUE_SIZE && read != 0))
+            return write;
+        // It fits at the beginning
+        if (size < read)
+            return 0;
+    } else if (write + size < read)
+        return write;
+
+    return NO_PLACE;
+}
+
+int queue_init(struct client_queue* queue) {
+    SDL_AtomicSet(&queue->read, 0);
+    SDL_AtomicSet(&queue->write, 0);
+    SDL_AtomicSet(&queue->waiting, 0);
+    queue->peeked = 0;
+
+    queue->pending = SDL_CreateSemaphore(0);
+    queue->space = SDL_CreateSemaphore(0);
+    if (!queue->pending || !queue->space) {
+        queue_destroy(queue);
+        return -1;
+    }
+
+    return 0;
+}
+
+void queue_destroy(struct client_queue* queue) {
+    SDL_DestroySemaphore(queue->pending);
+    SDL_DestroySemaphore(queue->space);
+    queue->pending = NULL;
+    queue->space = NULL;
+}
+
+void queue_clear(struct client_queue* queue) {
+    while (SDL_SemTryWait(queue->pending) == 0);
+    while (SDL_SemTryWait(queue->space) == 0);
+
+    SDL_AtomicSet(&queue->read, 0);
+    SDL_AtomicSet(&queue->write, 0);
+    SDL_AtomicSet(&queue->waiting, 0);
+    queue->peeked = 0;
+}
+
+int queue_push(struct client_queue* queue, const struct prot_msg* msg) {
+
+    // Calculate the size of the entry
+    size_t size = sizeof(struct entry_header);
+    for (size_t i = 0; i < (size_t)(msg->status > 0 ? msg->status : 0); i++)
+        size += strlen(msg->args[i])+1;
+    size = ALIGN4(size);
+
+    size_t write = (size_t)SDL_AtomicGet(&queue->write);
+    size_t place;
+    while (1) {
+        size_t read = (size_t)SDL_AtomicGet(&queue->read);
+        if ((place = find_place(read, write, size)) != NO_PLACE)
+            break;
+
+        // From now on, the consumer wakes up queue_wait_space, unless
+        // it has released an entry before it could see the flag
+        SDL_AtomicSet(&queue->waiting, 1);
+        if ((size_t)SDL_AtomicGet(&queue->read) == read)
+            return -1;
+    }
+
+    // It fits at the beginning, mark the rest as unused
+    if (place != write) {
+        ((struct entry_header*)&queue->buf[write])->size = 0;
+        write = place;
+    }
+
+    // Fill in the entry
+    struct entry_header header;
+    header.size = (Uint32)size;
+    header.status = msg->status;
+    memcpy(header.head, msg->head, PROT_HEAD_SIZE);
+    memcpy(&queue->buf[write], &header, sizeof(header));
+
+    char* args = &queue->buf[write + sizeof(header)];
+    for (size_t i = 0; i < (size_t)(msg->status > 0 ? msg->status : 0); i++) {
+        size_t len = strlen(msg->args[i])+1;
+        memcpy(args, msg->args[i], len);
+        args += len;
+    }
+
+    // Publish the entry, the barrier makes sure that the consumer sees the data first
+    write = (write + size) % CLIENT_QUEUE_SIZE;
+    SDL_MemoryBarrierRelease();
+    SDL_AtomicSet(&queue->write, (int)write);
+
+    SDL_SemPost(queue->pending);
+    return 0;
+}
+
+int queue_peek(struct client_queue* queue, struct prot_msg* msg, const unsigned int timeout) {
+
+    if (!queue->peeked) {
+        int status = timeout ? SDL_SemWaitTimeout(queue->pending, timeout) : SDL_SemTryWait(queue->pending);
+        if (status != 0)
+            return -1;
+        queue->peeked = 1;
+    }
+
+    size_t read = (size_t)SDL_AtomicGet(&queue->read);
+    SDL_MemoryBarrierAcquire();
+
+    struct entry_header header;
+    memcpy(&header, &queue->buf[read], sizeof(header));
+
+    // Skip the unused end of the buffer
+    if (header.size == 0) {
+        read = 0;
+        SDL_AtomicSet(&queue->read, 0);
+        memcpy(&header, &queue->buf[read], sizeof(header));
+    }
+
+    msg->status = header.status;
+    memcpy(msg->head, header.head, PROT_HEAD_SIZE);
+
+    char* args = &queue->buf[read + sizeof(header)];
+    for (size_t i = 0; i < (size_t)(msg->status > 0 ? msg->status : 0); i++) {
+        msg->args[i] = args;
+        args += strlen(args)+1;
+    }
+
+    return 0;
+}
+
+void queue_release(struct client_queue* queue) {
+
+    size_t read = (size_t)SDL_AtomicGet(&queue->read);
+
+    struct entry_header header;
+    memcpy(&header, &queue->buf[read], sizeof(header));
+
+    SDL_MemoryBarrierRelease();
+    SDL_AtomicSet(&queue->read, (int)((read + header.size) % CLIENT_QUEUE_SIZE));
+    queue->peeked = 0;
+
+    if (SDL_AtomicCAS(&queue->waiting, 1, 0))
+        SDL_SemPost(queue->space);
+}
+
+void queue_wait_space(struct client_queue* queue, const unsigned int timeout) {
+    SDL_SemWaitTimeout(queue->space, timeout);
+}
@@ -0,0 +1,94 @@
+#pragma once
+
+#include <wx/wx.h>
+#include <wx/vscroll.h>
+
+#include <deque>
+#include <vector>
+
+#include "search.h"
+
+// The output box, a read-only list of pre-formatted lines
+// Only the last `capacity` lines are kept (in a ring buffer) and only the visible ones
+// are drawn, so it takes the same time and memory no matter how long the chat runs
+// Every line is also put into a search index, which forgets it when it's thrown away
+// The lines aren't wrapped, it scrolls sideways by characters as far as the widest kept line
+class ScrollbackView : public wxHVScrolledWindow
+{
+    public:
+
+    ScrollbackView(wxWindow* parent, size_t capacity);
+
+    // Append a single line (it mustn't contain any newlines), the oldest line is
+    // thrown away when the capacity is reached
+    // Only the part from text_start on is searchable, nick and time are the sender
+    // and the time of the message the line belongs to
+    // The view isn't updated until Flush is called, so that a whole burst of
+    // lines can be appended at once
+    void AppendLine(const wxString& line, size_t text_start, const wxString& nick, time_t time);
+
+    // Update the view after appending, if it was scrolled to the bottom, it stays there
+    void Flush();
+
+    // Remove all the lines
+    void Clear();
+
+    // Change the number of lines that are kept, the oldest ones are thrown away if needed
+    void SetCapacity(size_t capacity);
+
+    size_t GetLineCount() const { return count; }
+
+    // The line-th oldest line that is still kept
+    const wxString& GetLine(size_t line) const { return lines[(first + line) % lines.size()].text; }
+
+    // Look for the query in the kept lines, see SearchIndex
+    std::vector<SearchIndex::Hit> Search(const SearchIndex::Query& query) const { return index.Search(query); }
+
+    // Highlight the hits (as returned by Search), the current one stands out
+    // and is scrolled into view
+    void SetHighlights(const std::vector<SearchIndex::Hit>& hits, size_t current);
+    void ClearHighlights();
+
+    private:
+
+    struct Line {
+        wxString text;
+        size_t text_start;
+    };
+
+    // A kept line that is wider than all the newer ones
+    struct Width {
+        uint32_t number;
+        wxCoord width;
+    };
+
+    // The row of the line with the given number, the number can be of an evicted line
+    bool GetRow(uint32_t number, size_t* row) const;
+
+    // Forget the widths of the lines that aren't kept anymore
+    void EvictWidths();
+
+    wxCoord OnGetRowHeight(size_t row) const override;
+    wxCoord OnGetColumnWidth(size_t column) const override;
+
+    void OnPaint(wxPaintEvent& evt);
+
+    // The ring buffer, lines[first] is the oldest line
+    std::vector<Line> lines;
+    size_t first = 0;
+    size_t count = 0;
+
+    // Every appended line gets the next number, the oldest kept line has next_number - count
+    uint32_t next_number = 0;
+    SearchIndex index;
+
+    // The widths get smaller from the front to the back, so the front is the widest kept line,
+    // a line is only ever taken out of the front when it's thrown away, so it doesn't have to be searched
+    std::deque<Width> widths;
+
+    std::vector<SearchIndex::Hit> highlights;
+    size_t current_highlight = 0;
+
+    // The number of lines thrown away since the last Flush
+    size_t evicted = 0;
+};
@@ -0,0 +1,81 @@
+#pragma once
+
+#include <wx/string.h>
+
+#include <cstdint>
+#include <ctime>
+#include <deque>
+#include <limits>
+#include <string>
+#include <unordered_map>
+#include <vector>
+
+// An incremental full-text index over the lines of the scrollback
+// Every line is indexed by the trigrams (three consecutive characters) of its lowercased
+// text and by its sender's nick. The postings (the numbers of the lines containing a trigram
+// or sent by a nick) are plain increasing arrays, so a search is an intersection of a few
+// of them followed by a check of the remaining candidates.
+// Lines are added at the end and removed from the beginning, just like in the scrollback's
+// ring buffer, so the index never holds more lines than the scrollback itself
+class SearchIndex
+{
+    public:
+
+    // Empty text or nick matches anything, the time range is inclusive
+    struct Query {
+        wxString text;
+        wxString nick;
+        time_t from = 0;
+        time_t to = std::numeric_limits<time_t>::max();
+    };
+
+    // A single occurrence of the searched text (or the whole line if there's no text)
+    // The offset and length are in characters of the indexed text
+    struct Hit {
+        uint32_t line;
+        size_t offset;
+        size_t length;
+    };
+
+    // Add a line, the lines are numbered by the caller and every line has to get the next number
+    void Add(uint32_t line, const wxString& text, const wxString& nick, time_t time);
+
+    // Remove all the lines with a number lower than line
+    void EvictBefore(uint32_t line);
+
+    void Clear();
+
+    // Returns all the hits ordered by line number (and offset)
+    std::vector<Hit> Search(const Query& query) const;
+
+    private:
+
+    // An increasing array of line numbers, the evicted ones at the start are only skipped
+    // and the array is compacted once they take up more than half of it
+    struct Postings {
+        std::vector<uint32_t> lines;
+        size_t start = 0;
+
+        size_t Size() const { return lines.size() - start; }
+        bool Contains(uint32_t line) const;
+        void Evict(uint32_t before);
+    };
+
+    struct Line {
+        wxString text; // Lowercased
+        uint32_t nick;
+        time_t time;
+    };
+
+    static uint64_t Trigram(const wxString& text, size_t i);
+
+    // The indexed lines, lines[0] has the number first
+    std::deque<Line> lines;
+    uint32_t first = 0;
+
+    std::unordered_map<uint64_t, Postings> trigrams;
+
+    // Nicks are identified by small numbers, the key is the lowercased UTF-8 nick
+    std::unordered_map<std::string, uint32_t> nick_ids;
+    std::unordered_map<uint32_t, Postings> nicks;
+};
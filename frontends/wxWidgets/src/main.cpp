@@ -1,13 +1,24 @@
 #include <wx/wx.h>
 #include <wx/thread.h>
 #include <wx/splitter.h>
+#include <wx/srchctrl.h>
 #include <wx/tokenzr.h>
 #include <wx/valnum.h>
 
+#include <atomic>
+
+#include "scrollback.h"
+
 extern "C" {
     #include "client.h"
 }
 
+// The number of lines kept in the output box
+static const size_t scrollback_lines = 10000;
+
+// How many times the client tries to reconnect when the connection is lost
+static const unsigned int reconnect_attempts = 10;
+
 class ChatFrontend : public wxApp
 {
 
@@ -16,7 +27,12 @@ class ChatFrontend : public wxApp
 
     // The input and output boxes
     wxTextCtrl* input_box;
-    wxTextCtrl* output_box;
+    ScrollbackView* output_box;
+
+    // The search box above the output box and the last hit that was shown
+    wxSearchCtrl* search_box;
+    wxString last_search;
+    SearchIndex::Hit last_hit;
 
     // The two buttons
     wxButton* send_button;
@@ -28,10 +44,21 @@ class ChatFrontend : public wxApp
     // A boolean indicating if we are currently connected to a remote server
     bool connected = false;
 
+    // The host we are connected to, shown in the title
+    wxString host;
+
+    // Set when a receive event is already on its way, so that the client's I/O thread
+    // doesn't flood the event queue when the main thread is busy
+    std::atomic<bool> receive_pending{false};
+
+    // The strings of received messages are stored here, it's reused for every batch
+    struct client_arena arena = {};
+
     // Change the visual status, including the connected flag
     void SetStatusConnected(bool connected, const wxString& host=wxEmptyString) {
 
         this->connected = connected;
+        this->host = host;
 
         wxString title;
 
@@ -58,9 +85,16 @@ class ChatFrontend : public wxApp
 
 		wxBoxSizer* main_sizer = new wxBoxSizer(wxVERTICAL);
 
-        // Add the output box first
+        // Add the search box and the output box first
 		main_sizer->Add(
-			output_box = new wxTextCtrl (panel, wxID_ANY, "", wxDefaultPosition, wxDefaultSize, wxTE_MULTILINE | wxTE_READONLY | wxTE_RICH | wxHSCROLL),
+			search_box = new wxSearchCtrl (panel, wxID_ANY),
+			wxSizerFlags(0).Expand().Border(wxLEFT | wxRIGHT | wxTOP)
+		);
+        search_box->ShowCancelButton(true);
+        search_box->SetDescriptiveText("Search (nick:, after:, before:)");
+
+		main_sizer->Add(
+			output_box = new ScrollbackView (panel, scrollback_lines),
 			wxSizerFlags(1).Expand().Border(wxALL)
 		);
 
@@ -117,6 +151,33 @@ class ChatFrontend : public wxApp
             Connect(); 
         });
 
+        // Searching the same thing again goes to the previous hit, cancelling removes the highlights
+        search_box->Bind(wxEVT_SEARCHCTRL_SEARCH_BTN, [&](wxCommandEvent& evt) {
+            (void)evt;
+
+            Search(search_box->GetValue());
+        });
+
+        search_box->Bind(wxEVT_SEARCHCTRL_CANCEL_BTN, [&](wxCommandEvent& evt) {
+            (void)evt;
+
+            search_box->Clear();
+            last_search.clear();
+            output_box->ClearHighlights();
+        });
+
+        // Ctrl+F jumps to the search box
+        {
+            wxAcceleratorEntry find_key(wxACCEL_CTRL, 'F', wxID_FIND);
+            frame->SetAcceleratorTable(wxAcceleratorTable(1, &find_key));
+            frame->Bind(wxEVT_MENU, [&](wxCommandEvent& evt) {
+                (void)evt;
+
+                search_box->SetFocus();
+                search_box->SelectAll();
+            }, wxID_FIND);
+        }
+
         // In the input box, we make it easy to send messages by pressing enter
         // Notice that shift+enter or any other combination creates \v is ignored
         // as we allow multiline text
@@ -135,10 +196,10 @@ class ChatFrontend : public wxApp
 
 		});
 
-        // Bind the idle event to receive, this is crucial
-        // We don't have to use a separate thread, instead, this non-blocking function gets called whenever
-        // The main thread is idle
-        Bind(wxEVT_IDLE, Receive, this);
+        // Bind the thread event to receive, this is crucial
+        // The client's I/O thread receives the messages in the background and lets us
+        // know (see Notify), so the main thread never waits for the network
+        Bind(wxEVT_THREAD, &ChatFrontend::Receive, this);
 
 	}
 
@@ -155,11 +216,16 @@ class ChatFrontend : public wxApp
 		frame->Show(true);
 
 		//initialize the network
-		if (client_init() != CLIENT_ERR_OK) {
+		if (client_init() != CLIENT_ERR_OK ||
+            client_set_async(Notify, this) != CLIENT_ERR_OK ||
+            client_set_async_send(NULL, NULL) != CLIENT_ERR_OK) {
             wxMessageBox("Failed to initialise the client", "Fatal error", wxOK | wxICON_ERROR);
             return false;
         }
 
+        // Survive short network outages without losing any messages
+        client_set_auto_reconnect(reconnect_attempts);
+
         // Immediately prompt the confused user to connect
         wxBell();
 		Connect();
@@ -170,34 +236,109 @@ class ChatFrontend : public wxApp
     int OnExit() override {
         // Make sure to deinit the client, this closes all the sockets and the underlying backend
         client_deinit();
+        client_arena_free(&arena);
 
         return 0;
     }
 
     // This function is called whenever a fatal error on the connection occurs
+    // The client has already tried to reconnect, so the output box is kept for reference
     void LostConnection() {
         SetStatusConnected(false);
-        output_box->Clear();
         wxMessageBox("Lost connection to remote host", "Error", wxOK | wxICON_ERROR);
     }
 
     // Prints a properly formatted message Msg by Sender
+    // The output box isn't updated until it's flushed, so that a burst of messages is drawn at once
     void PrintMsg(const wxString& sender, const wxString& msg) {
 
-        wxString output = wxString::Format("[%s] <%s> : ", wxDateTime::Now().FormatISOCombined(' '), sender);
-        *output_box << output;
+        wxDateTime now = wxDateTime::Now();
+        wxString prefix = wxString::Format("[%s] <%s> : ", now.FormatISOCombined(' '), sender);
+        wxString line = prefix;
 
         for (size_t i = 0; i < msg.Len(); i++) {
-            *output_box << wxString(msg[i]);
 
             // This ensures that the text doesn't appear at the beginning of the next line but correctly aligned
             // [TIME] <nick> : like
             //                 this
             char c;
-            if (msg[i].GetAsChar(&c) && (c == '\v' || c == '\n' || c == '\r'))
-                *output_box << std::string(output.Len(), ' ');
+            if (msg[i].GetAsChar(&c) && (c == '\v' || c == '\n' || c == '\r')) {
+                output_box->AppendLine(line, prefix.Len(), sender, now.GetTicks());
+                line = wxString(' ', prefix.Len());
+            } else
+                line += msg[i];
+        }
+        output_box->AppendLine(line, prefix.Len(), sender, now.GetTicks());
+    }
+
+    // Parses a time in the search box, it's either HH:MM[:SS] (today), YYYY-MM-DD or YYYY-MM-DDTHH:MM[:SS]
+    static bool ParseSearchTime(const wxString& str, time_t* time) {
+
+        wxDateTime date;
+        if (!date.ParseISOCombined(str, 'T') && !date.ParseISODate(str)) {
+            date = wxDateTime::Today();
+            if (!date.ParseISOTime(str) && !date.ParseTime(str))
+                return false;
         }
-        *output_box << "\n";
+
+        *time = date.GetTicks();
+        return true;
+    }
+
+    // Looks for a query in the output box and highlights all the hits, the newest one is shown
+    // Searching for the same query again shows the hit before the last one shown
+    // Besides the text, the query can contain the words nick:<nick>, after:<time> and before:<time>
+    void Search(const wxString& str) {
+
+        if (wxString(str).Trim().IsEmpty()) {
+            last_search.clear();
+            output_box->ClearHighlights();
+            return;
+        }
+
+        SearchIndex::Query query;
+        wxStringTokenizer tokens(str, " ");
+        while (tokens.HasMoreTokens()) {
+            wxString token = tokens.GetNextToken(), value;
+
+            if (token.StartsWith("nick:", &value))
+                query.nick = value;
+            else if (!(token.StartsWith("after:", &value) && ParseSearchTime(value, &query.from)) &&
+                     !(token.StartsWith("before:", &value) && ParseSearchTime(value, &query.to))) {
+                if (!query.text.IsEmpty()) query.text += ' ';
+                query.text += token;
+            }
+        }
+
+        // The search is always run again, new lines may have come in and old ones been thrown away
+        std::vector<SearchIndex::Hit> hits = output_box->Search(query);
+        if (hits.empty()) {
+            last_search.clear();
+            output_box->ClearHighlights();
+            wxBell();
+            return;
+        }
+
+        // Find the last hit before the one shown last time, or start over from the newest one
+        // (the difference is signed because the line numbers may wrap around)
+        size_t current = hits.size() - 1;
+        if (str == last_search) {
+            size_t i = hits.size();
+            while (i > 0) {
+                const SearchIndex::Hit& hit = hits[i-1];
+                int32_t diff = (int32_t)(hit.line - last_hit.line);
+                if (diff < 0 || (diff == 0 && hit.offset < last_hit.offset))
+                    break;
+                i--;
+            }
+
+            if (i > 0)
+                current = i - 1;
+        }
+
+        last_search = str;
+        last_hit = hits[current];
+        output_box->SetHighlights(hits, current);
     }
 
     // Sends the current contents of the input box to the moon
@@ -216,11 +357,14 @@ class ChatFrontend : public wxApp
         msg.type = CLIENT_MSG_MSG;
         msg.u.send.msg.text = const_cast<char*>(input.utf8_str().data());
 
+        // This only queues the message up, it's sent in the background
         int status = client_send(&msg);
 		if (status != CLIENT_ERR_OK) {
 
             if (status < 0)
                 LostConnection();
+            else if (status == CLIENT_ERR_RECONNECTING || status == CLIENT_ERR_QUEUE_FULL)
+                wxBell(); // Keep the message in the input box, the user can try again in a moment
             else
                 wxMessageBox("Invalid message", "Failed to send message", wxOK | wxICON_ERROR);
 
@@ -229,6 +373,7 @@ class ChatFrontend : public wxApp
 
 		// print the message to the output box
 		PrintMsg(label_box->GetLabel(), input);
+        output_box->Flush();
 
 		input_box->Clear();
 		input_box->SetFocus();	// set focus back if the send button was clicked
@@ -338,50 +483,79 @@ class ChatFrontend : public wxApp
 
         // If we get *all the way* here, we have passed and are officially connected
         SetStatusConnected(true, wxString::Format("%s:%d", dialog.GetIP(), dialog.GetPort()));
+
+        // Messages might have arrived while we weren't connected yet
+        QueueReceive();
 	}
 
-    // A non-blocking Idle event handler
+    // Called by the client's I/O thread whenever new messages arrive
+    // It runs on that thread, so it only posts an event to the main thread
+    static void Notify(void* data) {
+        static_cast<ChatFrontend*>(data)->QueueReceive();
+    }
+
+    // Make the main thread call Receive (thread-safe)
+    void QueueReceive() {
+        if (!receive_pending.exchange(true))
+            wxQueueEvent(this, new wxThreadEvent());
+    }
+
+    // A non-blocking thread event handler, the event is posted by Notify
     // Processes all the pending messages
-    //TODO: this could maybe be better if implemented as a timer - called a fixed amount of times per second
-    void Receive(wxIdleEvent& evt) {
-        if (!connected) return;
+    void Receive(wxThreadEvent& evt) {
+        (void)evt;
 
-        // Ensure that we get a constant stream of these events
-        evt.RequestMore(); 
+        // From now on, new messages need a new event
+        receive_pending = false;
+
+        if (!connected) return;
 
-        // Non-blocking IO : process all pending messages
+        // Non-blocking IO : process all pending messages in batches
         // Loop until there is stuff to read (until the "NO RECEIVE(D)" return value isn't returned)
-        struct client_msg msg;
+        struct client_msg batch[64];
+        size_t count;
         int status;
-        // Introduce a couple milliseconds of delay (timeout) to relax the CPU load
-        // This won't have basicallly any negative effect
-        while ((status = client_receive(&msg, 5)) != CLIENT_ERR_NOREC) {
-
-            // If any error occurs, the client automatically disconnects, therefore update the gui too
-            if (status != CLIENT_ERR_OK) {
-                LostConnection();
-                return;
+        // The messages are already waiting in the client's queue, so there's no need to wait (timeout is 0)
+        do {
+            status = client_receive_batch(batch, WXSIZEOF(batch), &count, &arena, 0);
+
+            // Even if an error occured, the messages received before it are valid
+            for (size_t i = 0; i < count; i++) {
+                const struct client_msg& msg = batch[i];
+
+                switch (msg.type) {
+                    case CLIENT_MSG_MSG :
+                        PrintMsg(wxString::FromUTF8(msg.u.rec.msg.sender), wxString::FromUTF8(msg.u.rec.msg.text));
+                    break;
+                    case CLIENT_MSG_NICK : 
+                        label_box->SetLabel(wxString::FromUTF8(msg.u.rec.nick.newnick)); 
+                    break; 
+                    case CLIENT_MSG_RECONNECTING :
+                        frame->SetTitle(wxString::Format("Jacob's chat client - Reconnecting to '%s'", host));
+                    break;
+                    case CLIENT_MSG_RECONNECTED :
+                        SetStatusConnected(true, host);
+                    break;
+                    default:
+
+                    break;
+                }
             }
 
-            switch (msg.type) {
-                case CLIENT_MSG_MSG :
-                    PrintMsg(wxString::FromUTF8(msg.u.rec.msg.sender), wxString::FromUTF8(msg.u.rec.msg.text));
-
-                    // Don't forget that all strings in the client_msg structure returned by client_receive() are malloc-ated!
-                    free(msg.u.rec.msg.sender);
-                    free(msg.u.rec.msg.text);
-                break;
-                case CLIENT_MSG_NICK : 
-                    label_box->SetLabel(wxString::FromUTF8(msg.u.rec.nick.newnick)); 
+            // All the strings of the batch live in the arena, release them at once
+            client_arena_reset(&arena);
 
-                    free(msg.u.rec.nick.newnick);
-                break; 
-                default:
+            // Draw the whole batch at once
+            if (count > 0)
+                output_box->Flush();
 
-                break;
+            // If any error occurs, the client automatically disconnects, therefore update the gui too
+            if (status != CLIENT_ERR_OK && status != CLIENT_ERR_NOREC) {
+                LostConnection();
+                return;
             }
 
-        }
+        } while (status != CLIENT_ERR_NOREC);
 
     }
 
@@ -0,0 +1,209 @@
+#include "scrollback.h"
+
+#include <wx/dcbuffer.h>
+
+#include <algorithm>
+
+// The space between the border and the text
+static const wxCoord margin = 2;
+
+ScrollbackView::ScrollbackView(wxWindow* parent, size_t capacity)
+    : wxHVScrolledWindow(parent, wxID_ANY, wxDefaultPosition, wxDefaultSize, wxBORDER_THEME),
+      lines(capacity > 0 ? capacity : 1)
+{
+    SetBackgroundColour(wxSystemSettings::GetColour(wxSYS_COLOUR_WINDOW));
+    SetForegroundColour(wxSystemSettings::GetColour(wxSYS_COLOUR_WINDOWTEXT));
+
+    // Everything is drawn in OnPaint, including the background
+    SetBackgroundStyle(wxBG_STYLE_PAINT);
+    Bind(wxEVT_PAINT, &ScrollbackView::OnPaint, this);
+
+    SetRowColumnCount(0, 0);
+}
+
+void ScrollbackView::AppendLine(const wxString& line, size_t text_start, const wxString& nick, time_t time) {
+
+    if (count < lines.size()) {
+        lines[(first + count) % lines.size()] = {line, text_start};
+        count++;
+    } else {
+        // Overwrite the oldest line
+        lines[first] = {line, text_start};
+        first = (first + 1) % lines.size();
+        evicted++;
+    }
+
+    // The narrower older lines can never be the widest one anymore
+    const wxCoord width = GetTextExtent(line).x;
+    while (!widths.empty() && widths.back().width <= width)
+        widths.pop_back();
+    widths.push_back({next_number, width});
+
+    index.Add(next_number++, line.Mid(text_start), nick, time);
+    index.EvictBefore(next_number - (uint32_t)count);
+    EvictWidths();
+}
+
+void ScrollbackView::EvictWidths() {
+
+    // Unsigned arithmetic, the numbers may have wrapped around
+    const uint32_t oldest = next_number - (uint32_t)count;
+    while (!widths.empty() && (int32_t)(widths.front().number - oldest) < 0)
+        widths.pop_front();
+}
+
+void ScrollbackView::Flush() {
+
+    // Remember where we were before the new lines came in
+    bool at_bottom = GetVisibleRowsEnd() >= GetRowCount();
+    size_t top = GetVisibleRowsBegin();
+
+    SetRowCount(count);
+
+    // Wide enough for the widest kept line and the margins on both sides
+    const wxCoord widest = widths.empty() ? 0 : widths.front().width + 2 * margin;
+    const wxCoord column = GetCharWidth();
+    SetColumnCount((size_t)((widest + column - 1) / column));
+
+    if (at_bottom) {
+        if (count > 0)
+            ScrollToRow(count - 1);
+    } else {
+        // The lines that were thrown away shifted everything up, keep looking at the same lines
+        ScrollToRow(top > evicted ? top - evicted : 0);
+    }
+
+    evicted = 0;
+    Refresh();
+}
+
+void ScrollbackView::Clear() {
+
+    for (Line& line : lines)
+        line.text.clear();
+
+    first = 0;
+    count = 0;
+    evicted = 0;
+
+    index.Clear();
+    widths.clear();
+    highlights.clear();
+
+    SetRowColumnCount(0, 0);
+    Refresh();
+}
+
+void ScrollbackView::SetCapacity(size_t capacity) {
+
+    if (capacity == 0) capacity = 1;
+
+    // Keep the newest lines that fit, in order
+    std::vector<Line> kept(capacity);
+    size_t keep = count < capacity ? count : capacity;
+    for (size_t i = 0; i < keep; i++)
+        kept[i] = lines[(first + count - keep + i) % lines.size()];
+
+    evicted += count - keep;
+    lines.swap(kept);
+    first = 0;
+    count = keep;
+
+    index.EvictBefore(next_number - (uint32_t)count);
+    EvictWidths();
+
+    Flush();
+}
+
+bool ScrollbackView::GetRow(uint32_t number, size_t* row) const {
+
+    // Unsigned arithmetic, the numbers may have wrapped around
+    uint32_t offset = number - (next_number - (uint32_t)count);
+    if (offset >= count)
+        return false;
+
+    *row = offset;
+    return true;
+}
+
+void ScrollbackView::SetHighlights(const std::vector<SearchIndex::Hit>& hits, size_t current) {
+
+    highlights = hits;
+    current_highlight = current;
+
+    // Center the current hit, and scroll sideways to it if it's out of view
+    size_t row;
+    if (current < highlights.size() && GetRow(highlights[current].line, &row)) {
+        size_t visible = GetVisibleRowsEnd() - GetVisibleRowsBegin();
+        ScrollToRow(row > visible / 2 ? row - visible / 2 : 0);
+
+        const Line& line = lines[(first + row) % lines.size()];
+        const wxCoord x = margin + GetTextExtent(line.text.Left(line.text_start + highlights[current].offset)).x;
+        const size_t column = (size_t)(x / GetCharWidth());
+        if (column < GetVisibleColumnsBegin() || column >= GetVisibleColumnsEnd())
+            ScrollToColumn(column);
+    }
+
+    Refresh();
+}
+
+void ScrollbackView::ClearHighlights() {
+    highlights.clear();
+    Refresh();
+}
+
+wxCoord ScrollbackView::OnGetRowHeight(size_t row) const {
+    (void)row;
+
+    // Every line has the same height
+    return GetCharHeight();
+}
+
+wxCoord ScrollbackView::OnGetColumnWidth(size_t column) const {
+    (void)column;
+
+    // It scrolls sideways by characters
+    return GetCharWidth();
+}
+
+void ScrollbackView::OnPaint(wxPaintEvent& evt) {
+    (void)evt;
+
+    wxAutoBufferedPaintDC dc(this);
+    dc.SetBackground(wxBrush(GetBackgroundColour()));
+    dc.Clear();
+
+    dc.SetFont(GetFont());
+    dc.SetTextForeground(GetForegroundColour());
+
+    // Only draw the visible lines, shifted by how far it's scrolled sideways
+    const wxCoord height = GetCharHeight();
+    const size_t begin = GetVisibleRowsBegin();
+    const size_t end = GetVisibleRowsEnd();
+    const wxCoord left = margin - (wxCoord)GetVisibleColumnsBegin() * GetCharWidth();
+
+    // The highlights are ordered by line, find the first visible one
+    // (the difference is signed because the line numbers may have wrapped around)
+    const uint32_t begin_number = next_number - (uint32_t)count + (uint32_t)begin;
+    auto hit = std::lower_bound(highlights.begin(), highlights.end(), begin_number,
+        [](const SearchIndex::Hit& h, uint32_t number) { return (int32_t)(h.line - number) < 0; });
+
+    dc.SetPen(*wxTRANSPARENT_PEN);
+
+    for (size_t row = begin; row < end && row < count; row++) {
+        const Line& line = lines[(first + row) % lines.size()];
+        const wxCoord y = (wxCoord)(row - begin) * height;
+
+        // Draw the highlights behind the text
+        for (size_t hit_row; hit != highlights.end() && GetRow(hit->line, &hit_row) && hit_row == row; ++hit) {
+            bool current = (size_t)(hit - highlights.begin()) == current_highlight;
+            dc.SetBrush(wxBrush(current ? wxColour(255, 150, 50) : wxColour(255, 230, 120)));
+
+            const size_t start = line.text_start + hit->offset;
+            const wxCoord x = left + dc.GetTextExtent(line.text.Left(start)).x;
+            dc.DrawRectangle(x, y, dc.GetTextExtent(line.text.Mid(start, hit->length)).x, height);
+        }
+
+        dc.DrawText(line.text, left, y);
+    }
+}
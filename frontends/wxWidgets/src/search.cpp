@@ -0,0 +1,165 @@
+#include "search.h"
+
+#include <algorithm>
+
+// Postings shorter than this are never compacted, it's not worth it
+static const size_t min_compact_size = 64;
+
+bool SearchIndex::Postings::Contains(uint32_t line) const {
+    auto it = std::lower_bound(lines.begin() + start, lines.end(), line);
+    return it != lines.end() && *it == line;
+}
+
+void SearchIndex::Postings::Evict(uint32_t before) {
+
+    while (start < lines.size() && lines[start] < before)
+        start++;
+
+    if (start > min_compact_size && start * 2 > lines.size()) {
+        lines.erase(lines.begin(), lines.begin() + start);
+        start = 0;
+    }
+}
+
+// Pack three characters (21 bits each are enough for any code point) into one key
+uint64_t SearchIndex::Trigram(const wxString& text, size_t i) {
+    return (uint64_t)(text[i].GetValue() & 0x1FFFFF) << 42 |
+           (uint64_t)(text[i+1].GetValue() & 0x1FFFFF) << 21 |
+           (uint64_t)(text[i+2].GetValue() & 0x1FFFFF);
+}
+
+void SearchIndex::Add(uint32_t line, const wxString& text, const wxString& nick, time_t time) {
+
+    if (lines.empty())
+        first = line;
+
+    Line entry;
+    entry.text = text.Lower();
+    entry.time = time;
+
+    // Give the nick a number if it's new
+    std::string key(nick.Lower().utf8_str());
+    auto id = nick_ids.find(key);
+    if (id == nick_ids.end())
+        id = nick_ids.emplace(key, (uint32_t)nick_ids.size()).first;
+    entry.nick = id->second;
+
+    nicks[entry.nick].lines.push_back(line);
+
+    // The same trigram can be in the line more than once, but it's only added once
+    for (size_t i = 0; i + 3 <= entry.text.Len(); i++) {
+        Postings& postings = trigrams[Trigram(entry.text, i)];
+        if (postings.lines.empty() || postings.lines.back() != line)
+            postings.lines.push_back(line);
+    }
+
+    lines.push_back(std::move(entry));
+}
+
+void SearchIndex::EvictBefore(uint32_t line) {
+
+    while (!lines.empty() && first < line) {
+        const Line& entry = lines.front();
+
+        // Only the postings of the evicted line can change
+        for (size_t i = 0; i + 3 <= entry.text.Len(); i++) {
+            auto postings = trigrams.find(Trigram(entry.text, i));
+            if (postings == trigrams.end()) continue;
+
+            postings->second.Evict(line);
+            if (postings->second.Size() == 0)
+                trigrams.erase(postings);
+        }
+
+        auto postings = nicks.find(entry.nick);
+        if (postings != nicks.end()) {
+            postings->second.Evict(line);
+            if (postings->second.Size() == 0)
+                nicks.erase(postings);
+        }
+
+        lines.pop_front();
+        first++;
+    }
+}
+
+void SearchIndex::Clear() {
+    lines.clear();
+    trigrams.clear();
+    nick_ids.clear();
+    nicks.clear();
+}
+
+std::vector<SearchIndex::Hit> SearchIndex::Search(const Query& query) const {
+
+    std::vector<Hit> hits;
+    if (lines.empty())
+        return hits;
+
+    const wxString text = query.text.Lower();
+
+    // The lines are added in chronological order, so the time range is a range of lines
+    auto begin = std::partition_point(lines.begin(), lines.end(), [&](const Line& entry) { return entry.time < query.from; });
+    auto end = std::partition_point(begin, lines.end(), [&](const Line& entry) { return entry.time <= query.to; });
+    const uint32_t range_begin = first + (uint32_t)(begin - lines.begin());
+    const uint32_t range_end = first + (uint32_t)(end - lines.begin());
+
+    // Every trigram of the text and the nick have to be in the line
+    std::vector<const Postings*> lists;
+
+    for (size_t i = 0; i + 3 <= text.Len(); i++) {
+        auto postings = trigrams.find(Trigram(text, i));
+        if (postings == trigrams.end())
+            return hits;
+        lists.push_back(&postings->second);
+    }
+
+    uint32_t nick = std::numeric_limits<uint32_t>::max();
+    if (!query.nick.IsEmpty()) {
+        auto id = nick_ids.find(std::string(query.nick.Lower().utf8_str()));
+        auto postings = id != nick_ids.end() ? nicks.find(id->second) : nicks.end();
+        if (postings == nicks.end())
+            return hits;
+
+        nick = id->second;
+        lists.push_back(&postings->second);
+    }
+
+    // Check a candidate line and add its hits
+    auto check = [&](uint32_t line) {
+        const Line& entry = lines[line - first];
+        if (nick != std::numeric_limits<uint32_t>::max() && entry.nick != nick) return;
+
+        if (text.IsEmpty()) {
+            hits.push_back({line, 0, entry.text.Len()});
+            return;
+        }
+
+        for (size_t pos = entry.text.find(text); pos != wxString::npos; pos = entry.text.find(text, pos + text.Len()))
+            hits.push_back({line, pos, text.Len()});
+    };
+
+    if (lists.empty()) {
+        // Texts shorter than a trigram have to be looked for in every line
+        for (uint32_t line = range_begin; line != range_end; line++)
+            check(line);
+
+        return hits;
+    }
+
+    // Go through the shortest list and look up its lines in the others
+    std::sort(lists.begin(), lists.end(), [](const Postings* a, const Postings* b) { return a->Size() < b->Size(); });
+
+    const Postings& shortest = *lists[0];
+    auto it = std::lower_bound(shortest.lines.begin() + shortest.start, shortest.lines.end(), range_begin);
+
+    for (; it != shortest.lines.end() && *it < range_end; ++it) {
+        size_t i = 1;
+        while (i < lists.size() && lists[i]->Contains(*it)) i++;
+
+        if (i == lists.size())
+            check(*it);
+    }
+
+    return hits;
+}
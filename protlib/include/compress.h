@@ -0,0 +1,66 @@
+// Compression of the stream beneath the messages, for slow links
+// Once both ends agree to it, the stream carries blocks instead of plain encoded messages,
+// every block holds one or more whole messages, so each one can be decoded as soon
+// as its block arrives (there's no waiting for more data to fill a window)
+// The blocks are compressed (LZ77) with a dictionary both ends have, the sender
+// picks it out of the recent traffic and sends it as a block of its own whenever
+// it changes, a block doesn't depend on the ones before it otherwise, so the
+// same compressed block can be sent to many streams that have the same dictionary
+// prot_reader_compress switches a reader to reading the blocks
+
+#pragma once
+
+#include "protocol.h"
+
+// The maximum size of a dictionary
+#define PROT_DICT_SIZE 32768
+
+// The maximum amount of data that's compressed in one block, the bigger blocks
+// are sent as they are (the matches can only reach 65535 bytes back)
+#define PROT_PACK_MAX (65535 - PROT_DICT_SIZE)
+
+// The blocks start with one of these, the size of the payload and the size
+// of the data it turns into (both as LEB128 numbers)
+// The data of the following blocks is compressed with the dictionary in the payload
+#define PROT_BLOCK_DICT 'D'
+// The payload is compressed with the current dictionary
+#define PROT_BLOCK_PACKED 'Z'
+// The payload is the data itself
+#define PROT_BLOCK_RAW 'R'
+
+// The maximum size of a block with len bytes of data
+#define PROT_PACK_BOUND(len) (11 + (len) + (len) / 255 + 16)
+
+// The number of bits of the hash of 4 bytes, used to find the matches
+#define PROT_HASH_BITS 12
+
+struct prot_dict {
+    // Counts the dictionaries of a stream, 0 is the empty one every stream starts with
+    unsigned long epoch;
+    size_t size;
+    char data[PROT_DICT_SIZE];
+    // The last position + 1 in data of every hash, 0 when there's none
+    Uint16 table[1 << PROT_HASH_BITS];
+};
+
+// Set the contents of the dictionary (only the last PROT_DICT_SIZE bytes of data
+// if it's longer), the epoch is left to the caller
+void prot_dict_set(struct prot_dict* dict, const char* data, size_t len);
+
+// Pack len bytes of encoded messages into a block, compressed with the dictionary
+// (which can be NULL) unless it doesn't make it any smaller or raw is set
+// out has to have PROT_PACK_BOUND(len) bytes, returns the size of the block
+size_t prot_pack(const struct prot_dict* dict, const char* data, const size_t len, const int raw, char* out);
+
+// Pack the dictionary itself, the other end uses it for the following blocks
+// out has to have PROT_PACK_BOUND(PROT_DICT_SIZE) bytes, returns the size of the block
+size_t prot_pack_dict(const struct prot_dict* dict, char* out);
+
+// Read the header of the block at the start of the len bytes of data
+// Returns the size of the header, 0 if it isn't complete yet or PROT_ERR_ERR if it's invalid
+int prot_block_header(const char* data, const size_t len, char* type, size_t* payload, size_t* size);
+
+// Decompress the payload of a block of type PROT_BLOCK_PACKED or PROT_BLOCK_DICT (with a NULL dictionary)
+// into out, which has to have exactly the size from the header
+// Returns PROT_ERR_OK or PROT_ERR_ERR if the payload is invalid
+int prot_unpack(const struct prot_dict* dict, const char* payload, const size_t len, char* out, const size_t size);
@@ -17,6 +17,22 @@ enum prot_errcode {
     PROT_ERR_ERR = -1
 };
 
+// The head packed into a number, so that messages can be told apart with a switch
+#define PROT_HEAD_ID(a, b, c) ((Uint32)(unsigned char)(a) << 16 | (Uint32)(unsigned char)(b) << 8 | (Uint32)(unsigned char)(c))
+
+// The expected form of the messages with one head, see prot_set_schema
+struct prot_schema {
+    // PROT_HEAD_ID of the head
+    Uint32 head;
+    // Only the entries with the direction given to prot_set_schema are used
+    int direction;
+    // The allowed number of arguments
+    int min_args;
+    int max_args;
+    // The maximum size of each argument including the null character
+    size_t max_size[PROT_MAX_ARGS];
+};
+
 // A low-lever message structure
 // Can be received by prot_recv and sent by prot_send
 struct prot_msg {
@@ -30,6 +46,15 @@ struct prot_msg {
     char* args[PROT_MAX_ARGS]; 
 };
 
+// Use the entries of schema with the given direction to check the received messages,
+// a message with an unknown head, a wrong number of arguments or a too long argument
+// is an error, which is found out as soon as the offending byte arrives
+// The schema has to stay valid, a count of 0 turns the checks off (the default)
+void prot_set_schema(const struct prot_schema* schema, const size_t count, const int direction);
+
+// PROT_HEAD_ID of the head
+Uint32 prot_head_id(const char head[PROT_HEAD_SIZE]);
+
 // A convenience function for elegantly manufacturing messages
 struct prot_msg prot_make_msg(const char* head, const int num_args, ...);
 
@@ -39,3 +64,68 @@ struct prot_msg prot_recv(TCPsocket socket);
 
 // Send message, returns enum prot_errcode values
 int prot_send(TCPsocket socket, const struct prot_msg msg);
+
+// Write the message into buf exactly as prot_send would send it
+// Returns the number of bytes written or PROT_ERR_ERR if it doesn't fit or is invalid
+int prot_encode(const struct prot_msg msg, char* buf, const size_t size);
+
+// Arguments can't contain null characters, so binary data has to be escaped
+// The escaped data is at most 2*len bytes long, out has to have space for that
+// and the null character, returns the length of the escaped data
+size_t prot_escape(const char* data, const size_t len, char* out);
+
+// Turn an argument escaped by prot_escape back into the data in place
+// Returns the length of the data or PROT_ERR_ERR if it's not escaped correctly
+long prot_unescape(char* arg);
+
+struct prot_dict;
+
+// Receives messages from a socket in big pieces instead of a byte at a time,
+// one system call usually brings in many messages
+struct prot_reader {
+    TCPsocket socket;
+    char* buf;
+    // [start, used) of buf hasn't been decoded yet
+    size_t start;
+    size_t used;
+    // The size of the message prot_read has returned last, its bytes are right before start
+    size_t last;
+    // Only once the stream is compressed (see prot_reader_compress), the blocks
+    // are received into packed and their data is unpacked into buf
+    struct prot_dict* dict;
+    char* packed;
+    size_t packed_start;
+    size_t packed_used;
+};
+
+// The size of a reader's buffer, it fits the biggest possible message
+#define PROT_READER_SIZE (2 * PROT_MAX_ARGS * PROT_MAX_ARG_SIZE)
+
+// Returns PROT_ERR_OK or PROT_ERR_ERR when out of memory
+int prot_reader_init(struct prot_reader* reader, TCPsocket socket);
+
+// Start reading from another socket, whatever is left in the buffer is thrown away
+// and the stream isn't compressed anymore
+void prot_reader_reset(struct prot_reader* reader, TCPsocket socket);
+
+// The rest of the stream consists of the blocks described in compress.h, call it right
+// after reading the message after which the other end started sending them
+// Returns PROT_ERR_OK or PROT_ERR_ERR when out of memory
+int prot_reader_compress(struct prot_reader* reader);
+
+void prot_reader_free(struct prot_reader* reader);
+
+// Return the next message, the socket is only waited for when there isn't a whole message in the buffer
+// The arguments point into the reader's buffer and stay valid until the next call
+struct prot_msg prot_read(struct prot_reader* reader);
+
+// Whether prot_read would return without waiting for the socket (with a message or an error),
+// SDLNet_CheckSockets doesn't know about what is already in the buffer
+// With a compressed stream it unpacks the received blocks, which makes the arguments
+// of the last message invalid as well
+int prot_reader_ready(struct prot_reader* reader);
+
+// The opposite of prot_encode, take the first message out of the len bytes of data,
+// checking it just like prot_recv does, the arguments in msg point into data
+// Returns the size of the message, 0 if it isn't complete yet or PROT_ERR_ERR if it's invalid
+int prot_decode(char* data, const size_t len, struct prot_msg* msg);
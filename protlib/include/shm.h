@@ -0,0 +1,52 @@
+// A one-way stream of bytes in shared memory, for when both ends are on the same machine
+// It carries exactly the same bytes as a socket would (messages encoded by prot_encode
+// and decoded by prot_decode), but writing is just a copy into a ring buffer and the
+// reader is only woken up (with a futex) when it's actually waiting
+// There is one writer and one reader, the writer creates the segment and tells
+// the reader its name some other way, for example through the socket
+// Only available on Linux, elsewhere creating or opening a segment always fails
+
+#pragma once
+
+#include "protocol.h"
+
+// The capacity of the ring buffer in bytes, a power of two
+#define PROT_SHM_SIZE 262144
+
+// The maximum size of a segment's name including the null character
+#define PROT_SHM_NAME_LEN 64
+
+struct prot_shm;
+
+// Create a new segment that only the same user can open
+// Returns NULL on failure
+struct prot_shm* prot_shm_create();
+
+// Open a segment created by prot_shm_create in another process
+// Returns NULL on failure
+struct prot_shm* prot_shm_open(const char* name);
+
+// The name to give to prot_shm_open
+const char* prot_shm_name(const struct prot_shm* shm);
+
+// Remove the name once the other end has opened the segment, so that it's freed
+// as soon as both ends close it, prot_shm_close does it too
+void prot_shm_unlink(struct prot_shm* shm);
+
+// Writer: append len bytes, either all of them or nothing
+// Returns PROT_ERR_ERR if there isn't enough space (the reader is too far behind) or it has been closed
+int prot_shm_write(struct prot_shm* shm, const char* data, const size_t len);
+
+// Reader: take at max size bytes out of the buffer
+// Returns the number of bytes read, 0 if there's nothing at the moment
+size_t prot_shm_read(struct prot_shm* shm, char* buf, const size_t size);
+
+// Reader: wait at max timeout milliseconds until there is something to read
+// Returns 1 if there is or if the segment has been closed, 0 on timeout
+int prot_shm_wait(struct prot_shm* shm, const unsigned int timeout);
+
+// Whether the other end has closed the segment
+int prot_shm_closed(const struct prot_shm* shm);
+
+// Close the segment and wake the other end up, NULL is ignored
+void prot_shm_close(struct prot_shm* shm);
@@ -0,0 +1,230 @@
+#include "compress.h"
+
+#include <string.h>
+
+// The shortest match worth encoding
+#define MIN_MATCH 4
+
+// The biggest header, a type byte and two 5 byte numbers
+#define MAX_HEADER 11
+
+static Uint32 hash(const unsigned char* data) {
+    Uint32 value;
+    memcpy(&value, data, sizeof(value));
+    return (value * 2654435761u) >> (32 - PROT_HASH_BITS);
+}
+
+// The number of equal bytes at a and b, at max max
+static size_t match_len(const unsigned char* a, const unsigned char* b, const size_t max) {
+    size_t len = 0;
+    while (len < max && a[len] == b[len]) len++;
+    return len;
+}
+
+// Lengths that don't fit into the token continue as 255s and the remainder
+static size_t put_length(unsigned char* out, size_t len) {
+    size_t size = 0;
+    for (; len >= 255; len -= 255)
+        out[size++] = 255;
+    out[size++] = (unsigned char)len;
+    return size;
+}
+
+static int get_length(const unsigned char* in, const size_t len, size_t* pos, size_t* value) {
+    unsigned char byte;
+    do {
+        if (*pos >= len) return PROT_ERR_ERR;
+        byte = in[(*pos)++];
+        *value += byte;
+    } while (byte == 255);
+
+    return PROT_ERR_OK;
+}
+
+// One sequence is the literals followed by a match of match bytes dist bytes back,
+// the last one only has the literals (the payload ends after them)
+// The token holds both lengths, the literals in the upper four bits, the match (minus MIN_MATCH) in the lower
+static size_t put_sequence(unsigned char* out, const unsigned char* literals, const size_t lits, const size_t dist, const size_t match) {
+
+    size_t size = 1;
+    out[0] = (unsigned char)((lits < 15 ? lits : 15) << 4);
+    if (lits >= 15) size += put_length(&out[size], lits - 15);
+    memcpy(&out[size], literals, lits);
+    size += lits;
+
+    if (match == 0) return size;
+
+    out[0] |= (unsigned char)(match - MIN_MATCH < 15 ? match - MIN_MATCH : 15);
+    out[size++] = (unsigned char)(dist & 0xFF);
+    out[size++] = (unsigned char)(dist >> 8);
+    if (match - MIN_MATCH >= 15) size += put_length(&out[size], match - MIN_MATCH - 15);
+
+    return size;
+}
+
+// Greedy LZ77, the matches are looked for in the data itself and in the dictionary,
+// which is seen as if it was right before the data
+// Writes at most len + len/255 + 16 bytes, len can't be over 65535 - the dictionary's size
+static size_t compress(const struct prot_dict* dict, const unsigned char* in, const size_t len, unsigned char* out) {
+
+    // The last position + 1 of every hash in the data
+    Uint16 table[1 << PROT_HASH_BITS];
+    memset(table, 0, sizeof(table));
+
+    const unsigned char* dict_data = dict ? (const unsigned char*)dict->data : NULL;
+    const size_t dict_size = dict ? dict->size : 0;
+
+    size_t size = 0, anchor = 0, pos = 0;
+    while (pos + MIN_MATCH <= len) {
+        Uint32 h = hash(&in[pos]);
+        size_t best = 0, dist = 0;
+
+        if (table[h]) {
+            size_t from = table[h] - 1u;
+            size_t found = match_len(&in[from], &in[pos], len - pos);
+            if (found > best) { best = found; dist = pos - from; }
+        }
+        table[h] = (Uint16)(pos + 1);
+
+        if (dict_size && dict->table[h]) {
+            size_t from = dict->table[h] - 1u;
+            size_t max = dict_size - from < len - pos ? dict_size - from : len - pos;
+            size_t found = match_len(&dict_data[from], &in[pos], max);
+            if (found > best) { best = found; dist = dict_size - from + pos; }
+        }
+
+        if (best < MIN_MATCH) {
+            pos++;
+            continue;
+        }
+
+        size += put_sequence(&out[size], &in[anchor], pos - anchor, dist, best);
+        pos += best;
+        anchor = pos;
+    }
+
+    return size + put_sequence(&out[size], &in[anchor], len - anchor, 0, 0);
+}
+
+static size_t put_number(unsigned char* out, size_t value) {
+    size_t size = 0;
+    for (; value >= 0x80; value >>= 7)
+        out[size++] = (unsigned char)(value & 0x7F) | 0x80;
+    out[size++] = (unsigned char)value;
+    return size;
+}
+
+static int get_number(const unsigned char* in, const size_t len, size_t* pos, size_t* value) {
+    *value = 0;
+    for (int shift = 0; shift < 35; shift += 7) {
+        if (*pos >= len) return 0;
+        unsigned char byte = in[(*pos)++];
+        *value |= (size_t)(byte & 0x7F) << shift;
+        if (!(byte & 0x80)) return 1;
+    }
+
+    return PROT_ERR_ERR;
+}
+
+// Write the header and move the payload (written at MAX_HEADER) right behind it
+static size_t finish_block(unsigned char* out, const char type, const size_t payload, const size_t size) {
+    unsigned char header[MAX_HEADER];
+    size_t len = 0;
+    header[len++] = (unsigned char)type;
+    len += put_number(&header[len], payload);
+    len += put_number(&header[len], size);
+
+    memmove(&out[len], &out[MAX_HEADER], payload);
+    memcpy(out, header, len);
+    return len + payload;
+}
+
+void prot_dict_set(struct prot_dict* dict, const char* data, size_t len) {
+
+    if (len > PROT_DICT_SIZE) {
+        data += len - PROT_DICT_SIZE;
+        len = PROT_DICT_SIZE;
+    }
+
+    memcpy(dict->data, data, len);
+    dict->size = len;
+
+    memset(dict->table, 0, sizeof(dict->table));
+    for (size_t pos = 0; pos + MIN_MATCH <= len; pos++)
+        dict->table[hash((const unsigned char*)&dict->data[pos])] = (Uint16)(pos + 1);
+}
+
+size_t prot_pack(const struct prot_dict* dict, const char* data, const size_t len, const int raw, char* out) {
+
+    unsigned char* block = (unsigned char*)out;
+
+    if (!raw && len <= PROT_PACK_MAX) {
+        size_t payload = compress(dict, (const unsigned char*)data, len, &block[MAX_HEADER]);
+        if (payload < len) return finish_block(block, PROT_BLOCK_PACKED, payload, len);
+    }
+
+    memcpy(&block[MAX_HEADER], data, len);
+    return finish_block(block, PROT_BLOCK_RAW, len, len);
+}
+
+size_t prot_pack_dict(const struct prot_dict* dict, char* out) {
+    unsigned char* block = (unsigned char*)out;
+    size_t payload = compress(NULL, (const unsigned char*)dict->data, dict->size, &block[MAX_HEADER]);
+    return finish_block(block, PROT_BLOCK_DICT, payload, dict->size);
+}
+
+int prot_block_header(const char* data, const size_t len, char* type, size_t* payload, size_t* size) {
+
+    const unsigned char* in = (const unsigned char*)data;
+    if (len == 0) return 0;
+
+    *type = (char)in[0];
+    if (*type != PROT_BLOCK_DICT && *type != PROT_BLOCK_PACKED && *type != PROT_BLOCK_RAW)
+        return PROT_ERR_ERR;
+
+    size_t pos = 1;
+    int status = get_number(in, len, &pos, payload);
+    if (status <= 0) return status;
+    status = get_number(in, len, &pos, size);
+    if (status <= 0) return status;
+
+    if (*type == PROT_BLOCK_RAW && *payload != *size) return PROT_ERR_ERR;
+    if (*type == PROT_BLOCK_DICT && *size > PROT_DICT_SIZE) return PROT_ERR_ERR;
+
+    return (int)pos;
+}
+
+int prot_unpack(const struct prot_dict* dict, const char* payload, const size_t len, char* out, const size_t size) {
+
+    const unsigned char* in = (const unsigned char*)payload;
+    const size_t dict_size = dict ? dict->size : 0;
+
+    size_t pos = 0, done = 0;
+    while (pos < len) {
+        unsigned char token = in[pos++];
+
+        size_t lits = token >> 4;
+        if (lits == 15 && get_length(in, len, &pos, &lits)) return PROT_ERR_ERR;
+        if (lits > len - pos || lits > size - done) return PROT_ERR_ERR;
+        memcpy(&out[done], &in[pos], lits);
+        pos += lits;
+        done += lits;
+
+        // The last sequence has no match
+        if (pos == len) break;
+
+        if (len - pos < 2) return PROT_ERR_ERR;
+        size_t dist = (size_t)in[pos] | (size_t)in[pos+1] << 8;
+        pos += 2;
+
+        size_t match = (token & 15) + MIN_MATCH;
+        if ((token & 15) == 15 && get_length(in, len, &pos, &match)) return PROT_ERR_ERR;
+        if (dist == 0 || dist > done + dict_size || match > size - done) return PROT_ERR_ERR;
+
+        // Byte by byte, the match can overlap what it produces
+        for (size_t from = dict_size + done - dist; match > 0; match--, from++)
+            out[done++] = from < dict_size ? dict->data[from] : out[from - dict_size];
+    }
+
+    return done == size ? PROT_ERR_OK : PROT_ERR_ERR;
+}
@@ -1,9 +1,65 @@
 #include "protocol.h"
+#include "compress.h"
 
 #include <stdlib.h>
 #include <string.h>
 #include <stdarg.h>
 
+// The entries that received messages are checked against, see prot_set_schema
+static const struct prot_schema* schema;
+static size_t schema_count;
+static int schema_direction;
+
+void prot_set_schema(const struct prot_schema* table, const size_t count, const int direction) {
+    schema = table;
+    schema_count = count;
+    schema_direction = direction;
+}
+
+Uint32 prot_head_id(const char head[PROT_HEAD_SIZE]) {
+    return PROT_HEAD_ID(head[0], head[1], head[2]);
+}
+
+// Find the schema entry for head, entry is NULL when there is no schema
+// Returns -1 if the head isn't in the schema
+static int find_entry(const char head[PROT_HEAD_SIZE], const struct prot_schema** entry) {
+
+    *entry = NULL;
+    if (schema_count == 0) return 0;
+
+    Uint32 id = prot_head_id(head);
+    for (size_t i = 0; i < schema_count; i++)
+        if (schema[i].head == id && schema[i].direction == schema_direction) {
+            *entry = &schema[i];
+            return 0;
+        }
+
+    return -1;
+}
+
+// The maximum size of the next argument (the arg-th one) including the null character
+static size_t arg_limit(const struct prot_schema* entry, const int arg) {
+
+    if (!entry) return PROT_MAX_ARG_SIZE;
+
+    // Only the empty argument that ends the message may follow
+    if (arg >= entry->max_args) return 1;
+
+    return entry->max_size[arg] < PROT_MAX_ARG_SIZE ? entry->max_size[arg] : PROT_MAX_ARG_SIZE;
+}
+
+// Receive exactly size bytes, a single receive may return less than that
+static int recv_all(TCPsocket socket, char* buf, const int size) {
+
+    for (int received = 0; received < size; ) {
+        int ret = SDLNet_TCP_Recv(socket, &buf[received], size - received);
+        if (ret <= 0) return PROT_ERR_ERR;
+        received += ret;
+    }
+
+    return PROT_ERR_OK;
+}
+
 // Convenience function, constructs a message that can be sent by prot_send
 struct prot_msg prot_make_msg(const char* head, const int num_args, ...) {
 
@@ -36,13 +92,23 @@ struct prot_msg prot_recv(TCPsocket socket) {
     char* buf = NULL;
 
     // Get head
-    if (SDLNet_TCP_Recv(socket, msg.head, PROT_HEAD_SIZE) != PROT_HEAD_SIZE)
+    if (recv_all(socket, msg.head, PROT_HEAD_SIZE) < 0)
         goto err;
 
+    // The head tells how long the arguments can be
+    const struct prot_schema* entry;
+    if (find_entry(msg.head, &entry) < 0)
+        goto err;
+
+    size_t buf_size = 1;
+    for (int i = 0; i < PROT_MAX_ARGS && buf_size < PROT_MAX_ARG_SIZE; i++)
+        if (arg_limit(entry, i) > buf_size)
+            buf_size = arg_limit(entry, i);
+
     // Receive the null-separated list of arguments terminated by an empty argument
 
     // Intermediate buffer used when reading the arguments
-    buf = malloc(PROT_MAX_ARG_SIZE);
+    buf = malloc(buf_size);
     if (!buf) goto err;
     // Status is used to keep track of the number of arguments
     msg.status = 0;
@@ -52,14 +118,18 @@ struct prot_msg prot_recv(TCPsocket socket) {
         if (msg.status >= PROT_MAX_ARGS) goto err;
 
         // Receive the argument
+        const size_t limit = arg_limit(entry, msg.status);
         size_t size = 0;
         do {
-            if (size >= PROT_MAX_ARG_SIZE) goto err;
+            if (size >= limit) goto err;
             if (SDLNet_TCP_Recv(socket, &buf[size], 1) != 1) goto err;
         } while (buf[size++] != '\0');
 
         // An empty argument means the end
-        if (buf[0] == '\0') break;
+        if (buf[0] == '\0') {
+            if (entry && msg.status < entry->min_args) goto err;
+            break;
+        }
         
         // Strdup reallocates the string and ensures that each argument 
         // is as small as possible (and not PROT_MAX_ARG_SIZE every time)
@@ -102,3 +172,255 @@ int prot_send(TCPsocket socket, const struct prot_msg msg) {
 
     return PROT_ERR_OK;
 }
+
+// Encode a message into a buffer, the result can be sent with a single SDLNet_TCP_Send
+int prot_encode(const struct prot_msg msg, char* buf, const size_t size) {
+
+    if (msg.status < 0 || msg.status > PROT_MAX_ARGS) return PROT_ERR_ERR;
+
+    // The head and the final null-terminator
+    if (size < PROT_HEAD_SIZE + 1) return PROT_ERR_ERR;
+    memcpy(buf, msg.head, PROT_HEAD_SIZE);
+    size_t used = PROT_HEAD_SIZE;
+
+    for (size_t i = 0; i < (size_t)msg.status; i++) {
+
+        size_t len = strlen(msg.args[i])+1;
+        if (len > PROT_MAX_ARG_SIZE) return PROT_ERR_ERR;
+        if (used + len + 1 > size) return PROT_ERR_ERR;
+
+        memcpy(&buf[used], msg.args[i], len);
+        used += len;
+    }
+
+    buf[used++] = '\0';
+
+    return (int)used;
+}
+
+// Decode a message from a buffer, the arguments stay where they are
+int prot_decode(char* data, const size_t len, struct prot_msg* msg) {
+
+    if (len < PROT_HEAD_SIZE) return 0;
+    memcpy(msg->head, data, PROT_HEAD_SIZE);
+
+    const struct prot_schema* entry;
+    if (find_entry(msg->head, &entry) < 0)
+        goto err;
+
+    size_t used = PROT_HEAD_SIZE;
+    msg->status = 0;
+    while (1) {
+
+        if (msg->status >= PROT_MAX_ARGS) goto err;
+
+        // An argument that is already too long is an error even if it isn't complete
+        char* arg = &data[used];
+        const size_t limit = arg_limit(entry, msg->status);
+        const size_t available = len - used;
+        const char* end = memchr(arg, '\0', available < limit ? available : limit);
+        if (!end) {
+            if (available >= limit) goto err;
+            return 0;
+        }
+
+        used += (size_t)(end - arg) + 1;
+
+        // An empty argument means the end
+        if (end == arg) {
+            if (entry && msg->status < entry->min_args) goto err;
+            break;
+        }
+
+        msg->args[msg->status++] = arg;
+    }
+
+    return (int)used;
+
+    err:
+
+    msg->status = PROT_ERR_ERR;
+    return PROT_ERR_ERR;
+}
+
+// Null characters (and the escape character itself) become the escape character followed by the character + 2
+#define PROT_ESCAPE '\x01'
+
+size_t prot_escape(const char* data, const size_t len, char* out) {
+
+    size_t used = 0;
+    for (size_t i = 0; i < len; i++) {
+        if (data[i] == '\0' || data[i] == PROT_ESCAPE) {
+            out[used++] = PROT_ESCAPE;
+            out[used++] = (char)(data[i] + 2);
+        } else
+            out[used++] = data[i];
+    }
+
+    out[used] = '\0';
+    return used;
+}
+
+long prot_unescape(char* arg) {
+
+    size_t len = 0;
+    for (const char* c = arg; *c != '\0'; c++) {
+        if (*c == PROT_ESCAPE) {
+            c++;
+            if (*c != '\0' + 2 && *c != PROT_ESCAPE + 2) return PROT_ERR_ERR;
+            arg[len++] = (char)(*c - 2);
+        } else
+            arg[len++] = *c;
+    }
+
+    return (long)len;
+}
+
+int prot_reader_init(struct prot_reader* reader, TCPsocket socket) {
+
+    reader->buf = malloc(PROT_READER_SIZE);
+    if (!reader->buf) return PROT_ERR_ERR;
+    reader->dict = NULL;
+    reader->packed = NULL;
+
+    prot_reader_reset(reader, socket);
+    return PROT_ERR_OK;
+}
+
+void prot_reader_reset(struct prot_reader* reader, TCPsocket socket) {
+    reader->socket = socket;
+    reader->start = 0;
+    reader->used = 0;
+    reader->last = 0;
+
+    free(reader->dict);
+    free(reader->packed);
+    reader->dict = NULL;
+    reader->packed = NULL;
+}
+
+int prot_reader_compress(struct prot_reader* reader) {
+
+    reader->dict = calloc(1, sizeof(struct prot_dict));
+    reader->packed = malloc(PROT_READER_SIZE);
+    if (!reader->dict || !reader->packed) {
+        prot_reader_reset(reader, reader->socket);
+        return PROT_ERR_ERR;
+    }
+
+    // Whatever came after the last message is already made of blocks
+    reader->packed_start = 0;
+    reader->packed_used = reader->used - reader->start;
+    memcpy(reader->packed, &reader->buf[reader->start], reader->packed_used);
+    reader->start = 0;
+    reader->used = 0;
+
+    return PROT_ERR_OK;
+}
+
+void prot_reader_free(struct prot_reader* reader) {
+    prot_reader_reset(reader, NULL);
+    free(reader->buf);
+    reader->buf = NULL;
+}
+
+// Unpack the next block if it has been received whole
+// Returns 1 if it has been, 0 if it hasn't or PROT_ERR_ERR if the stream is invalid
+static int unpack_block(struct prot_reader* reader) {
+
+    const char* data = &reader->packed[reader->packed_start];
+    const size_t len = reader->packed_used - reader->packed_start;
+
+    char type;
+    size_t payload, size;
+    int header = prot_block_header(data, len, &type, &payload, &size);
+    if (header < 0) return PROT_ERR_ERR;
+    if (header == 0) return 0;
+    if (len - (size_t)header < payload) {
+        // A block that can never fit
+        if ((size_t)header + payload > PROT_READER_SIZE) return PROT_ERR_ERR;
+        return 0;
+    }
+    data += header;
+
+    // The blocks only hold whole messages, so the buffer only ever has the messages of one of them
+    memmove(reader->buf, &reader->buf[reader->start], reader->used - reader->start);
+    reader->used -= reader->start;
+    reader->start = 0;
+
+    if (type == PROT_BLOCK_DICT) {
+        if (prot_unpack(NULL, data, payload, reader->dict->data, size)) return PROT_ERR_ERR;
+        reader->dict->size = size;
+        reader->dict->epoch++;
+    } else {
+        if (size > PROT_READER_SIZE - reader->used) return PROT_ERR_ERR;
+        if (type == PROT_BLOCK_RAW)
+            memcpy(&reader->buf[reader->used], data, size);
+        else if (prot_unpack(reader->dict, data, payload, &reader->buf[reader->used], size))
+            return PROT_ERR_ERR;
+        reader->used += size;
+    }
+
+    reader->packed_start += (size_t)header + payload;
+    return 1;
+}
+
+struct prot_msg prot_read(struct prot_reader* reader) {
+
+    struct prot_msg msg;
+
+    while (1) {
+        int len = prot_decode(&reader->buf[reader->start], reader->used - reader->start, &msg);
+        if (len < 0) break;
+        if (len > 0) {
+            reader->start += (size_t)len;
+            reader->last = (size_t)len;
+            return msg;
+        }
+
+        if (reader->dict) {
+            int unpacked = unpack_block(reader);
+            if (unpacked < 0) break;
+            if (unpacked > 0) continue;
+
+            // Move the incomplete block to the front and receive whatever is available
+            memmove(reader->packed, &reader->packed[reader->packed_start], reader->packed_used - reader->packed_start);
+            reader->packed_used -= reader->packed_start;
+            reader->packed_start = 0;
+
+            int received = SDLNet_TCP_Recv(reader->socket, &reader->packed[reader->packed_used], (int)(PROT_READER_SIZE - reader->packed_used));
+            if (received <= 0) break;
+            reader->packed_used += (size_t)received;
+            continue;
+        }
+
+        // Move the incomplete message to the front and receive whatever is available
+        memmove(reader->buf, &reader->buf[reader->start], reader->used - reader->start);
+        reader->used -= reader->start;
+        reader->start = 0;
+
+        int received = SDLNet_TCP_Recv(reader->socket, &reader->buf[reader->used], (int)(PROT_READER_SIZE - reader->used));
+        if (received <= 0) break;
+        reader->used += (size_t)received;
+    }
+
+    // Don't decode the rest after an error
+    reader->start = reader->used;
+    reader->last = 0;
+    if (reader->dict) reader->packed_start = reader->packed_used;
+    msg.status = PROT_ERR_ERR;
+    return msg;
+}
+
+int prot_reader_ready(struct prot_reader* reader) {
+    struct prot_msg msg;
+    while (1) {
+        if (prot_decode(&reader->buf[reader->start], reader->used - reader->start, &msg) != 0) return 1;
+        if (!reader->dict) return 0;
+
+        // A dictionary block doesn't have any messages, keep going
+        int unpacked = unpack_block(reader);
+        if (unpacked < 0) return 1;
+        if (unpacked == 0) return 0;
+    }
+}
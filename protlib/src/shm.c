@@ -0,0 +1,259 @@
+#ifdef __linux__
+// For syscall
+#define _GNU_SOURCE
+#endif
+
+#include "shm.h"
+
+#include <stdio.h>
+#include <stdlib.h>
+#include <string.h>
+
+#ifdef __linux__
+#include <fcntl.h>
+#include <linux/futex.h>
+#include <sys/mman.h>
+#include <sys/syscall.h>
+#include <time.h>
+#include <unistd.h>
+#endif
+
+#define SHM_MAGIC 0x50534D31 // PSM1
+
+// Where the segments live, opening files there is what shm_open does anyway
+#define SHM_DIR "/dev/shm"
+
+// The beginning of the segment, the ring buffer follows right after it
+// The fields of the writer and the reader are on separate cache lines
+struct shm_header {
+    Uint32 magic;
+    Uint32 size;
+    // Set by either end
+    SDL_atomic_t closed;
+    char pad0[64 - 3*sizeof(Uint32)];
+
+    // The total number of bytes written, only changed by the writer
+    SDL_atomic_t write;
+    char pad1[64 - sizeof(SDL_atomic_t)];
+
+    // The total number of bytes read, only changed by the reader
+    SDL_atomic_t read;
+    // Set while the reader is (about to be) waiting
+    SDL_atomic_t waiting;
+    // The futex the reader waits on, it changes with every wakeup
+    SDL_atomic_t wake;
+};
+
+// The header takes up a whole page so that the buffer is aligned
+#define SHM_HEADER_SIZE 4096
+
+struct prot_shm {
+    struct shm_header* header;
+    char* data;
+    char name[PROT_SHM_NAME_LEN];
+    int linked;
+};
+
+#ifdef __linux__
+
+static void futex_wake(SDL_atomic_t* word) {
+    SDL_AtomicAdd(word, 1);
+    syscall(SYS_futex, &word->value, FUTEX_WAKE, 1, NULL, NULL, 0);
+}
+
+static struct prot_shm* map(const char* name, const int fd) {
+
+    struct prot_shm* shm = malloc(sizeof(*shm));
+    if (!shm) return NULL;
+
+    void* mem = mmap(NULL, SHM_HEADER_SIZE + PROT_SHM_SIZE, PROT_READ | PROT_WRITE, MAP_SHARED, fd, 0);
+    if (mem == MAP_FAILED) {
+        free(shm);
+        return NULL;
+    }
+
+    shm->header = mem;
+    shm->data = (char*)mem + SHM_HEADER_SIZE;
+    snprintf(shm->name, sizeof(shm->name), "%s", name);
+    shm->linked = 0;
+
+    return shm;
+}
+
+static void unmap(struct prot_shm* shm) {
+    munmap(shm->header, SHM_HEADER_SIZE + PROT_SHM_SIZE);
+    free(shm);
+}
+
+struct prot_shm* prot_shm_create() {
+
+    // The name only has to be unique, nobody else can open the file anyway
+    static SDL_atomic_t counter;
+    char name[PROT_SHM_NAME_LEN], path[PROT_SHM_NAME_LEN + sizeof(SHM_DIR)];
+    snprintf(name, sizeof(name), "protlib-%ld-%d", (long)getpid(), SDL_AtomicAdd(&counter, 1));
+    snprintf(path, sizeof(path), SHM_DIR "/%s", name);
+
+    int fd = open(path, O_RDWR | O_CREAT | O_EXCL | O_CLOEXEC, 0600);
+    if (fd < 0) return NULL;
+
+    // The new file is filled with zeros
+    struct prot_shm* shm = NULL;
+    if (ftruncate(fd, SHM_HEADER_SIZE + PROT_SHM_SIZE) == 0)
+        shm = map(name, fd);
+    close(fd);
+
+    if (!shm) {
+        unlink(path);
+        return NULL;
+    }
+
+    shm->header->size = PROT_SHM_SIZE;
+    shm->header->magic = SHM_MAGIC;
+    shm->linked = 1;
+
+    return shm;
+}
+
+struct prot_shm* prot_shm_open(const char* name) {
+
+    // Names with slashes could point anywhere
+    if (strchr(name, '/') || strlen(name) + 1 > PROT_SHM_NAME_LEN)
+        return NULL;
+
+    char path[PROT_SHM_NAME_LEN + sizeof(SHM_DIR)];
+    snprintf(path, sizeof(path), SHM_DIR "/%s", name);
+
+    int fd = open(path, O_RDWR | O_CLOEXEC);
+    if (fd < 0) return NULL;
+
+    // Don't map past the end of a file that isn't what we expect
+    struct prot_shm* shm = NULL;
+    if (lseek(fd, 0, SEEK_END) == SHM_HEADER_SIZE + PROT_SHM_SIZE)
+        shm = map(name, fd);
+    close(fd);
+
+    if (shm && (shm->header->magic != SHM_MAGIC || shm->header->size != PROT_SHM_SIZE)) {
+        unmap(shm);
+        return NULL;
+    }
+
+    return shm;
+}
+
+void prot_shm_unlink(struct prot_shm* shm) {
+
+    if (!shm->linked) return;
+
+    char path[PROT_SHM_NAME_LEN + sizeof(SHM_DIR)];
+    snprintf(path, sizeof(path), SHM_DIR "/%s", shm->name);
+    unlink(path);
+    shm->linked = 0;
+}
+
+int prot_shm_write(struct prot_shm* shm, const char* data, const size_t len) {
+
+    struct shm_header* header = shm->header;
+    if (SDL_AtomicGet(&header->closed))
+        return PROT_ERR_ERR;
+
+    const Uint32 write = (Uint32)SDL_AtomicGet(&header->write);
+    const Uint32 read = (Uint32)SDL_AtomicGet(&header->read);
+    if (len > PROT_SHM_SIZE - (write - read))
+        return PROT_ERR_ERR;
+
+    // The data may wrap around the end of the buffer
+    const size_t offset = write & (PROT_SHM_SIZE - 1);
+    const size_t first = len < PROT_SHM_SIZE - offset ? len : PROT_SHM_SIZE - offset;
+    memcpy(&shm->data[offset], data, first);
+    memcpy(shm->data, &data[first], len - first);
+
+    // Publish the data and only make the system call if the reader is asleep
+    SDL_AtomicSet(&header->write, (int)(write + (Uint32)len));
+    if (SDL_AtomicGet(&header->waiting))
+        futex_wake(&header->wake);
+
+    return PROT_ERR_OK;
+}
+
+size_t prot_shm_read(struct prot_shm* shm, char* buf, const size_t size) {
+
+    struct shm_header* header = shm->header;
+    const Uint32 write = (Uint32)SDL_AtomicGet(&header->write);
+    const Uint32 read = (Uint32)SDL_AtomicGet(&header->read);
+
+    // Don't trust the other process
+    size_t len = write - read;
+    if (len > PROT_SHM_SIZE) {
+        SDL_AtomicSet(&header->closed, 1);
+        return 0;
+    }
+    if (len > size) len = size;
+
+    const size_t offset = read & (PROT_SHM_SIZE - 1);
+    const size_t first = len < PROT_SHM_SIZE - offset ? len : PROT_SHM_SIZE - offset;
+    memcpy(buf, &shm->data[offset], first);
+    memcpy(&buf[first], shm->data, len - first);
+
+    SDL_AtomicSet(&header->read, (int)(read + (Uint32)len));
+
+    return len;
+}
+
+int prot_shm_wait(struct prot_shm* shm, const unsigned int timeout) {
+
+    struct shm_header* header = shm->header;
+
+    // Announce the wait before checking for data, the writer either sees it
+    // and changes the futex or we see its data
+    const int wake = SDL_AtomicGet(&header->wake);
+    SDL_AtomicSet(&header->waiting, 1);
+
+    if (SDL_AtomicGet(&header->write) == SDL_AtomicGet(&header->read) && !SDL_AtomicGet(&header->closed)) {
+        struct timespec ts = { (time_t)(timeout / 1000), (long)(timeout % 1000) * 1000000L };
+        syscall(SYS_futex, &header->wake.value, FUTEX_WAIT, wake, &ts, NULL, 0);
+    }
+
+    SDL_AtomicSet(&header->waiting, 0);
+
+    return SDL_AtomicGet(&header->write) != SDL_AtomicGet(&header->read) || SDL_AtomicGet(&header->closed);
+}
+
+int prot_shm_closed(const struct prot_shm* shm) {
+    return SDL_AtomicGet(&shm->header->closed);
+}
+
+void prot_shm_close(struct prot_shm* shm) {
+
+    if (!shm) return;
+
+    SDL_AtomicSet(&shm->header->closed, 1);
+    futex_wake(&shm->header->wake);
+
+    prot_shm_unlink(shm);
+    unmap(shm);
+}
+
+#else
+
+struct prot_shm* prot_shm_create() {
+    return NULL;
+}
+
+struct prot_shm* prot_shm_open(const char* name) {
+    (void)name;
+    return NULL;
+}
+
+// Nothing can be created or opened, so there's nothing else to do
+void prot_shm_unlink(struct prot_shm* shm) { (void)shm; }
+int prot_shm_write(struct prot_shm* shm, const char* data, const size_t len) { (void)shm; (void)data; (void)len; return PROT_ERR_ERR; }
+size_t prot_shm_read(struct prot_shm* shm, char* buf, const size_t size) { (void)shm; (void)buf; (void)size; return 0; }
+int prot_shm_wait(struct prot_shm* shm, const unsigned int timeout) { (void)shm; (void)timeout; return 1; }
+int prot_shm_closed(const struct prot_shm* shm) { (void)shm; return 1; }
+void prot_shm_close(struct prot_shm* shm) { (void)shm; }
+
+#endif
+
+const char* prot_shm_name(const struct prot_shm* shm) {
+    return shm->name;
+}
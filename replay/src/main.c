@@ -0,0 +1,563 @@
+// Replays a traffic capture of the server (see capture.h in the server) against a running server
+// Every captured connection is opened again and sends the same frames, either at the original
+// pacing or as fast as possible, and the replies are received on all of them. In the end, it
+// reports the throughput and the latency of the broadcast messages, optionally compared with
+// the results of a previous run
+
+#include <SDL_net.h>
+
+#include <stdio.h>
+#include <stdlib.h>
+#include <string.h>
+
+#include "capture.h"
+#include "messages.h"
+#include "protocol.h"
+#include "server.h"
+
+// The maximum number of connections open at once
+#define REPLAY_MAX_CONNECTIONS 64
+// How long to wait for the server to accept a connection, in milliseconds
+#define REPLAY_ACCEPT_TIMEOUT 5000
+// How long to keep receiving after the last record, in milliseconds
+#define REPLAY_DRAIN_TIME 1000
+// How many of the sent messages of every connection wait for being received by another one,
+// and for how long at most, in milliseconds (the server might have dropped or changed them)
+#define REPLAY_MAX_PENDING 4096
+#define REPLAY_LOST_TIME 5000
+// The maximum number of latency samples
+#define REPLAY_MAX_SAMPLES (1024*1024)
+
+// A connection is kept after it's closed, the others can still receive its messages,
+// until the slot is needed again
+static struct connection {
+    // The id in the capture, 0 if the slot has never been used
+    unsigned long captured_id;
+    // The id that the server has given the connection, 0 until it's known
+    unsigned long id;
+    // NULL once the connection is closed
+    TCPsocket socket;
+    struct prot_reader reader;
+    // How many lists of users the server has sent, see finish_connection
+    unsigned long lists;
+    // The messages that have been sent and not received by anyone else yet, a ring buffer
+    // Only the hashes of the texts are kept
+    struct pending_msg {
+        Uint64 time;
+        Uint32 hash;
+        // Another connection has received it already, it's only waiting for the ones before it
+        int received;
+    } pending[REPLAY_MAX_PENDING];
+    size_t pending_start;
+    size_t pending_count;
+} connections[REPLAY_MAX_CONNECTIONS];
+
+static SDLNet_SocketSet sset;
+
+// When the last message has arrived
+static Uint64 last_received;
+
+// The microseconds it took from sending a message to receiving it on another connection
+static Uint32* samples;
+static size_t num_samples;
+
+// What a run has measured, written to and read from the results files
+static struct results {
+    double seconds;
+    unsigned long sent;
+    unsigned long received;
+    unsigned long lost;
+    double sent_per_second;
+    double received_per_second;
+    double latency_avg;
+    double latency_p50;
+    double latency_p99;
+    double latency_max;
+} results;
+
+static Uint32 get_u32(const unsigned char* buf) {
+    return (Uint32)buf[0] | (Uint32)buf[1] << 8 | (Uint32)buf[2] << 16 | (Uint32)buf[3] << 24;
+}
+
+static Uint64 get_u64(const unsigned char* buf) {
+    return (Uint64)get_u32(buf) | (Uint64)get_u32(&buf[4]) << 32;
+}
+
+// FNV-1a
+static Uint32 hash_string(const char* str) {
+    Uint32 hash = 2166136261u;
+    for (; *str; str++)
+        hash = (hash ^ (unsigned char)*str) * 16777619u;
+    return hash;
+}
+
+// Microseconds since some point in the past
+static Uint64 now() {
+    Uint64 ticks = SDL_GetPerformanceCounter();
+    Uint64 freq = SDL_GetPerformanceFrequency();
+    return ticks / freq * 1000000 + ticks % freq * 1000000 / freq;
+}
+
+// Only the open connections
+static struct connection* find_connection(const unsigned long captured_id) {
+    for (size_t i = 0; i < REPLAY_MAX_CONNECTIONS; i++)
+        if (connections[i].socket && connections[i].captured_id == captured_id)
+            return &connections[i];
+    return NULL;
+}
+
+static struct connection* find_server_id(const unsigned long id) {
+    for (size_t i = 0; i < REPLAY_MAX_CONNECTIONS; i++)
+        if (connections[i].id == id && id != 0)
+            return &connections[i];
+    return NULL;
+}
+
+static void close_connection(struct connection* connection) {
+    if (!connection->socket) return;
+
+    SDLNet_TCP_DelSocket(sset, connection->socket);
+    SDLNet_TCP_Close(connection->socket);
+    connection->socket = NULL;
+}
+
+// Remove the oldest pending message of the connection, it's lost if nobody has received it
+static void pop_pending(struct connection* connection) {
+
+    if (!connection->pending[connection->pending_start].received)
+        results.lost++;
+
+    connection->pending_start = (connection->pending_start + 1) % REPLAY_MAX_PENDING;
+    connection->pending_count--;
+}
+
+// Find the message among the ones that the sender is waiting with and take the sample,
+// only the first connection to receive it counts
+static void message_received(struct connection* sender, const char* text) {
+
+    Uint64 time = now();
+
+    // Forget the messages that have been received or waited for too long
+    while (sender->pending_count > 0) {
+        const struct pending_msg* oldest = &sender->pending[sender->pending_start];
+        if (!oldest->received && time - oldest->time < REPLAY_LOST_TIME * 1000) break;
+        pop_pending(sender);
+    }
+
+    Uint32 hash = hash_string(text);
+
+    for (size_t i = 0; i < sender->pending_count; i++) {
+        struct pending_msg* pending = &sender->pending[(sender->pending_start + i) % REPLAY_MAX_PENDING];
+        if (pending->received || pending->hash != hash) continue;
+
+        if (num_samples < REPLAY_MAX_SAMPLES)
+            samples[num_samples++] = (Uint32)(time - pending->time);
+        pending->received = 1;
+        return;
+    }
+}
+
+static void handle_message(struct connection* connection, const struct prot_msg* msg) {
+
+    results.received++;
+    last_received = now();
+
+    switch (prot_head_id(msg->head)) {
+        case SERV_ONL_OUT:
+            connection->lists++;
+        break;
+        case SERV_ACC_OUT:
+            // Args: the last sequence number, the id, the run, the features
+            connection->id = strtoul(msg->args[1], NULL, 10);
+        break;
+        case SERV_MSG_OUT: {
+            // Args: the sequence number, the sender's id, the text
+            struct connection* sender = find_server_id(strtoul(msg->args[1], NULL, 10));
+            if (sender && sender != connection)
+                message_received(sender, msg->args[2]);
+        } break;
+    }
+}
+
+// Receive everything that arrives in at most timeout milliseconds
+static void receive(const Uint32 timeout) {
+
+    // The socket set doesn't know about the messages that are already in the readers
+    int buffered = 0;
+    for (size_t i = 0; i < REPLAY_MAX_CONNECTIONS; i++)
+        if (connections[i].socket && prot_reader_ready(&connections[i].reader))
+            buffered = 1;
+
+    if (SDLNet_CheckSockets(sset, buffered ? 0 : timeout) <= 0 && !buffered)
+        return;
+
+    for (size_t i = 0; i < REPLAY_MAX_CONNECTIONS; i++) {
+        struct connection* connection = &connections[i];
+        if (!connection->socket) continue;
+        if (!SDLNet_SocketReady(connection->socket) && !prot_reader_ready(&connection->reader)) continue;
+
+        do {
+            struct prot_msg msg = prot_read(&connection->reader);
+            if (msg.status < 0) {
+                fprintf(stderr, "The connection %lu was closed by the server\n", connection->captured_id);
+                close_connection(connection);
+                break;
+            }
+            handle_message(connection, &msg);
+        } while (prot_reader_ready(&connection->reader));
+    }
+}
+
+// Receive and handle the next message of the connection, waiting at most REPLAY_ACCEPT_TIMEOUT
+// The server answers right away, so it doesn't matter which socket wakes us up
+// Returns 0 or -1 if nothing has arrived or the connection is closed
+static int receive_from(struct connection* connection) {
+
+    struct prot_msg msg;
+    if ((!prot_reader_ready(&connection->reader) && SDLNet_CheckSockets(sset, REPLAY_ACCEPT_TIMEOUT) <= 0) ||
+        (msg = prot_read(&connection->reader)).status < 0)
+        return -1;
+
+    handle_message(connection, &msg);
+    return prot_head_id(msg.head) == SERV_REF_OUT ? -1 : 0;
+}
+
+static void open_connection(const unsigned long captured_id, IPaddress* addr) {
+
+    // Prefer the slots that have never been used, then the closed connections
+    struct connection* connection = NULL;
+    for (size_t i = 0; i < REPLAY_MAX_CONNECTIONS && !connection; i++)
+        if (connections[i].captured_id == 0)
+            connection = &connections[i];
+    for (size_t i = 0; i < REPLAY_MAX_CONNECTIONS && !connection; i++)
+        if (!connections[i].socket)
+            connection = &connections[i];
+
+    if (!connection) {
+        fprintf(stderr, "Too many connections, the connection %lu is skipped\n", captured_id);
+        return;
+    }
+
+    connection->socket = SDLNet_TCP_Open(addr);
+    if (!connection->socket || SDLNet_TCP_AddSocket(sset, connection->socket) < 0) {
+        fprintf(stderr, "Failed to connect: %s\n", SDLNet_GetError());
+        if (connection->socket) SDLNet_TCP_Close(connection->socket);
+        connection->socket = NULL;
+        connection->captured_id = 0;
+        connection->id = 0;
+        return;
+    }
+
+    connection->captured_id = captured_id;
+    connection->id = 0;
+    connection->lists = 0;
+    connection->pending_start = 0;
+    connection->pending_count = 0;
+    prot_reader_reset(&connection->reader, connection->socket);
+
+    // The server tells the connection its id when it accepts it, wait for it,
+    // so that the messages of the connection are recognised from the start
+    while (connection->id == 0)
+        if (receive_from(connection) < 0) {
+            fprintf(stderr, "The server didn't accept the connection %lu\n", captured_id);
+            close_connection(connection);
+            return;
+        }
+}
+
+// When going fast, make sure that the server has handled everything the connection has sent before
+// closing it, otherwise the messages would be lost, the server answers ONL after all of them
+static void finish_connection(struct connection* connection) {
+
+    unsigned long lists = connection->lists;
+    if (prot_send(connection->socket, prot_make_msg("ONL", 0)) < 0)
+        return;
+
+    while (connection->lists == lists)
+        if (receive_from(connection) < 0)
+            return;
+}
+
+static void send_frame(struct connection* connection, const char* data, const size_t size) {
+
+    // The shared memory can't be replayed, the connection just keeps using the socket
+    // The compression isn't either, the frames are captured decoded and are sent as they are,
+    // so the replay measures the server without it
+    if (size >= PROT_HEAD_SIZE && (!strncmp(data, "SHM", PROT_HEAD_SIZE) || !strncmp(data, "CMP", PROT_HEAD_SIZE)))
+        return;
+
+    if (SDLNet_TCP_Send(connection->socket, data, (int)size) != (int)size) {
+        fprintf(stderr, "Failed to send to the connection %lu\n", connection->captured_id);
+        close_connection(connection);
+        return;
+    }
+
+    results.sent++;
+
+    // Remember the broadcast messages for measuring the latency, the text is the only argument
+    if (size > PROT_HEAD_SIZE && !strncmp(data, "MSG", PROT_HEAD_SIZE)) {
+        if (connection->pending_count == REPLAY_MAX_PENDING)
+            pop_pending(connection);
+
+        struct pending_msg* pending = &connection->pending[(connection->pending_start + connection->pending_count++) % REPLAY_MAX_PENDING];
+        pending->time = now();
+        pending->hash = hash_string(&data[PROT_HEAD_SIZE]);
+        pending->received = 0;
+    }
+}
+
+static int compare_samples(const void* a, const void* b) {
+    Uint32 x = *(const Uint32*)a, y = *(const Uint32*)b;
+    return (x > y) - (x < y);
+}
+
+static void compute_results(const Uint64 duration) {
+
+    results.seconds = (double)duration / 1000000;
+    results.sent_per_second = results.sent / results.seconds;
+    results.received_per_second = results.received / results.seconds;
+
+    if (num_samples == 0) return;
+
+    qsort(samples, num_samples, sizeof(*samples), compare_samples);
+
+    double sum = 0;
+    for (size_t i = 0; i < num_samples; i++)
+        sum += samples[i];
+
+    results.latency_avg = sum / num_samples;
+    results.latency_p50 = samples[num_samples / 2];
+    results.latency_p99 = samples[num_samples * 99 / 100];
+    results.latency_max = samples[num_samples - 1];
+}
+
+// The results files have a line with a name and a value for every field
+#define REPLAY_RESULTS(X) \
+    X(seconds) \
+    X(sent) \
+    X(received) \
+    X(lost) \
+    X(sent_per_second) \
+    X(received_per_second) \
+    X(latency_avg) \
+    X(latency_p50) \
+    X(latency_p99) \
+    X(latency_max)
+
+static int write_results(const char* path) {
+
+    FILE* file = fopen(path, "w");
+    if (!file) return -1;
+
+#define REPLAY_WRITE(name) fprintf(file, #name " %.3f\n", (double)results.name);
+    REPLAY_RESULTS(REPLAY_WRITE)
+#undef REPLAY_WRITE
+
+    return fclose(file);
+}
+
+static int read_results(const char* path, struct results* read) {
+
+    FILE* file = fopen(path, "r");
+    if (!file) return -1;
+
+    char name[32];
+    double value;
+    while (fscanf(file, "%31s %lf", name, &value) == 2) {
+#define REPLAY_READ(field) if (!strcmp(name, #field)) read->field = value;
+        REPLAY_RESULTS(REPLAY_READ)
+#undef REPLAY_READ
+    }
+
+    fclose(file);
+    return 0;
+}
+
+// Print a result and how much it has changed since the baseline (if there is one)
+static void print_result(const char* label, const double value, const double* baseline) {
+
+    if (baseline && *baseline != 0)
+        printf("%-24s %14.3f   (baseline %.3f, %+.1f%%)\n", label, value, *baseline, (value - *baseline) / *baseline * 100);
+    else
+        printf("%-24s %14.3f\n", label, value);
+}
+
+static void print_results(const struct results* baseline) {
+
+#define REPLAY_PRINT(name) print_result(#name, (double)results.name, baseline ? &(double){ (double)baseline->name } : NULL);
+    REPLAY_RESULTS(REPLAY_PRINT)
+#undef REPLAY_PRINT
+
+    if (num_samples == 0)
+        printf("No broadcast message was received, the latency wasn't measured\n");
+}
+
+static void usage(const char* name) {
+    fprintf(stderr, "Usage: %s [-f] [-h <host>] [-p <port>] [-o <results>] [-b <baseline results>] <capture>\n", name);
+    exit(1);
+}
+
+int main(int argc, char* argv[]) {
+
+    int fast = 0;
+    const char* host = "127.0.0.1";
+    unsigned short port = SERV_PORT;
+    const char* output = NULL;
+    const char* baseline_path = NULL;
+    const char* capture_path = NULL;
+
+    for (int i = 1; i < argc; i++) {
+        if (!strcmp(argv[i], "-f"))
+            fast = 1;
+        else if (!strcmp(argv[i], "-h") && i+1 < argc)
+            host = argv[++i];
+        else if (!strcmp(argv[i], "-p") && i+1 < argc)
+            port = (unsigned short)strtoul(argv[++i], NULL, 10);
+        else if (!strcmp(argv[i], "-o") && i+1 < argc)
+            output = argv[++i];
+        else if (!strcmp(argv[i], "-b") && i+1 < argc)
+            baseline_path = argv[++i];
+        else if (argv[i][0] != '-' && !capture_path)
+            capture_path = argv[i];
+        else
+            usage(argv[0]);
+    }
+    if (!capture_path)
+        usage(argv[0]);
+
+    struct results baseline = { 0 };
+    if (baseline_path && read_results(baseline_path, &baseline) < 0) {
+        fprintf(stderr, "Failed to read the baseline results %s\n", baseline_path);
+        exit(1);
+    }
+
+    // The whole capture is loaded, so that reading it doesn't disturb the timing
+    FILE* file = fopen(capture_path, "rb");
+    if (!file) {
+        fprintf(stderr, "Failed to open the capture %s\n", capture_path);
+        exit(1);
+    }
+
+    fseek(file, 0, SEEK_END);
+    long capture_size = ftell(file);
+    fseek(file, 0, SEEK_SET);
+
+    unsigned char* capture = malloc(capture_size > 0 ? (size_t)capture_size : 1);
+    if (!capture || capture_size < CAPTURE_MAGIC_SIZE || fread(capture, 1, (size_t)capture_size, file) != (size_t)capture_size ||
+        memcmp(capture, CAPTURE_MAGIC, CAPTURE_MAGIC_SIZE)) {
+        fprintf(stderr, "The capture %s is invalid\n", capture_path);
+        exit(1);
+    }
+    fclose(file);
+
+    samples = malloc(REPLAY_MAX_SAMPLES * sizeof(*samples));
+    if (!samples) {
+        fprintf(stderr, "Out of memory\n");
+        exit(1);
+    }
+
+    if (SDL_Init(0) < 0 || SDLNet_Init() < 0) {
+        fprintf(stderr, "Failed to initialise SDL: %s\n", SDL_GetError());
+        exit(1);
+    }
+
+    IPaddress addr;
+    if (SDLNet_ResolveHost(&addr, host, port) < 0) {
+        fprintf(stderr, "SDLNet_ResolveHost: %s\n", SDLNet_GetError());
+        exit(1);
+    }
+
+    sset = SDLNet_AllocSocketSet(REPLAY_MAX_CONNECTIONS);
+    if (!sset) {
+        fprintf(stderr, "SDLNet_AllocSocketSet: %s\n", SDLNet_GetError());
+        exit(1);
+    }
+
+    for (size_t i = 0; i < REPLAY_MAX_CONNECTIONS; i++)
+        if (prot_reader_init(&connections[i].reader, NULL) < 0) {
+            fprintf(stderr, "Out of memory\n");
+            exit(1);
+        }
+
+    // We receive what the server sends to the clients
+    prot_set_schema(serv_schema, SDL_arraysize(serv_schema), SERV_DIR_OUT);
+
+    Uint64 start = now();
+    Uint64 first_time = 0;
+    size_t offset = CAPTURE_MAGIC_SIZE;
+
+    while (offset + CAPTURE_HEADER_SIZE <= (size_t)capture_size) {
+
+        const unsigned char* record = &capture[offset];
+        unsigned long captured_id = get_u32(&record[1]);
+        Uint64 time = get_u64(&record[5]);
+        size_t size = get_u32(&record[13]);
+
+        if (offset + CAPTURE_HEADER_SIZE + size > (size_t)capture_size) {
+            fprintf(stderr, "The capture ends with a broken record\n");
+            break;
+        }
+        offset += CAPTURE_HEADER_SIZE + size;
+
+        if (first_time == 0)
+            first_time = time ? time : 1;
+
+        // Receive what has already arrived and wait until it's time for the record (unless going fast)
+        receive(0);
+        if (!fast)
+            while (now() - start < time - first_time) {
+                Uint64 wait = (time - first_time - (now() - start)) / 1000;
+                receive(wait > 0 ? (Uint32)wait : 0);
+            }
+
+        struct connection* connection = find_connection(captured_id);
+
+        switch (record[0]) {
+            case CAPTURE_CONNECT:
+                open_connection(captured_id, &addr);
+            break;
+            case CAPTURE_FRAME:
+                if (connection)
+                    send_frame(connection, (const char*)&record[CAPTURE_HEADER_SIZE], size);
+            break;
+            case CAPTURE_DISCONNECT:
+                if (connection && fast)
+                    finish_connection(connection);
+                if (connection)
+                    close_connection(connection);
+            break;
+        }
+    }
+
+    // The connections that are still open get the rest of the replies, the time spent
+    // waiting for nothing doesn't count
+    Uint64 end = now();
+    while (now() - end < REPLAY_DRAIN_TIME * 1000)
+        receive(10);
+    if (last_received > end)
+        end = last_received;
+
+    // Whatever nobody has received by now is lost
+    for (size_t i = 0; i < REPLAY_MAX_CONNECTIONS; i++)
+        while (connections[i].pending_count > 0)
+            pop_pending(&connections[i]);
+
+    compute_results(end - start);
+    print_results(baseline_path ? &baseline : NULL);
+
+    if (output && write_results(output) != 0)
+        fprintf(stderr, "Failed to write the results %s\n", output);
+
+    for (size_t i = 0; i < REPLAY_MAX_CONNECTIONS; i++) {
+        close_connection(&connections[i]);
+        prot_reader_free(&connections[i].reader);
+    }
+
+    free(samples);
+    free(capture);
+    SDLNet_FreeSocketSet(sset);
+    SDLNet_Quit();
+    SDL_Quit();
+
+    return 0;
+}
@@ -0,0 +1,59 @@
+#pragma once
+
+// The archive of all the broadcast messages
+// Every message is appended to a log file and indexed by its terms, sender and time,
+// so that the clients can search the whole history with QRY, not only the messages
+// that are still in the history ring.
+// The file and the index belong to the archive thread, the main thread only hands it
+// messages and queries and picks up the encoded results, so searching never holds up
+// the chat. Another thread merges the index segments in the background.
+
+#include <SDL_net.h>
+
+#include "server.h"
+
+struct archive_query {
+    // The client that gets the result
+    unsigned long client_id;
+    // Every page has SERV_QUERY_PAGE_LEN messages, page 0 has the newest ones
+    unsigned long page;
+    // The messages have to contain all the words of text and be sent by nick,
+    // empty strings match anything
+    char text[SERV_MAX_MSG_LEN];
+    char nick[SERV_MAX_NICK_LEN];
+    // The inclusive range of times (seconds since the epoch) the messages were sent in
+    Sint64 after;
+    Sint64 before;
+};
+
+// The reply to a query, encoded and ready to be sent
+struct archive_result {
+    struct archive_result* next;
+    unsigned long client_id;
+    size_t size;
+    char data[];
+};
+
+// Open (or create) the log at path, index the messages in it and start the threads
+// next_seq is set to the sequence number after the last archived message
+// Whenever there are new results, a byte is sent to wake_socket
+// Returns 0 on success, the archive stays disabled when it fails
+int archive_init(const char* path, TCPsocket wake_socket, unsigned long* next_seq);
+
+// Archive and index the remaining messages and stop the threads
+void archive_quit();
+
+// Queue a broadcast message to be archived, the strings are copied
+void archive_add(const unsigned long seq, const char* nick, const char* text);
+
+// Fill in the text, nick and time range of query from str, which contains the words to look for
+// and optionally the filters nick:<nick>, after:<time> and before:<time> (seconds since the epoch)
+// Returns 0 on success or -1 if something is too long
+int archive_parse_query(const char* str, struct archive_query* query);
+
+// Queue a query, returns 0 or -1 if the archive is disabled or too many queries are waiting
+// A queued query always gets a result, END without the total if it couldn't be run
+int archive_query(const struct archive_query* query);
+
+// Take all the finished results, oldest first, every one has to be freed with free
+struct archive_result* archive_take_results();
@@ -0,0 +1,39 @@
+#pragma once
+
+// Records all the incoming traffic into a file, so that it can be replayed later (see the replay tool)
+// The main thread only appends the records to a buffer and a separate thread writes them out,
+// so the server doesn't wait for the disk. When the thread falls behind and the buffer is full,
+// the frames are dropped and the server says how many. The connections and disconnections are never
+// dropped, part of the buffer is kept for them (and they wait for the thread if even that is full).
+//
+// The file starts with CAPTURE_MAGIC and then there are the records one after another,
+// every one is a CAPTURE_HEADER_SIZE byte header and the data:
+//   1 byte   the kind of the record (enum capture_kind)
+//   4 bytes  the id of the connection
+//   8 bytes  the time since the capture has started in microseconds
+//   4 bytes  the size of the data
+// All the numbers are little endian, the data of a frame is the message exactly as it was
+// received (the reader's bytes, not encoded again), the other records don't have any data
+
+#include <SDL.h>
+
+#define CAPTURE_MAGIC "CHATCAP1"
+#define CAPTURE_MAGIC_SIZE 8
+#define CAPTURE_HEADER_SIZE 17
+
+enum capture_kind {
+    CAPTURE_CONNECT = 1,
+    CAPTURE_FRAME = 2,
+    CAPTURE_DISCONNECT = 3
+};
+
+// Create (or overwrite) the file at path and start the writing thread
+// Returns 0 on success or -1 on failure, nothing is captured then
+int capture_init(const char* path);
+
+// Write out the remaining records and stop the thread
+void capture_quit();
+
+// Record the size bytes of a message received from the connection, or that it has connected
+// or disconnected (data is NULL then), does nothing unless capturing
+void capture_add(const enum capture_kind kind, const unsigned long connection, const char* data, const size_t size);
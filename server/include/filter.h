@@ -0,0 +1,38 @@
+#pragma once
+
+// The filters that the message texts and the nicks go through before anyone else sees them
+// They run on the main thread after the text has been cleaned by utf8_sanitize,
+// so they always get valid UTF-8 without control characters
+
+#include <stddef.h>
+
+// The maximum number of filters at once
+#define FILTER_MAX_FILTERS 8
+
+// What should happen with the text, a filter can return any combination of these
+enum filter_action {
+    // Let it through, but log it
+    FILTER_FLAG = 1,
+    // Parts of it were replaced
+    FILTER_MASK = 2,
+    // Drop the message or refuse the nick
+    FILTER_REJECT = 4
+};
+
+struct filter {
+    const char* name;
+    // Look at the len bytes of the null-terminated text and return the actions (0 for none),
+    // the text may be changed in place, but its length has to stay the same
+    int (*apply)(void* data, char* text, const size_t len);
+    void* data;
+};
+
+// Add a filter to the end of the pipeline, it has to stay valid until it's removed
+// Returns 0 on success or -1 if there are too many filters
+int filter_add(const struct filter* filter);
+
+void filter_remove(const struct filter* filter);
+
+// Run the text through the filters in the order they were added, until one rejects it
+// Returns all the actions that the filters returned
+int filter_run(char* text, const size_t len);
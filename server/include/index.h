@@ -0,0 +1,104 @@
+#pragma once
+
+// An inverted index over the archived messages
+// Every message is a document, numbered in the order they were archived, and it's
+// indexed by its terms (words) and by its sender's nick
+// New documents go into a builder, which is sealed into an immutable segment once
+// it's full, the segments can then be merged together into bigger ones
+
+#include <SDL.h>
+
+// The number of documents in a builder before it's sealed into a segment
+#define INDEX_SEGMENT_DOCS 1024
+
+// The maximum length of a term in bytes including the null character, longer words are cut
+#define INDEX_MAX_TERM_LEN 32
+
+// The maximum number of terms taken from one text
+#define INDEX_MAX_TERMS 64
+
+// The maximum number of lists that can be intersected, the terms and the nick
+#define INDEX_MAX_LISTS (INDEX_MAX_TERMS+1)
+
+// An increasing list of document numbers
+struct index_list {
+    const Uint32* docs;
+    size_t count;
+};
+
+struct index_term {
+    // Offsets into the segment's text and postings
+    Uint32 text;
+    Uint32 postings;
+    Uint32 count;
+};
+
+// An immutable part of the index, it covers the documents [first_doc, first_doc + num_docs)
+// Segments are shared between threads, they're freed when the last reference is released
+struct index_segment {
+    SDL_atomic_t refs;
+    Uint32 first_doc;
+    Uint32 num_docs;
+    // Sorted by the term text
+    struct index_term* terms;
+    Uint32 num_terms;
+    // The null-terminated terms back to back
+    char* text;
+    Uint32 text_size;
+    // The postings of all the terms back to back
+    Uint32* postings;
+    Uint32 num_postings;
+};
+
+struct index_builder_entry {
+    // NULL if the entry is empty
+    char* term;
+    Uint32* docs;
+    Uint32 count;
+    Uint32 capacity;
+};
+
+// The part of the index that is still being added to, a hash table of terms
+struct index_builder {
+    struct index_builder_entry* entries;
+    size_t capacity;
+    size_t used;
+    Uint32 first_doc;
+    Uint32 num_docs;
+};
+
+// Split text into lowercased terms (runs of letters, digits and non-ASCII characters)
+// Returns the number of terms written to terms
+size_t index_tokenize(const char* text, char terms[][INDEX_MAX_TERM_LEN], const size_t max);
+
+// The term that stands for a sender, it can't collide with a word
+void index_nick_term(const char* nick, char term[INDEX_MAX_TERM_LEN]);
+
+// Add the document doc (it must be the next one) with the given terms
+// Returns 0 on success or -1 when out of memory
+int index_builder_add(struct index_builder* builder, const Uint32 doc, char terms[][INDEX_MAX_TERM_LEN], const size_t num_terms);
+
+// Returns 0 and the postings in list, or -1 if the term isn't there
+int index_builder_find(const struct index_builder* builder, const char* term, struct index_list* list);
+
+// Turn the builder's contents into a segment with one reference and empty the builder
+// Returns NULL when out of memory, the builder is left as it was
+struct index_segment* index_builder_seal(struct index_builder* builder);
+
+void index_builder_free(struct index_builder* builder);
+
+// Returns 0 and the postings in list, or -1 if the term isn't there
+int index_segment_find(const struct index_segment* segment, const char* term, struct index_list* list);
+
+// Merge two adjacent segments, older has to come right before newer
+// Returns a new segment with one reference or NULL when out of memory
+struct index_segment* index_merge(const struct index_segment* older, const struct index_segment* newer);
+
+void index_segment_retain(struct index_segment* segment);
+void index_segment_release(struct index_segment* segment);
+
+// Go through the documents from [from, to) that are in all the lists (at most INDEX_MAX_LISTS),
+// starting with the newest
+// found is called for each one and the search stops when it returns nonzero
+void index_intersect(const struct index_list* lists, const size_t num_lists, const Uint32 from, const Uint32 to,
+                     int (*found)(void* data, Uint32 doc), void* data);
@@ -0,0 +1,58 @@
+#pragma once
+
+// Finding many patterns in a text at once in a single pass, ignoring the case of ASCII letters
+// The patterns are compiled into an Aho-Corasick automaton which is turned into a full
+// state table (a DFA), so every byte of the text costs one lookup
+// The bytes that don't appear in any pattern all share one column of the table,
+// which keeps it small even for thousands of patterns
+
+#include <SDL.h>
+
+struct matcher_pattern {
+    char* text;
+    size_t len;
+    int value;
+};
+
+struct matcher {
+    // The patterns, added with matcher_add
+    struct matcher_pattern* patterns;
+    size_t num_patterns;
+    size_t patterns_capacity;
+
+    // The rest is filled in by matcher_compile
+    // The column of the table for every byte
+    Uint16 classes[256];
+    Uint32 num_classes;
+    // num_states rows of num_classes transitions, a transition is the index of
+    // the first entry of the next state's row, with MATCHER_OUTPUT set if the state
+    // is the end of a pattern
+    Uint32* table;
+    Uint32 num_states;
+    // For every state, the pattern that ends there (or -1) and the next state
+    // (a shorter suffix) with a pattern ending there (or 0)
+    Sint32* output;
+    Uint32* next_output;
+};
+
+#define MATCHER_OUTPUT 0x80000000u
+
+// Called for every occurrence of a pattern, with the position of its first byte in the text
+typedef void (*matcher_callback)(void* data, size_t start, const struct matcher_pattern* pattern);
+
+void matcher_init(struct matcher* matcher);
+
+// Add a pattern of len bytes (it's copied), when the same pattern is added
+// more than once, the one with the highest value is kept
+// Must be called before matcher_compile, returns 0 on success or -1 when out of memory
+int matcher_add(struct matcher* matcher, const char* pattern, const size_t len, const int value);
+
+// Build the state table from the patterns, returns 0 on success or -1 on failure
+int matcher_compile(struct matcher* matcher);
+
+// Report every occurrence of all the patterns in the text, ordered by where they end
+// The callback may change the bytes of the text that were already reported
+void matcher_scan(const struct matcher* matcher, const char* text, const size_t len,
+                  matcher_callback callback, void* data);
+
+void matcher_free(struct matcher* matcher);
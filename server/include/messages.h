@@ -0,0 +1,68 @@
+#pragma once
+
+// The table of all the messages that the server and the clients exchange, see format.md
+// It's turned into the protlib schema that checks every received message and into
+// the enum of packed heads used to tell the messages apart, so a new message is just a new row
+
+#include "protocol.h"
+#include "server.h"
+#include "shm.h"
+
+// The maximum size of a decimal number argument including the null character
+#define SERV_MAX_NUM_LEN 24
+
+// The maximum size of the list of users in ONL, a line with an id and a nick for everyone
+#define SERV_MAX_PRESENCE_LEN (SERV_MAX_CLIENTS * (SERV_MAX_NUM_LEN + SERV_MAX_NICK_LEN))
+
+// The optional features of the server are listed in ACC, separated by spaces
+#define SERV_MAX_FEATURES_LEN 64
+// The stream to the client can be compressed, see CMP
+#define SERV_FEATURE_COMPRESSION "lz"
+
+// Who sends the message, from the server's point of view
+enum serv_direction {
+    SERV_DIR_IN = 1,  // From a client to the server
+    SERV_DIR_OUT = 2  // From the server to a client
+};
+
+// Head (name and letters), direction, minimum and maximum number of arguments,
+// maximum sizes of the arguments (0 if there are none)
+#define SERV_MESSAGES(X) \
+    X(ACC, 'A','C','C', OUT, 3, 4, SERV_MAX_NUM_LEN, SERV_MAX_NUM_LEN, SERV_MAX_NUM_LEN, SERV_MAX_FEATURES_LEN) \
+    X(REF, 'R','E','F', OUT, 0, 0, 0) \
+    X(MSG, 'M','S','G', IN,  1, 1, SERV_MAX_MSG_LEN) \
+    X(MSG, 'M','S','G', OUT, 3, 3, SERV_MAX_NUM_LEN, SERV_MAX_NUM_LEN, SERV_MAX_MSG_LEN) \
+    X(NIC, 'N','I','C', IN,  1, 1, SERV_MAX_NICK_LEN) \
+    X(NIC, 'N','I','C', OUT, 1, 1, SERV_MAX_NICK_LEN) \
+    X(RES, 'R','E','S', IN,  4, 4, SERV_MAX_NUM_LEN, SERV_MAX_NUM_LEN, SERV_MAX_NUM_LEN, SERV_MAX_NICK_LEN) \
+    X(USR, 'U','S','R', OUT, 1, 2, SERV_MAX_NUM_LEN, SERV_MAX_NICK_LEN) \
+    X(ONL, 'O','N','L', IN,  0, 0, 0) \
+    X(ONL, 'O','N','L', OUT, 1, 2, SERV_MAX_NUM_LEN, SERV_MAX_PRESENCE_LEN) \
+    X(PRS, 'P','R','S', OUT, 2, 3, SERV_MAX_NUM_LEN, SERV_MAX_NUM_LEN, SERV_MAX_NICK_LEN) \
+    X(QRY, 'Q','R','Y', IN,  2, 2, SERV_MAX_NUM_LEN, SERV_MAX_MSG_LEN) \
+    X(HIT, 'H','I','T', OUT, 4, 4, SERV_MAX_NUM_LEN, SERV_MAX_NUM_LEN, SERV_MAX_NICK_LEN, SERV_MAX_MSG_LEN) \
+    X(END, 'E','N','D', OUT, 1, 2, SERV_MAX_NUM_LEN, SERV_MAX_NUM_LEN) \
+    X(SHM, 'S','H','M', IN,  0, 1, PROT_SHM_NAME_LEN) \
+    X(SHM, 'S','H','M', OUT, 0, 1, PROT_SHM_NAME_LEN) \
+    X(CMP, 'C','M','P', IN,  0, 0, 0) \
+    X(CMP, 'C','M','P', OUT, 0, 0, 0) \
+    X(OFR, 'O','F','R', IN,  4, 4, SERV_MAX_NUM_LEN, SERV_MAX_NUM_LEN, SERV_MAX_FILE_NAME_LEN, SERV_MAX_NUM_LEN) \
+    X(OFR, 'O','F','R', OUT, 4, 4, SERV_MAX_NUM_LEN, SERV_MAX_NUM_LEN, SERV_MAX_FILE_NAME_LEN, SERV_MAX_NUM_LEN) \
+    X(CHK, 'C','H','K', IN,  1, 3, SERV_MAX_NUM_LEN, SERV_MAX_NUM_LEN, SERV_MAX_CHUNK_LEN) \
+    X(CHK, 'C','H','K', OUT, 1, 3, SERV_MAX_NUM_LEN, SERV_MAX_NUM_LEN, SERV_MAX_CHUNK_LEN) \
+    X(ACK, 'A','C','K', IN,  1, 2, SERV_MAX_NUM_LEN, SERV_MAX_NUM_LEN) \
+    X(ACK, 'A','C','K', OUT, 1, 2, SERV_MAX_NUM_LEN, SERV_MAX_NUM_LEN)
+
+// SERV_<head>_IN and SERV_<head>_OUT are the packed heads, to be compared with prot_head_id
+enum serv_head {
+#define SERV_HEAD_ENUM(name, a, b, c, dir, min_args, max_args, ...) SERV_##name##_##dir = PROT_HEAD_ID(a, b, c),
+    SERV_MESSAGES(SERV_HEAD_ENUM)
+#undef SERV_HEAD_ENUM
+};
+
+// The schema for prot_set_schema, with SERV_DIR_IN on the server and SERV_DIR_OUT on the clients
+static const struct prot_schema serv_schema[] = {
+#define SERV_SCHEMA_ENTRY(name, a, b, c, dir, min_args, max_args, ...) { PROT_HEAD_ID(a, b, c), SERV_DIR_##dir, min_args, max_args, { __VA_ARGS__ } },
+    SERV_MESSAGES(SERV_SCHEMA_ENTRY)
+#undef SERV_SCHEMA_ENTRY
+};
@@ -0,0 +1,81 @@
+#pragma once
+
+// The messages waiting to be written to a client's socket, every client has a thread
+// that writes them, so that the main loop never waits for a slow client
+// There are two lanes, the chat and everything else goes into the high priority one,
+// the chunks of file transfers into the low priority one, which is only written
+// a slice at a time and only when the high priority lane is empty
+// A switch (see outbox_push_switch) is written after everything queued before it
+
+#include <SDL_net.h>
+
+#include "server.h"
+
+enum outbox_lane {
+    OUTBOX_HIGH,
+    OUTBOX_LOW
+};
+
+// A message in the low priority lane
+struct outbox_frame {
+    struct outbox_frame* next;
+    // Set on the frame pushed by outbox_push_switch
+    int barrier;
+    size_t size;
+    char data[];
+};
+
+struct outbox {
+    TCPsocket socket;
+    SDL_Thread* thread;
+    // Protects everything below
+    SDL_mutex* lock;
+    SDL_cond* cond;
+
+    // The high priority lane, messages back to back, written all at once
+    char* high;
+    size_t high_used;
+    size_t high_size;
+
+    // The low priority lane
+    struct outbox_frame* low_head;
+    struct outbox_frame* low_tail;
+    size_t low_used;
+    // The number of barriers in the low priority lane, the high priority one waits for them
+    int barriers;
+
+    // Set by outbox_quit, the thread then closes the socket, frees the outbox and exits
+    int stop;
+    // Set when a write fails or a lane is full
+    SDL_atomic_t failed;
+};
+
+// Start writing to the socket, the outbox takes it over, it's closed by outbox_quit
+// Returns NULL on failure
+struct outbox* outbox_create(TCPsocket socket);
+
+// Append the encoded messages to the lane
+// Returns 0 on success or -1 if the lane is full or a write has failed (the client should be disconnected)
+int outbox_push(struct outbox* outbox, const enum outbox_lane lane, const char* data, const size_t size);
+
+// A frame with space for size bytes of data, so that a message can be encoded straight into it
+// and then pushed with outbox_push_frame without being copied again, NULL when out of memory
+struct outbox_frame* outbox_frame_create(const size_t size);
+
+// Append the frame (with its size set to what has been written) to the low priority lane,
+// the outbox takes it over, it's freed even if it fails
+// Returns the same as outbox_push
+int outbox_push_frame(struct outbox* outbox, struct outbox_frame* frame);
+
+// Append the encoded message after everything that is queued in both lanes, whatever is pushed
+// afterwards is only written after it, for the last message before the stream changes
+// (the high priority lane waits, the low priority one is written at once until it gets there)
+// Returns the same as outbox_push
+int outbox_push_switch(struct outbox* outbox, const char* data, const size_t size);
+
+int outbox_failed(struct outbox* outbox);
+
+// Throw away what hasn't been written yet and stop the thread, it closes the socket and frees
+// the outbox once it finishes the write it's doing at the moment, the outbox can't be used anymore
+// (a write to a client that doesn't read only ends when the connection fails)
+void outbox_quit(struct outbox* outbox);
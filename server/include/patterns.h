@@ -0,0 +1,19 @@
+#pragma once
+
+// A filter that looks for the patterns listed in a file, a line of the file is an action
+// (mask, flag or reject) and a pattern separated by a space, lines starting with # are comments
+//
+//     mask darn
+//     reject http://
+//
+// The patterns are found anywhere in the text regardless of the case of ASCII letters,
+// masking replaces every byte of the found pattern with *
+// The file is checked for changes every SERV_FILTER_RELOAD_INTERVAL milliseconds and
+// loaded again on a separate thread, the main thread only picks up the new patterns
+
+// Load the patterns, start watching the file and add the filter to the pipeline
+// A missing file is fine, it's loaded once it appears
+// Returns 0 on success or -1 on failure
+int patterns_init(const char* path);
+
+void patterns_quit();
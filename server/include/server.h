@@ -9,3 +9,52 @@
 
 // Maximum number of concurrent clients
 #define SERV_MAX_CLIENTS 8
+
+// The number of the most recent broadcast messages that the server remembers,
+// a reconnecting client gets the ones it missed (if they are still there)
+#define SERV_HISTORY_LEN 256
+
+// The file that every broadcast message is appended to, they can all be searched with QRY
+#define SERV_LOG_PATH "history.log"
+
+// The number of messages in one page of search results
+#define SERV_QUERY_PAGE_LEN 16
+
+// The maximum number of queries waiting to be run, more are refused
+#define SERV_MAX_PENDING_QUERIES 32
+
+// The file with the patterns that the content filter looks for in the messages and nicks
+#define SERV_FILTER_PATH "filter.txt"
+
+// How often the filter patterns file is checked for changes in milliseconds
+#define SERV_FILTER_RELOAD_INTERVAL 1000
+
+// The maximum number of bytes waiting to be written to a client in each lane of its outbox,
+// a client that doesn't read them is disconnected
+#define SERV_OUTBOX_SIZE (1024*1024)
+
+// The maximum number of bytes of file chunks written at once, between them the chat can go first
+#define SERV_OUTBOX_SLICE 8192
+
+// The maximum length of the name of an offered file in bytes, including the null character
+#define SERV_MAX_FILE_NAME_LEN 128
+
+// The number of bytes of a file in one chunk, they are escaped (see prot_escape),
+// so a chunk takes up at most twice as much in a message
+#define SERV_CHUNK_LEN 2040
+#define SERV_MAX_CHUNK_LEN (2*SERV_CHUNK_LEN + 1)
+
+// How many bytes of a file the sender can send before the recipient acknowledges them
+#define SERV_TRANSFER_WINDOW 65536
+
+// The number of bytes of broadcast messages after which the last of them become the new compression
+// dictionary, every client with compression gets it before its next compressed message
+// The first one is made as soon as there's enough for a whole dictionary
+#define SERV_DICT_INTERVAL (1024*1024)
+
+// The maximum number of file transfers going on at once
+#define SERV_MAX_TRANSFERS 32
+
+// The size of each of the two buffers of the traffic capture, the frames that
+// arrive while one is full and the other one is being written out are dropped
+#define SERV_CAPTURE_BUFFER_SIZE (1024*1024)
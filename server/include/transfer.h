@@ -0,0 +1,38 @@
+#pragma once
+
+// The file transfers that the server relays between the clients
+// The sender numbers its transfers itself, the recipient gets the server's id for it
+
+#include <SDL.h>
+
+#include "server.h"
+
+struct transfer {
+    // 0 if the entry is free
+    unsigned long id;
+    // The ids of the clients
+    unsigned long sender;
+    unsigned long recipient;
+    // The sender's number for the transfer
+    Uint64 sender_id;
+    Uint64 size;
+    // How many bytes the recipient has received
+    Uint64 acked;
+    // Set once the recipient has accepted the offer
+    int accepted;
+};
+
+// Returns NULL if there are too many transfers
+struct transfer* transfer_add(const unsigned long sender, const Uint64 sender_id, const unsigned long recipient, const Uint64 size);
+
+// Returns NULL if there's no such transfer
+struct transfer* transfer_find(const unsigned long id);
+
+// Find a transfer by the sender's number, returns NULL if there's no such transfer
+struct transfer* transfer_find_sent(const unsigned long sender, const Uint64 sender_id);
+
+// The next transfer after prev (NULL for the first one) that the client sends or receives
+// Returns NULL when there are no more
+struct transfer* transfer_next_of(const unsigned long client, struct transfer* prev);
+
+void transfer_remove(struct transfer* transfer);
@@ -0,0 +1,18 @@
+#pragma once
+
+// Checking the text that the clients send, so that the others only ever get valid UTF-8
+// without any control characters that could mess up their output
+
+#include <stddef.h>
+
+enum utf8_mode {
+    // Remove the control characters, except for tabs and line breaks
+    UTF8_STRIP,
+    // Fail on any control character
+    UTF8_REJECT
+};
+
+// Check that the len bytes of str are valid UTF-8 and deal with the control characters
+// (C0, DEL and C1) according to mode, the string is changed in place and null-terminated
+// Returns the new length or -1 if the string is invalid
+long utf8_sanitize(char* str, const size_t len, const enum utf8_mode mode);
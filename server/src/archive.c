@@ -0,0 +1,690 @@
+#include "archive.h"
+
+#include <stdio.h>
+#include <stdlib.h>
+#include <string.h>
+#include <time.h>
+
+#include "index.h"
+#include "protocol.h"
+
+// Every record in the log is a header followed by the nick and the text (without the null characters)
+// Header: sequence number (8 bytes), time (8 bytes), nick length (2 bytes), text length (2 bytes)
+// All the numbers are little-endian
+#define LOG_HEADER_SIZE 20
+
+// The largest encoded HIT message, the numbers take at most 20 digits and a sign
+#define MAX_HIT_SIZE (PROT_HEAD_SIZE + 22 + 22 + SERV_MAX_NICK_LEN + SERV_MAX_MSG_LEN + 1)
+
+// Work for the archive thread, either a message to archive or a query
+struct job {
+    struct job* next;
+    int is_query;
+    union {
+        struct {
+            unsigned long seq;
+            Sint64 time;
+            char nick[SERV_MAX_NICK_LEN];
+            char text[SERV_MAX_MSG_LEN];
+        } msg;
+        struct archive_query query;
+    } u;
+};
+
+static int running = 0;
+
+// Protects the jobs and the results, which are linked lists
+static SDL_mutex* lock;
+static SDL_cond* jobs_cond;
+static struct job* jobs_head;
+static struct job* jobs_tail;
+static int pending_queries;
+static struct archive_result* results_head;
+static struct archive_result* results_tail;
+static int stop;
+
+static SDL_Thread* archive_thread;
+static TCPsocket wake;
+
+// Everything from here on belongs to the archive thread (or to archive_init before it starts)
+static FILE* log_file;
+static long log_end;
+
+// The file offset and time of every document (archived message)
+static struct doc {
+    long offset;
+    Sint64 time;
+}* docs;
+static Uint32 num_docs;
+static Uint32 docs_capacity;
+
+// The newest documents that aren't in a segment yet
+static struct index_builder builder;
+
+// The sealed segments from the oldest, shared with the merging thread
+static SDL_mutex* segments_lock;
+static SDL_cond* merge_cond;
+static struct index_segment** segments;
+static size_t num_segments;
+static size_t segments_capacity;
+static int merge_stop;
+static SDL_Thread* merge_thread;
+
+static void put_u64(char* buf, Uint64 value) {
+    for (int i = 0; i < 8; i++, value >>= 8)
+        buf[i] = (char)(value & 0xFF);
+}
+
+static Uint64 get_u64(const char* buf) {
+    Uint64 value = 0;
+    for (int i = 7; i >= 0; i--)
+        value = value << 8 | (unsigned char)buf[i];
+    return value;
+}
+
+static void put_u16(char* buf, Uint16 value) {
+    buf[0] = (char)(value & 0xFF);
+    buf[1] = (char)(value >> 8);
+}
+
+static Uint16 get_u16(const char* buf) {
+    return (Uint16)((unsigned char)buf[0] | (unsigned char)buf[1] << 8);
+}
+
+// Add a sealed segment and let the merging thread know
+static int add_segment(struct index_segment* segment) {
+
+    SDL_LockMutex(segments_lock);
+
+    if (num_segments == segments_capacity) {
+        size_t capacity = segments_capacity ? segments_capacity*2 : 16;
+        struct index_segment** new_segments = realloc(segments, capacity * sizeof(struct index_segment*));
+        if (!new_segments) {
+            SDL_UnlockMutex(segments_lock);
+            return -1;
+        }
+
+        segments = new_segments;
+        segments_capacity = capacity;
+    }
+
+    segments[num_segments++] = segment;
+
+    SDL_CondSignal(merge_cond);
+    SDL_UnlockMutex(segments_lock);
+
+    return 0;
+}
+
+// Index an archived message as the next document
+static int index_message(const long offset, const Sint64 time, const char* nick, const char* text) {
+
+    if (num_docs == docs_capacity) {
+        Uint32 capacity = docs_capacity ? docs_capacity*2 : 1024;
+        struct doc* new_docs = realloc(docs, capacity * sizeof(struct doc));
+        if (!new_docs) return -1;
+
+        docs = new_docs;
+        docs_capacity = capacity;
+    }
+
+    static char terms[INDEX_MAX_LISTS][INDEX_MAX_TERM_LEN];
+    size_t num_terms = index_tokenize(text, terms, INDEX_MAX_TERMS);
+    index_nick_term(nick, terms[num_terms++]);
+
+    if (index_builder_add(&builder, num_docs, terms, num_terms) < 0)
+        return -1;
+
+    docs[num_docs].offset = offset;
+    docs[num_docs].time = time;
+    num_docs++;
+
+    if (builder.num_docs == INDEX_SEGMENT_DOCS) {
+        struct index_segment* segment = index_builder_seal(&builder);
+        if (!segment || add_segment(segment) < 0) {
+            if (segment) index_segment_release(segment);
+            return -1;
+        }
+    }
+
+    return 0;
+}
+
+// Read the record at offset, nick and text have to be SERV_MAX_NICK_LEN and SERV_MAX_MSG_LEN long
+// Returns the size of the record or -1 if it's incomplete or broken
+static long read_record(const long offset, unsigned long* seq, Sint64* time, char* nick, char* text) {
+
+    char header[LOG_HEADER_SIZE];
+    if (fseek(log_file, offset, SEEK_SET) != 0 || fread(header, 1, LOG_HEADER_SIZE, log_file) != LOG_HEADER_SIZE)
+        return -1;
+
+    size_t nick_len = get_u16(&header[16]), text_len = get_u16(&header[18]);
+    if (nick_len >= SERV_MAX_NICK_LEN || text_len >= SERV_MAX_MSG_LEN)
+        return -1;
+
+    if (fread(nick, 1, nick_len, log_file) != nick_len || fread(text, 1, text_len, log_file) != text_len)
+        return -1;
+
+    nick[nick_len] = '\0';
+    text[text_len] = '\0';
+    *seq = (unsigned long)get_u64(&header[0]);
+    *time = (Sint64)get_u64(&header[8]);
+
+    return (long)(LOG_HEADER_SIZE + nick_len + text_len);
+}
+
+static void archive_message(const unsigned long seq, const Sint64 time, const char* nick, const char* text) {
+
+    size_t nick_len = strlen(nick), text_len = strlen(text);
+
+    char header[LOG_HEADER_SIZE];
+    put_u64(&header[0], seq);
+    put_u64(&header[8], (Uint64)time);
+    put_u16(&header[16], (Uint16)nick_len);
+    put_u16(&header[18], (Uint16)text_len);
+
+    // Queries move around the file, so always go back to the end
+    if (fseek(log_file, log_end, SEEK_SET) != 0 ||
+        fwrite(header, 1, LOG_HEADER_SIZE, log_file) != LOG_HEADER_SIZE ||
+        fwrite(nick, 1, nick_len, log_file) != nick_len ||
+        fwrite(text, 1, text_len, log_file) != text_len) {
+        fprintf(stderr, "Failed to archive message %lu\n", seq);
+        return;
+    }
+
+    long offset = log_end;
+    log_end += (long)(LOG_HEADER_SIZE + nick_len + text_len);
+
+    if (index_message(offset, time, nick, text) < 0)
+        fprintf(stderr, "Failed to index message %lu\n", seq);
+}
+
+struct query_state {
+    unsigned long skip;
+    unsigned long total;
+    Uint32 page[SERV_QUERY_PAGE_LEN];
+    size_t page_len;
+};
+
+static int query_found(void* data, Uint32 doc) {
+
+    struct query_state* state = data;
+
+    if (state->total >= state->skip && state->page_len < SERV_QUERY_PAGE_LEN)
+        state->page[state->page_len++] = doc;
+    state->total++;
+
+    // Go on, all of them are counted
+    return 0;
+}
+
+// The first document at or after time
+static Uint32 find_time(const Sint64 time) {
+
+    // The documents are archived in order, so their times only increase
+    Uint32 begin = 0, end = num_docs;
+    while (begin < end) {
+        Uint32 mid = begin + (end - begin)/2;
+        if (docs[mid].time < time)
+            begin = mid+1;
+        else
+            end = mid;
+    }
+    return begin;
+}
+
+// Look for the documents in a part of the index, the builder if segment is NULL
+static void query_part(const struct index_segment* segment, char terms[][INDEX_MAX_TERM_LEN], const size_t num_terms,
+                       const Uint32 from, const Uint32 to, struct query_state* state) {
+
+    struct index_list lists[INDEX_MAX_LISTS];
+
+    for (size_t i = 0; i < num_terms; i++) {
+        int found = segment ? index_segment_find(segment, terms[i], &lists[i]) : index_builder_find(&builder, terms[i], &lists[i]);
+        if (found < 0) return;
+    }
+
+    index_intersect(lists, num_terms, from, to, query_found, state);
+}
+
+static void push_result(struct archive_result* result) {
+
+    SDL_LockMutex(lock);
+
+    int was_empty = results_head == NULL;
+    if (results_tail)
+        results_tail->next = result;
+    else
+        results_head = result;
+    results_tail = result;
+
+    SDL_UnlockMutex(lock);
+
+    // Only wake the main loop once, it takes all the results at once
+    if (was_empty)
+        SDLNet_TCP_Send(wake, "!", 1);
+}
+
+// The query couldn't be run, the client still gets END, without the total
+static void refuse_query(const struct archive_query* query) {
+
+    struct archive_result* result = malloc(sizeof(struct archive_result) + MAX_HIT_SIZE);
+    if (!result) {
+        fprintf(stderr, "Failed to refuse a query of the client %lu\n", query->client_id);
+        return;
+    }
+
+    result->next = NULL;
+    result->client_id = query->client_id;
+
+    // Args: page
+    char page_str[24];
+    snprintf(page_str, sizeof(page_str), "%lu", query->page);
+    int size = prot_encode(prot_make_msg("END", 1, page_str), result->data, MAX_HIT_SIZE);
+    result->size = size > 0 ? (size_t)size : 0;
+
+    push_result(result);
+}
+
+static void run_query(const struct archive_query* query) {
+
+    static char terms[INDEX_MAX_LISTS][INDEX_MAX_TERM_LEN];
+    size_t num_terms = index_tokenize(query->text, terms, INDEX_MAX_TERMS);
+    if (query->nick[0] != '\0')
+        index_nick_term(query->nick, terms[num_terms++]);
+
+    struct query_state state;
+    memset(&state, 0, sizeof(state));
+    state.skip = query->page * SERV_QUERY_PAGE_LEN;
+
+    // The time range is a range of documents
+    const Uint32 from = find_time(query->after);
+    const Uint32 to = query->before < query->after ? from :
+                      query->before == SDL_MAX_SINT64 ? num_docs : find_time(query->before + 1);
+
+    if (num_terms == 0) {
+        // Every document in the range matches
+        state.total = to > from ? to - from : 0;
+        for (Uint32 doc = to - (Uint32)(state.skip < state.total ? state.skip : state.total); doc > from && state.page_len < SERV_QUERY_PAGE_LEN; doc--)
+            state.page[state.page_len++] = doc-1;
+    } else {
+        // The newest documents are in the builder, then go through the segments from the newest
+        query_part(NULL, terms, num_terms, from, to, &state);
+
+        SDL_LockMutex(segments_lock);
+        size_t count = num_segments;
+        struct index_segment** snapshot = malloc((count ? count : 1) * sizeof(struct index_segment*));
+        if (snapshot) {
+            for (size_t i = 0; i < count; i++) {
+                snapshot[i] = segments[i];
+                index_segment_retain(snapshot[i]);
+            }
+        }
+        SDL_UnlockMutex(segments_lock);
+
+        if (!snapshot) {
+            refuse_query(query);
+            return;
+        }
+
+        for (size_t i = count; i > 0; i--) {
+            const struct index_segment* segment = snapshot[i-1];
+            if (segment->first_doc + segment->num_docs > from && segment->first_doc < to)
+                query_part(segment, terms, num_terms, from, to, &state);
+
+            index_segment_release(snapshot[i-1]);
+        }
+
+        free(snapshot);
+    }
+
+    // Encode the page right here, the main loop just sends it
+    struct archive_result* result = malloc(sizeof(struct archive_result) + (state.page_len+1) * MAX_HIT_SIZE);
+    if (!result) {
+        refuse_query(query);
+        return;
+    }
+
+    result->next = NULL;
+    result->client_id = query->client_id;
+    result->size = 0;
+
+    for (size_t i = 0; i < state.page_len; i++) {
+        unsigned long seq;
+        Sint64 time;
+        char nick[SERV_MAX_NICK_LEN], text[SERV_MAX_MSG_LEN];
+        if (read_record(docs[state.page[i]].offset, &seq, &time, nick, text) < 0) continue;
+
+        // Args: sequence number, time, nick, text
+        char seq_str[24], time_str[24];
+        snprintf(seq_str, sizeof(seq_str), "%lu", seq);
+        snprintf(time_str, sizeof(time_str), "%lld", (long long)time);
+
+        int size = prot_encode(prot_make_msg("HIT", 4, seq_str, time_str, nick, text), &result->data[result->size], MAX_HIT_SIZE);
+        if (size > 0) result->size += (size_t)size;
+    }
+
+    // Args: page, total number of matching messages
+    char page_str[24], total_str[24];
+    snprintf(page_str, sizeof(page_str), "%lu", query->page);
+    snprintf(total_str, sizeof(total_str), "%lu", state.total);
+
+    int size = prot_encode(prot_make_msg("END", 2, page_str, total_str), &result->data[result->size], MAX_HIT_SIZE);
+    if (size > 0) result->size += (size_t)size;
+
+    push_result(result);
+}
+
+static int archive_thread_main(void* data) {
+    (void)data;
+
+    SDL_LockMutex(lock);
+
+    while (1) {
+        while (jobs_head == NULL && !stop)
+            SDL_CondWait(jobs_cond, lock);
+
+        // The remaining messages are still archived before stopping
+        if (jobs_head == NULL) break;
+
+        struct job* job = jobs_head;
+        jobs_head = jobs_tail = NULL;
+
+        SDL_UnlockMutex(lock);
+
+        while (job) {
+            struct job* next = job->next;
+
+            if (job->is_query) {
+                run_query(&job->u.query);
+
+                SDL_LockMutex(lock);
+                pending_queries--;
+                SDL_UnlockMutex(lock);
+            } else
+                archive_message(job->u.msg.seq, job->u.msg.time, job->u.msg.nick, job->u.msg.text);
+
+            free(job);
+            job = next;
+        }
+
+        // Not after every message, a burst is written at once
+        fflush(log_file);
+
+        SDL_LockMutex(lock);
+    }
+
+    SDL_UnlockMutex(lock);
+
+    return 0;
+}
+
+// Merges adjacent segments of the same size, so there are only about log2(n) of them
+static int merge_thread_main(void* data) {
+    (void)data;
+
+    SDL_LockMutex(segments_lock);
+
+    while (!merge_stop) {
+
+        size_t i = num_segments;
+        while (i >= 2 && segments[i-2]->num_docs > segments[i-1]->num_docs) i--;
+
+        if (i < 2) {
+            SDL_CondWait(merge_cond, segments_lock);
+            continue;
+        }
+
+        struct index_segment* older = segments[i-2];
+        struct index_segment* newer = segments[i-1];
+
+        // Merge without holding the lock, the segments are immutable and the
+        // archive thread can only add new ones at the end meanwhile
+        SDL_UnlockMutex(segments_lock);
+        struct index_segment* merged = index_merge(older, newer);
+        SDL_LockMutex(segments_lock);
+
+        if (!merged) {
+            fprintf(stderr, "Failed to merge index segments\n");
+            SDL_CondWait(merge_cond, segments_lock);
+            continue;
+        }
+
+        segments[i-2] = merged;
+        memmove(&segments[i-1], &segments[i], (num_segments - i) * sizeof(struct index_segment*));
+        num_segments--;
+
+        // Queries may still be using them
+        index_segment_release(older);
+        index_segment_release(newer);
+    }
+
+    SDL_UnlockMutex(segments_lock);
+
+    return 0;
+}
+
+int archive_init(const char* path, TCPsocket wake_socket, unsigned long* next_seq) {
+
+    log_file = fopen(path, "r+b");
+    if (!log_file)
+        log_file = fopen(path, "w+b");
+    if (!log_file) {
+        fprintf(stderr, "Failed to open the message log %s\n", path);
+        return -1;
+    }
+
+    lock = SDL_CreateMutex();
+    jobs_cond = SDL_CreateCond();
+    segments_lock = SDL_CreateMutex();
+    merge_cond = SDL_CreateCond();
+    if (!lock || !jobs_cond || !segments_lock || !merge_cond) {
+        fprintf(stderr, "Failed to create the archive's locks: %s\n", SDL_GetError());
+        return -1;
+    }
+
+    // Index everything that is already in the log, a broken record at the end
+    // (if the server didn't finish writing it) is overwritten by the next one
+    unsigned long seq = 0;
+    Sint64 time;
+    char nick[SERV_MAX_NICK_LEN], text[SERV_MAX_MSG_LEN];
+    long size;
+
+    log_end = 0;
+    while ((size = read_record(log_end, &seq, &time, nick, text)) > 0) {
+        if (index_message(log_end, time, nick, text) < 0) {
+            fprintf(stderr, "Failed to index the message log\n");
+            return -1;
+        }
+        log_end += size;
+    }
+
+    if (num_docs > 0) {
+        *next_seq = seq+1;
+        fprintf(stdout, "Loaded %lu archived messages\n", (unsigned long)num_docs);
+    }
+
+    wake = wake_socket;
+    stop = 0;
+    merge_stop = 0;
+
+    archive_thread = SDL_CreateThread(archive_thread_main, "archive", NULL);
+    merge_thread = SDL_CreateThread(merge_thread_main, "merge", NULL);
+    if (!archive_thread || !merge_thread) {
+        fprintf(stderr, "Failed to start the archive's threads: %s\n", SDL_GetError());
+        return -1;
+    }
+
+    running = 1;
+
+    return 0;
+}
+
+void archive_quit() {
+
+    if (!running) return;
+    running = 0;
+
+    SDL_LockMutex(lock);
+    stop = 1;
+    SDL_CondSignal(jobs_cond);
+    SDL_UnlockMutex(lock);
+    SDL_WaitThread(archive_thread, NULL);
+
+    SDL_LockMutex(segments_lock);
+    merge_stop = 1;
+    SDL_CondSignal(merge_cond);
+    SDL_UnlockMutex(segments_lock);
+    SDL_WaitThread(merge_thread, NULL);
+
+    fclose(log_file);
+
+    while (results_head) {
+        struct archive_result* next = results_head->next;
+        free(results_head);
+        results_head = next;
+    }
+    results_tail = NULL;
+
+    for (size_t i = 0; i < num_segments; i++)
+        index_segment_release(segments[i]);
+    free(segments);
+    segments = NULL;
+    num_segments = segments_capacity = 0;
+
+    index_builder_free(&builder);
+    free(docs);
+    docs = NULL;
+    num_docs = docs_capacity = 0;
+
+    SDL_DestroyCond(merge_cond);
+    SDL_DestroyMutex(segments_lock);
+    SDL_DestroyCond(jobs_cond);
+    SDL_DestroyMutex(lock);
+}
+
+static void push_job(struct job* job) {
+
+    job->next = NULL;
+
+    SDL_LockMutex(lock);
+
+    if (jobs_tail)
+        jobs_tail->next = job;
+    else
+        jobs_head = job;
+    jobs_tail = job;
+
+    SDL_CondSignal(jobs_cond);
+    SDL_UnlockMutex(lock);
+}
+
+void archive_add(const unsigned long seq, const char* nick, const char* text) {
+
+    if (!running) return;
+
+    struct job* job = malloc(sizeof(struct job));
+    if (!job) {
+        fprintf(stderr, "Failed to archive message %lu\n", seq);
+        return;
+    }
+
+    job->is_query = 0;
+    job->u.msg.seq = seq;
+    job->u.msg.time = (Sint64)time(NULL);
+    snprintf(job->u.msg.nick, sizeof(job->u.msg.nick), "%s", nick);
+    snprintf(job->u.msg.text, sizeof(job->u.msg.text), "%s", text);
+
+    push_job(job);
+}
+
+int archive_parse_query(const char* str, struct archive_query* query) {
+
+    query->text[0] = '\0';
+    query->nick[0] = '\0';
+    query->after = SDL_MIN_SINT64;
+    query->before = SDL_MAX_SINT64;
+
+    size_t text_len = 0;
+
+    while (*str) {
+        if (*str == ' ') {
+            str++;
+            continue;
+        }
+
+        size_t len = strcspn(str, " ");
+
+        // A time filter has to be followed by a number, otherwise it's a word
+        Sint64 time = 0;
+        int is_time = 0;
+        if (!strncmp(str, "after:", 6) || !strncmp(str, "before:", 7)) {
+            const char* num = strchr(str, ':') + 1;
+            char* end;
+            time = (Sint64)strtoll(num, &end, 10);
+            is_time = end != num && end == str + len;
+        }
+
+        if (!strncmp(str, "nick:", 5)) {
+            if (len - 5 + 1 > SERV_MAX_NICK_LEN) return -1;
+            memcpy(query->nick, str + 5, len - 5);
+            query->nick[len - 5] = '\0';
+        } else
+        if (is_time && str[0] == 'a')
+            query->after = time;
+        else
+        if (is_time)
+            query->before = time;
+        else {
+            // Anything else is a word
+            if (text_len + len + 2 > SERV_MAX_MSG_LEN) return -1;
+            if (text_len > 0) query->text[text_len++] = ' ';
+            memcpy(&query->text[text_len], str, len);
+            text_len += len;
+            query->text[text_len] = '\0';
+        }
+
+        str += len;
+    }
+
+    return 0;
+}
+
+int archive_query(const struct archive_query* query) {
+
+    if (!running) return -1;
+
+    SDL_LockMutex(lock);
+    int busy = pending_queries >= SERV_MAX_PENDING_QUERIES;
+    if (!busy) pending_queries++;
+    SDL_UnlockMutex(lock);
+
+    if (busy) return -1;
+
+    struct job* job = malloc(sizeof(struct job));
+    if (!job) {
+        SDL_LockMutex(lock);
+        pending_queries--;
+        SDL_UnlockMutex(lock);
+        return -1;
+    }
+
+    job->is_query = 1;
+    job->u.query = *query;
+
+    push_job(job);
+
+    return 0;
+}
+
+struct archive_result* archive_take_results() {
+
+    if (!running) return NULL;
+
+    SDL_LockMutex(lock);
+    struct archive_result* results = results_head;
+    results_head = results_tail = NULL;
+    SDL_UnlockMutex(lock);
+
+    return results;
+}
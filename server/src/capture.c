@@ -0,0 +1,175 @@
+#include "capture.h"
+
+#include <stdio.h>
+#include <string.h>
+
+#include "server.h"
+
+// The end of the pending buffer that the frames can't take, the replay needs every connection
+// and disconnection, so there's always space for them unless the thread has fallen far behind
+#define CONTROL_RESERVE (2 * SERV_MAX_CLIENTS * CAPTURE_HEADER_SIZE)
+
+static FILE* file;
+static SDL_Thread* thread;
+static int running;
+
+// Protects everything below
+static SDL_mutex* lock;
+// Signalled when there is something to write
+static SDL_cond* cond;
+
+// Two buffers of records, the main thread appends to the pending one
+// while the thread writes out the other one
+static struct capture_buffer {
+    char data[SERV_CAPTURE_BUFFER_SIZE];
+    size_t used;
+} buffers[2];
+static struct capture_buffer* pending = &buffers[0];
+static int stop;
+// The frames that didn't fit into the pending buffer since the last batch
+static unsigned long dropped;
+
+// The performance counter when the capture has started
+static Uint64 start;
+
+static void put_u32(char* buf, Uint32 value) {
+    for (int i = 0; i < 4; i++, value >>= 8)
+        buf[i] = (char)(value & 0xFF);
+}
+
+static void put_u64(char* buf, Uint64 value) {
+    for (int i = 0; i < 8; i++, value >>= 8)
+        buf[i] = (char)(value & 0xFF);
+}
+
+// Microseconds since the capture has started, split up so that it doesn't overflow
+static Uint64 now() {
+    Uint64 ticks = SDL_GetPerformanceCounter() - start;
+    Uint64 freq = SDL_GetPerformanceFrequency();
+    return ticks / freq * 1000000 + ticks % freq * 1000000 / freq;
+}
+
+static int capture_thread_main(void* data) {
+    (void)data;
+
+    SDL_LockMutex(lock);
+
+    while (1) {
+        while (pending->used == 0 && !stop)
+            SDL_CondWait(cond, lock);
+
+        // The remaining records are still written before stopping
+        if (pending->used == 0) break;
+
+        struct capture_buffer* batch = pending;
+        pending = batch == &buffers[0] ? &buffers[1] : &buffers[0];
+        pending->used = 0;
+
+        // The frames are only dropped when the buffer is full, so there's always a batch after them
+        unsigned long batch_dropped = dropped;
+        dropped = 0;
+
+        // capture_add might be waiting for the space
+        SDL_CondBroadcast(cond);
+
+        SDL_UnlockMutex(lock);
+
+        // Told right away, the server is usually just killed
+        if (batch_dropped > 0)
+            fprintf(stderr, "%lu frames were dropped from the capture\n", batch_dropped);
+
+        if (fwrite(batch->data, 1, batch->used, file) != batch->used || fflush(file) != 0)
+            fprintf(stderr, "Failed to write the capture\n");
+
+        SDL_LockMutex(lock);
+    }
+
+    SDL_UnlockMutex(lock);
+
+    return 0;
+}
+
+int capture_init(const char* path) {
+
+    file = fopen(path, "wb");
+    if (!file) {
+        fprintf(stderr, "Failed to open the capture %s\n", path);
+        return -1;
+    }
+
+    lock = SDL_CreateMutex();
+    cond = SDL_CreateCond();
+    if (!lock || !cond || fwrite(CAPTURE_MAGIC, 1, CAPTURE_MAGIC_SIZE, file) != CAPTURE_MAGIC_SIZE) {
+        fprintf(stderr, "Failed to start the capture\n");
+        return -1;
+    }
+
+    start = SDL_GetPerformanceCounter();
+    stop = 0;
+    dropped = 0;
+    pending = &buffers[0];
+    pending->used = 0;
+
+    thread = SDL_CreateThread(capture_thread_main, "capture", NULL);
+    if (!thread) {
+        fprintf(stderr, "Failed to start the capture's thread: %s\n", SDL_GetError());
+        return -1;
+    }
+
+    running = 1;
+    fprintf(stdout, "Capturing the traffic into %s\n", path);
+
+    return 0;
+}
+
+void capture_quit() {
+
+    if (!running) return;
+    running = 0;
+
+    SDL_LockMutex(lock);
+    stop = 1;
+    SDL_CondSignal(cond);
+    SDL_UnlockMutex(lock);
+    SDL_WaitThread(thread, NULL);
+
+    fclose(file);
+    SDL_DestroyCond(cond);
+    SDL_DestroyMutex(lock);
+}
+
+void capture_add(const enum capture_kind kind, const unsigned long connection, const char* data, const size_t size) {
+
+    if (!running) return;
+
+    Uint64 time = now();
+
+    // The thread only holds it to swap the buffers
+    SDL_LockMutex(lock);
+
+    // A frame is dropped instead of waiting for the thread, the other records
+    // are never dropped, only when even the reserve is full, the thread is waited for
+    if (kind == CAPTURE_FRAME) {
+        if (pending->used + CAPTURE_HEADER_SIZE + size > SERV_CAPTURE_BUFFER_SIZE - CONTROL_RESERVE) {
+            dropped++;
+            SDL_UnlockMutex(lock);
+            return;
+        }
+    } else {
+        while (pending->used + CAPTURE_HEADER_SIZE > SERV_CAPTURE_BUFFER_SIZE)
+            SDL_CondWait(cond, lock);
+    }
+
+    char* record = &pending->data[pending->used];
+    if (data)
+        memcpy(&record[CAPTURE_HEADER_SIZE], data, size);
+
+    record[0] = (char)kind;
+    put_u32(&record[1], (Uint32)connection);
+    put_u64(&record[5], time);
+    put_u32(&record[13], (Uint32)size);
+    pending->used += CAPTURE_HEADER_SIZE + (size_t)size;
+
+    SDL_CondSignal(cond);
+    SDL_UnlockMutex(lock);
+}
@@ -0,0 +1,35 @@
+#include "filter.h"
+
+static const struct filter* filters[FILTER_MAX_FILTERS];
+static size_t num_filters;
+
+int filter_add(const struct filter* filter) {
+
+    if (num_filters == FILTER_MAX_FILTERS)
+        return -1;
+
+    filters[num_filters++] = filter;
+    return 0;
+}
+
+void filter_remove(const struct filter* filter) {
+
+    for (size_t i = 0; i < num_filters; i++) {
+        if (filters[i] != filter) continue;
+
+        // Keep the order of the rest
+        for (size_t j = i+1; j < num_filters; j++)
+            filters[j-1] = filters[j];
+        num_filters--;
+        return;
+    }
+}
+
+int filter_run(char* text, const size_t len) {
+
+    int actions = 0;
+    for (size_t i = 0; i < num_filters && !(actions & FILTER_REJECT); i++)
+        actions |= filters[i]->apply(filters[i]->data, text, len);
+
+    return actions;
+}
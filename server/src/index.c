@@ -0,0 +1,360 @@
+#include "index.h"
+
+#include <ctype.h>
+#include <stdlib.h>
+#include <string.h>
+
+// The builder is an open addressing hash table with linear probing,
+// its capacity is a power of two and it's kept at most half full
+#define INDEX_MIN_CAPACITY 256
+
+static int is_term_char(const char c) {
+    return (unsigned char)c >= 0x80 || isalnum((unsigned char)c);
+}
+
+size_t index_tokenize(const char* text, char terms[][INDEX_MAX_TERM_LEN], const size_t max) {
+
+    size_t num_terms = 0;
+
+    while (*text && num_terms < max) {
+
+        while (*text && !is_term_char(*text)) text++;
+
+        size_t len = 0;
+        for (; is_term_char(*text); text++)
+            if (len < INDEX_MAX_TERM_LEN-1)
+                terms[num_terms][len++] = (char)tolower((unsigned char)*text);
+
+        if (len > 0) {
+            terms[num_terms][len] = '\0';
+            num_terms++;
+        }
+    }
+
+    return num_terms;
+}
+
+void index_nick_term(const char* nick, char term[INDEX_MAX_TERM_LEN]) {
+
+    // '@' is never a part of a word
+    size_t len = 0;
+    term[len++] = '@';
+    for (; *nick && len < INDEX_MAX_TERM_LEN-1; nick++)
+        term[len++] = (char)tolower((unsigned char)*nick);
+    term[len] = '\0';
+}
+
+// FNV-1a
+static size_t hash_string(const char* str) {
+    size_t hash = 2166136261u;
+    for (; *str; str++)
+        hash = (hash ^ (unsigned char)*str) * 16777619u;
+    return hash;
+}
+
+// Find the entry of term, either the one containing it or the empty one where it belongs
+static size_t find_entry(const struct index_builder_entry* entries, const size_t capacity, const char* term) {
+    size_t i = hash_string(term) & (capacity-1);
+    while (entries[i].term != NULL && strcmp(entries[i].term, term))
+        i = (i+1) & (capacity-1);
+    return i;
+}
+
+int index_builder_add(struct index_builder* builder, const Uint32 doc, char terms[][INDEX_MAX_TERM_LEN], const size_t num_terms) {
+
+    if (builder->num_docs == 0)
+        builder->first_doc = doc;
+
+    for (size_t t = 0; t < num_terms; t++) {
+
+        // Make sure that there's space for a new term
+        if ((builder->used+1)*2 > builder->capacity) {
+            size_t capacity = builder->capacity ? builder->capacity*2 : INDEX_MIN_CAPACITY;
+            struct index_builder_entry* entries = calloc(capacity, sizeof(struct index_builder_entry));
+            if (!entries) return -1;
+
+            for (size_t i = 0; i < builder->capacity; i++)
+                if (builder->entries[i].term != NULL)
+                    entries[find_entry(entries, capacity, builder->entries[i].term)] = builder->entries[i];
+
+            free(builder->entries);
+            builder->entries = entries;
+            builder->capacity = capacity;
+        }
+
+        struct index_builder_entry* entry = &builder->entries[find_entry(builder->entries, builder->capacity, terms[t])];
+
+        if (entry->term == NULL) {
+            size_t len = strlen(terms[t])+1;
+            entry->term = malloc(len);
+            if (!entry->term) return -1;
+
+            memcpy(entry->term, terms[t], len);
+            builder->used++;
+        }
+
+        // The same term can be in the document more than once
+        if (entry->count > 0 && entry->docs[entry->count-1] == doc) continue;
+
+        if (entry->count == entry->capacity) {
+            Uint32 capacity = entry->capacity ? entry->capacity*2 : 4;
+            Uint32* docs = realloc(entry->docs, capacity * sizeof(Uint32));
+            if (!docs) return -1;
+
+            entry->docs = docs;
+            entry->capacity = capacity;
+        }
+
+        entry->docs[entry->count++] = doc;
+    }
+
+    builder->num_docs = doc - builder->first_doc + 1;
+
+    return 0;
+}
+
+int index_builder_find(const struct index_builder* builder, const char* term, struct index_list* list) {
+
+    if (builder->capacity == 0) return -1;
+
+    const struct index_builder_entry* entry = &builder->entries[find_entry(builder->entries, builder->capacity, term)];
+    if (entry->term == NULL) return -1;
+
+    list->docs = entry->docs;
+    list->count = entry->count;
+    return 0;
+}
+
+static int compare_entries(const void* a, const void* b) {
+    return strcmp(((const struct index_builder_entry*)a)->term, ((const struct index_builder_entry*)b)->term);
+}
+
+static struct index_segment* alloc_segment(const Uint32 num_terms, const Uint32 text_size, const Uint32 num_postings) {
+
+    struct index_segment* segment = calloc(1, sizeof(struct index_segment));
+    if (!segment) return NULL;
+
+    segment->terms = malloc((num_terms ? num_terms : 1) * sizeof(struct index_term));
+    segment->text = malloc(text_size ? text_size : 1);
+    segment->postings = malloc((num_postings ? num_postings : 1) * sizeof(Uint32));
+
+    if (!segment->terms || !segment->text || !segment->postings) {
+        free(segment->terms);
+        free(segment->text);
+        free(segment->postings);
+        free(segment);
+        return NULL;
+    }
+
+    SDL_AtomicSet(&segment->refs, 1);
+    return segment;
+}
+
+struct index_segment* index_builder_seal(struct index_builder* builder) {
+
+    // Pack the used entries at the beginning and sort them
+    struct index_builder_entry* entries = builder->entries;
+    size_t num_terms = 0;
+    Uint32 text_size = 0, num_postings = 0;
+
+    for (size_t i = 0; i < builder->capacity; i++)
+        if (entries[i].term != NULL) {
+            text_size += (Uint32)strlen(entries[i].term)+1;
+            num_postings += entries[i].count;
+        }
+
+    struct index_segment* segment = alloc_segment((Uint32)builder->used, text_size, num_postings);
+    if (!segment) return NULL;
+
+    for (size_t i = 0; i < builder->capacity; i++)
+        if (entries[i].term != NULL)
+            entries[num_terms++] = entries[i];
+
+    if (num_terms > 0)
+        qsort(entries, num_terms, sizeof(struct index_builder_entry), compare_entries);
+
+    segment->first_doc = builder->first_doc;
+    segment->num_docs = builder->num_docs;
+
+    for (size_t i = 0; i < num_terms; i++) {
+        struct index_term* term = &segment->terms[segment->num_terms++];
+        size_t len = strlen(entries[i].term)+1;
+
+        term->text = segment->text_size;
+        memcpy(&segment->text[segment->text_size], entries[i].term, len);
+        segment->text_size += (Uint32)len;
+
+        term->postings = segment->num_postings;
+        term->count = entries[i].count;
+        memcpy(&segment->postings[segment->num_postings], entries[i].docs, entries[i].count * sizeof(Uint32));
+        segment->num_postings += entries[i].count;
+
+        free(entries[i].term);
+        free(entries[i].docs);
+    }
+
+    // Start over with an empty table
+    memset(entries, 0, builder->capacity * sizeof(struct index_builder_entry));
+    builder->used = 0;
+    builder->first_doc += builder->num_docs;
+    builder->num_docs = 0;
+
+    return segment;
+}
+
+void index_builder_free(struct index_builder* builder) {
+
+    for (size_t i = 0; i < builder->capacity; i++) {
+        free(builder->entries[i].term);
+        free(builder->entries[i].docs);
+    }
+
+    free(builder->entries);
+    memset(builder, 0, sizeof(struct index_builder));
+}
+
+int index_segment_find(const struct index_segment* segment, const char* term, struct index_list* list) {
+
+    // Binary search over the sorted terms
+    Uint32 begin = 0, end = segment->num_terms;
+    while (begin < end) {
+        Uint32 mid = begin + (end - begin)/2;
+        int cmp = strcmp(&segment->text[segment->terms[mid].text], term);
+
+        if (cmp == 0) {
+            list->docs = &segment->postings[segment->terms[mid].postings];
+            list->count = segment->terms[mid].count;
+            return 0;
+        }
+
+        if (cmp < 0)
+            begin = mid+1;
+        else
+            end = mid;
+    }
+
+    return -1;
+}
+
+// Append a term with its postings (from one or two segments) to segment
+static void append_term(struct index_segment* segment, const char* text, const struct index_list* lists, const size_t num_lists) {
+
+    struct index_term* term = &segment->terms[segment->num_terms++];
+    size_t len = strlen(text)+1;
+
+    term->text = segment->text_size;
+    memcpy(&segment->text[segment->text_size], text, len);
+    segment->text_size += (Uint32)len;
+
+    term->postings = segment->num_postings;
+    term->count = 0;
+
+    for (size_t i = 0; i < num_lists; i++) {
+        memcpy(&segment->postings[segment->num_postings], lists[i].docs, lists[i].count * sizeof(Uint32));
+        segment->num_postings += (Uint32)lists[i].count;
+        term->count += (Uint32)lists[i].count;
+    }
+}
+
+struct index_segment* index_merge(const struct index_segment* older, const struct index_segment* newer) {
+
+    struct index_segment* segment = alloc_segment(older->num_terms + newer->num_terms,
+                                                  older->text_size + newer->text_size,
+                                                  older->num_postings + newer->num_postings);
+    if (!segment) return NULL;
+
+    segment->first_doc = older->first_doc;
+    segment->num_docs = older->num_docs + newer->num_docs;
+
+    // Both are sorted, so it's the merge step of merge sort
+    // The documents of older all come before the ones of newer, so the postings
+    // of a term that is in both can simply be concatenated
+    Uint32 i = 0, j = 0;
+    while (i < older->num_terms || j < newer->num_terms) {
+
+        const char* a = i < older->num_terms ? &older->text[older->terms[i].text] : NULL;
+        const char* b = j < newer->num_terms ? &newer->text[newer->terms[j].text] : NULL;
+        int cmp = !a ? 1 : !b ? -1 : strcmp(a, b);
+
+        struct index_list lists[2];
+        size_t num_lists = 0;
+
+        if (cmp <= 0) {
+            lists[num_lists].docs = &older->postings[older->terms[i].postings];
+            lists[num_lists++].count = older->terms[i].count;
+            i++;
+        }
+        if (cmp >= 0) {
+            lists[num_lists].docs = &newer->postings[newer->terms[j].postings];
+            lists[num_lists++].count = newer->terms[j].count;
+            j++;
+        }
+
+        append_term(segment, cmp <= 0 ? a : b, lists, num_lists);
+    }
+
+    return segment;
+}
+
+void index_segment_retain(struct index_segment* segment) {
+    SDL_AtomicIncRef(&segment->refs);
+}
+
+void index_segment_release(struct index_segment* segment) {
+
+    if (!SDL_AtomicDecRef(&segment->refs)) return;
+
+    free(segment->terms);
+    free(segment->text);
+    free(segment->postings);
+    free(segment);
+}
+
+// Whether the list contains doc, it has to be somewhere before end
+static int list_contains(const struct index_list* list, size_t* end, const Uint32 doc) {
+
+    // Binary search, the documents are looked up from the newest, so the next
+    // lookup never has to look past this one
+    size_t begin = 0;
+    while (begin < *end) {
+        size_t mid = begin + (*end - begin)/2;
+        if (list->docs[mid] < doc)
+            begin = mid+1;
+        else
+            *end = mid;
+    }
+
+    if (begin < list->count && list->docs[begin] == doc) {
+        *end = begin+1;
+        return 1;
+    }
+    return 0;
+}
+
+void index_intersect(const struct index_list* lists, const size_t num_lists, const Uint32 from, const Uint32 to,
+                     int (*found)(void* data, Uint32 doc), void* data) {
+
+    if (num_lists == 0 || num_lists > INDEX_MAX_LISTS) return;
+
+    // Walk the shortest list, look up its documents in the others
+    size_t shortest = 0;
+    for (size_t i = 1; i < num_lists; i++)
+        if (lists[i].count < lists[shortest].count)
+            shortest = i;
+
+    size_t ends[INDEX_MAX_LISTS];
+    for (size_t i = 0; i < num_lists; i++)
+        ends[i] = lists[i].count;
+
+    for (size_t k = lists[shortest].count; k > 0; k--) {
+        Uint32 doc = lists[shortest].docs[k-1];
+        if (doc >= to) continue;
+        if (doc < from) break;
+
+        size_t i = 0;
+        while (i < num_lists && (i == shortest || list_contains(&lists[i], &ends[i], doc))) i++;
+
+        if (i == num_lists && found(data, doc))
+            return;
+    }
+}
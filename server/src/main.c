@@ -1,41 +1,445 @@
 #include <SDL_net.h>
 
 #include <stdio.h>
+#include <stdlib.h>
 #include <string.h>
+#include <time.h>
 
+#include "archive.h"
+#include "capture.h"
+#include "compress.h"
+#include "filter.h"
+#include "messages.h"
+#include "outbox.h"
+#include "patterns.h"
 #include "protocol.h"
 #include "server.h"
+#include "shm.h"
+#include "transfer.h"
+#include "utf8.h"
 
 // This struct defines a connected client, one open socket
 // The only cached info needed is the nick
 static struct client {
     char nick[SERV_MAX_NICK_LEN];
     TCPsocket socket;
+    // Unique for every connection, unlike the index in clients
+    unsigned long id;
+    // Everything is received through the reader and sent through the outbox
+    struct prot_reader reader;
+    struct outbox* outbox;
+    // Clients on the same machine can ask for the messages to be sent through shared memory,
+    // once they have opened it, everything is sent there instead of the socket
+    // If the client falls too far behind, it's closed and NULL, the client then reconnects
+    struct prot_shm* shm;
+    int shm_active;
+    // Clients that ask for it (CMP) get everything in compressed blocks, see compress.h,
+    // dict_epoch is the dictionary that the client has
+    int compressed;
+    unsigned long dict_epoch;
+    // The others only learn about the client with its first message, which tells
+    // whether it starts a new session or resumes the previous one (RES)
+    int announced;
 } clients[SERV_MAX_CLIENTS];
 
+// The id of the next accepted connection
+static unsigned long next_client_id = 1;
+// Tells this run of the server apart from the earlier ones, the ids start over with every run,
+// so the id of a previous connection in RES only means something with the same run
+static unsigned long run_id;
+
+// The recently broadcast messages, a ring buffer indexed by seq % SERV_HISTORY_LEN
+static struct history_entry {
+    // 0 means that the entry hasn't been used yet
+    unsigned long seq;
+    // The connection that has sent the message
+    unsigned long client_id;
+    char nick[SERV_MAX_NICK_LEN];
+    char text[SERV_MAX_MSG_LEN];
+} history[SERV_HISTORY_LEN];
+
+// Every broadcast message gets a sequence number, the clients use them to resume
+static unsigned long next_seq = 1;
+
+// Every connection, nick change and disconnection gets the next version, the clients get the
+// list of who is online once (ONL) and then only the changes (PRS), numbered with the versions
+static unsigned long presence_version;
+
+// The messages to the clients with compression are compressed with this dictionary, made of
+// the last broadcast messages, it's packed only once for all of them (dict_block)
+static struct prot_dict dict;
+static char dict_block[PROT_PACK_BOUND(PROT_DICT_SIZE)];
+static size_t dict_block_size;
+// The recently broadcast messages, a ring buffer, and how many bytes of them
+// there have been since the dictionary was made
+static char recent[PROT_DICT_SIZE];
+static size_t recent_end;
+static size_t recent_new;
+
 // The set of all connected clients, this allows simple non-blocking IO
 // Without unnecessary multithreading 
 // (altought that would be needed for large scale applications obviously, or perhaps a combination)
 static SDLNet_SocketSet socks;
 // The listening socket, also contained in socks, listens for incomming connections
 static TCPsocket server_socket;
+// A connection to ourselves, the archive thread writes to the one end when search
+// results are ready and the other one (in socks) wakes up the main loop
+static TCPsocket wake_sender;
+static TCPsocket wake_receiver;
+
+// Queue a block made by prot_pack with the current dictionary for a client with compression,
+// the client gets the dictionary first if the block needs it and it doesn't have it yet
+static int send_block(struct client* client, const char* block, const size_t size, const enum outbox_lane lane) {
+
+    if (block[0] == PROT_BLOCK_PACKED && client->dict_epoch != dict.epoch) {
+        if (outbox_push(client->outbox, OUTBOX_HIGH, dict_block, dict_block_size) < 0)
+            return PROT_ERR_ERR;
+        client->dict_epoch = dict.epoch;
+    }
+
+    return outbox_push(client->outbox, lane, block, size) < 0 ? PROT_ERR_ERR : PROT_ERR_OK;
+}
+
+// Send the encoded messages to the client through whatever it receives them from
+// Only the file chunks go into the low priority lane
+static int send_raw(struct client* client, const char* data, const size_t size, const enum outbox_lane lane) {
+
+    if (!client->shm_active && client->compressed) {
+        static char block[PROT_PACK_BOUND(PROT_MAX_ARGS * PROT_MAX_ARG_SIZE)];
+        if (size > PROT_MAX_ARGS * PROT_MAX_ARG_SIZE)
+            return PROT_ERR_ERR;
+
+        // The file chunks don't get any smaller, they're only wrapped in a block
+        size_t block_size = prot_pack(&dict, data, size, lane == OUTBOX_LOW, block);
+        return send_block(client, block, block_size, lane);
+    }
+
+    if (!client->shm_active)
+        return outbox_push(client->outbox, lane, data, size) < 0 ? PROT_ERR_ERR : PROT_ERR_OK;
+
+    if (!client->shm || prot_shm_write(client->shm, data, size) < 0) {
+        // Unless the client has closed it itself, it has fallen too far behind
+        if (client->shm && !prot_shm_closed(client->shm))
+            fprintf(stderr, "The client %s isn't keeping up with the shared memory\n", client->nick);
+        prot_shm_close(client->shm);
+        client->shm = NULL;
+        return PROT_ERR_ERR;
+    }
+
+    return PROT_ERR_OK;
+}
+
+// Queue the last message through the socket before the stream changes (SHM or CMP without arguments),
+// the outbox writes it after everything queued so far, the main loop doesn't wait for it
+static int send_switch(struct client* client, const char* head) {
+
+    char buf[PROT_HEAD_SIZE + 1];
+    int size = prot_encode(prot_make_msg(head, 0), buf, sizeof(buf));
+    if (size < 0)
+        return PROT_ERR_ERR;
+
+    return outbox_push_switch(client->outbox, buf, (size_t)size) < 0 ? PROT_ERR_ERR : PROT_ERR_OK;
+}
+
+static int send_msg(struct client* client, const struct prot_msg msg) {
+
+    char buf[PROT_MAX_ARGS * PROT_MAX_ARG_SIZE];
+    int size = prot_encode(msg, buf, sizeof(buf));
+    if (size < 0)
+        return PROT_ERR_ERR;
+
+    return send_raw(client, buf, (size_t)size, OUTBOX_HIGH);
+}
+
+// Remember the broadcast messages for the next dictionary, which is made once there have been enough of them
+static void add_recent(const char* data, size_t size) {
+
+    recent_new += size;
+    if (size > sizeof(recent)) {
+        data += size - sizeof(recent);
+        size = sizeof(recent);
+    }
+
+    size_t first = size < sizeof(recent) - recent_end ? size : sizeof(recent) - recent_end;
+    memcpy(&recent[recent_end], data, first);
+    memcpy(recent, &data[first], size - first);
+    recent_end = (recent_end + size) % sizeof(recent);
+
+    if (recent_new < (dict.epoch == 0 ? sizeof(recent) : SERV_DICT_INTERVAL))
+        return;
+
+    // The ring buffer is full by now, the oldest byte is at its end
+    char data_in_order[PROT_DICT_SIZE];
+    memcpy(data_in_order, &recent[recent_end], sizeof(recent) - recent_end);
+    memcpy(&data_in_order[sizeof(recent) - recent_end], recent, recent_end);
+
+    prot_dict_set(&dict, data_in_order, sizeof(data_in_order));
+    dict.epoch++;
+    dict_block_size = prot_pack_dict(&dict, dict_block);
+    recent_new = 0;
+}
+
+// Send the same encoded messages to everyone except the given client (unless it's NULL)
+// The clients with compression get the same block, it's compressed only once
+static void send_everyone(const char* data, const size_t size, const struct client* except) {
+
+    static char block[PROT_PACK_BOUND(PROT_MAX_ARGS * PROT_MAX_ARG_SIZE)];
+    size_t block_size = 0;
+    if (size > PROT_MAX_ARGS * PROT_MAX_ARG_SIZE)
+        return;
+
+    for (size_t i = 0; i < SERV_MAX_CLIENTS; i++) {
+        if (clients[i].socket == NULL || &clients[i] == except) continue;
+
+        // Not really necessary to error check
+        // If one of the clients disconnect, we will disconnect them anyway in the main loop asap
+        if (clients[i].compressed && !clients[i].shm_active) {
+            if (block_size == 0)
+                block_size = prot_pack(&dict, data, size, 0, block);
+            send_block(&clients[i], block, block_size, OUTBOX_HIGH);
+        } else
+            send_raw(&clients[i], data, size, OUTBOX_HIGH);
+    }
+
+    // Only after it has been compressed with the current dictionary
+    add_recent(data, size);
+}
+
+static struct client* find_client(const unsigned long id) {
+
+    for (size_t i = 0; i < SERV_MAX_CLIENTS; i++)
+        if (clients[i].socket != NULL && clients[i].id == id)
+            return &clients[i];
+
+    return NULL;
+}
+
+// Parse a decimal number, returns -1 if str isn't one
+static int parse_num(const char* str, Uint64* num) {
+
+    // strtoull would also take whitespace and a sign
+    if (*str < '0' || *str > '9') return -1;
+
+    char* end;
+    *num = strtoull(str, &end, 10);
+    return *end == '\0' ? 0 : -1;
+}
 
 // Broadcasts a message sent by client to all other clients
 // This is used internally and with care because it doesn't do any sort of checks
 // e.g. validity of the message
 static int broadcast_message(struct client* client, const char* msg) {
 
-    // Args: nick, message
-    struct prot_msg msg_pack = prot_make_msg("MSG", 2, client->nick, msg);
+    // Remember the message for reconnecting clients
+    struct history_entry* entry = &history[next_seq % SERV_HISTORY_LEN];
+    entry->seq = next_seq++;
+    entry->client_id = client->id;
+    snprintf(entry->nick, sizeof(entry->nick), "%s", client->nick);
+    snprintf(entry->text, sizeof(entry->text), "%s", msg);
+
+    // And forever in the log
+    archive_add(entry->seq, entry->nick, msg);
+
+    char seq[24], id[24];
+    snprintf(seq, sizeof(seq), "%lu", entry->seq);
+    snprintf(id, sizeof(id), "%lu", client->id);
+
+    // Args: sequence number, sender's id, message
+    // The clients know the nick that belongs to the id from the ONL, PRS and USR messages
+    // It's encoded only once for everyone
+    char buf[PROT_HEAD_SIZE + 2*SERV_MAX_NUM_LEN + SERV_MAX_MSG_LEN + 1];
+    int size = prot_encode(prot_make_msg("MSG", 3, seq, id, msg), buf, sizeof(buf));
+    if (size < 0)
+        return -1;
 
     // Send this message to everyone (except the client that sent it)
-	for (size_t i = 0; i < SERV_MAX_CLIENTS; i++) {
-		if (clients[i].socket == NULL || clients[i].socket == client->socket) continue;
+    send_everyone(buf, (size_t)size, client);
 
-        // Not really necessary to error check
-        // If one of the clients disconnect, we will disconnect them anyway in the main loop asap
-        prot_send(clients[i].socket, msg_pack);
-	}
+    return 0;
+}
+
+// Tell the client that the user id now has the nick, or that it's gone if nick is NULL
+static int send_user(struct client* client, const unsigned long id, const char* nick) {
+
+    char id_str[24];
+    snprintf(id_str, sizeof(id_str), "%lu", id);
+
+    if (nick)
+        return send_msg(client, prot_make_msg("USR", 2, id_str, nick));
+    else
+        return send_msg(client, prot_make_msg("USR", 1, id_str));
+}
+
+// Send the client the list of everyone who is connected right now
+// Args: the presence version, a line with the id and the nick of every user (unless there's nobody)
+static int send_presence(struct client* client) {
+
+    char list[SERV_MAX_PRESENCE_LEN];
+    size_t used = 0;
+    for (size_t i = 0; i < SERV_MAX_CLIENTS; i++) {
+        // The others only learn about a client once it's announced
+        if (clients[i].socket == NULL || !clients[i].announced) continue;
+
+        used += (size_t)snprintf(&list[used], sizeof(list) - used, "%lu %s\n", clients[i].id, clients[i].nick);
+    }
+
+    char version[24];
+    snprintf(version, sizeof(version), "%lu", presence_version);
+
+    if (used == 0)
+        return send_msg(client, prot_make_msg("ONL", 1, version));
+    else
+        return send_msg(client, prot_make_msg("ONL", 2, version, list));
+}
+
+// Tell everyone (including the client itself) that the client has connected or has a new nick,
+// or that it's gone if nick is NULL
+// Args: the new presence version, the client's id, the nick
+static void broadcast_presence(const struct client* client, const char* nick) {
+
+    char version[24], id[24];
+    snprintf(version, sizeof(version), "%lu", ++presence_version);
+    snprintf(id, sizeof(id), "%lu", client->id);
+
+    // Only the change is sent, encoded once for everyone
+    char buf[PROT_HEAD_SIZE + 2*SERV_MAX_NUM_LEN + SERV_MAX_NICK_LEN + 1];
+    int size = nick ? prot_encode(prot_make_msg("PRS", 3, version, id, nick), buf, sizeof(buf))
+                    : prot_encode(prot_make_msg("PRS", 2, version, id), buf, sizeof(buf));
+    if (size < 0)
+        return;
+
+    send_everyone(buf, (size_t)size, NULL);
+}
+
+// Tell both ends that the transfer won't go on and forget it, the sender
+// gets ACK and the recipient CHK without the number of bytes
+static void cancel_transfer(struct transfer* transfer) {
+
+    struct client* sender = find_client(transfer->sender);
+    struct client* recipient = find_client(transfer->recipient);
+
+    char sender_id[24], id[24];
+    snprintf(sender_id, sizeof(sender_id), "%llu", (unsigned long long)transfer->sender_id);
+    snprintf(id, sizeof(id), "%lu", transfer->id);
+
+    if (sender)
+        send_msg(sender, prot_make_msg("ACK", 1, sender_id));
+    if (recipient)
+        send_msg(recipient, prot_make_msg("CHK", 1, id));
+
+    transfer_remove(transfer);
+}
+
+// Pass an offer of a file on to the recipient, or refuse it right away
+// Args: the sender's number for the transfer, the recipient's id, the file name, the file size
+static int offer_file(struct client* client, struct prot_msg* msg) {
+
+    Uint64 sender_id, recipient_id, size;
+    if (parse_num(msg->args[0], &sender_id) < 0 || parse_num(msg->args[1], &recipient_id) < 0 ||
+        parse_num(msg->args[3], &size) < 0)
+        return -1;
+
+    // The recipient shows the name, so it's checked like a nick
+    struct client* recipient = find_client((unsigned long)recipient_id);
+    struct transfer* transfer = NULL;
+    if (recipient && recipient != client && size > 0 &&
+        utf8_sanitize(msg->args[2], strlen(msg->args[2]), UTF8_REJECT) > 0 &&
+        !transfer_find_sent(client->id, sender_id))
+        transfer = transfer_add(client->id, sender_id, recipient->id, size);
+
+    if (!transfer) {
+        send_msg(client, prot_make_msg("ACK", 1, msg->args[0]));
+        return 0;
+    }
+
+    char id[24], sender[24];
+    snprintf(id, sizeof(id), "%lu", transfer->id);
+    snprintf(sender, sizeof(sender), "%lu", client->id);
+
+    fprintf(stdout, "The client %s offers %s to %s\n", client->nick, msg->args[2], recipient->nick);
+    send_msg(recipient, prot_make_msg("OFR", 4, id, sender, msg->args[2], msg->args[3]));
+
+    return 0;
+}
+
+// Forward a chunk of a file to the recipient, the chunks go into its low priority lane
+// Args: the sender's number for the transfer, the position of the chunk in the file, the escaped chunk
+// or only the number when the sender cancels the transfer
+static int relay_chunk(struct client* client, struct prot_msg* msg) {
+
+    Uint64 sender_id, offset = 0;
+    if (parse_num(msg->args[0], &sender_id) < 0 || msg->status == 2 ||
+        (msg->status == 3 && parse_num(msg->args[1], &offset) < 0))
+        return -1;
+
+    // It might have been cancelled while the chunk was on its way
+    struct transfer* transfer = transfer_find_sent(client->id, sender_id);
+    if (!transfer)
+        return 0;
+
+    // The sender can only be a window ahead of what the recipient has received
+    if (msg->status == 1 || !transfer->accepted || offset < transfer->acked ||
+        offset >= transfer->size || offset - transfer->acked >= SERV_TRANSFER_WINDOW) {
+        cancel_transfer(transfer);
+        return 0;
+    }
+
+    char id[24];
+    snprintf(id, sizeof(id), "%lu", transfer->id);
+
+    // The chunk is encoded straight into an outbox frame, so it's copied only once
+    // on its way to the socket (the shared memory and compression copy it again)
+    struct client* recipient = find_client(transfer->recipient);
+    struct outbox_frame* frame = outbox_frame_create(PROT_HEAD_SIZE + 2*SERV_MAX_NUM_LEN + SERV_MAX_CHUNK_LEN + 1);
+    if (!frame)
+        return 0;
+
+    int size = prot_encode(prot_make_msg("CHK", 3, id, msg->args[1], msg->args[2]), frame->data, frame->size);
+    if (size < 0) {
+        free(frame);
+        return -1;
+    }
+    frame->size = (size_t)size;
+
+    if (!recipient->shm_active && !recipient->compressed)
+        outbox_push_frame(recipient->outbox, frame);
+    else {
+        send_raw(recipient, frame->data, frame->size, OUTBOX_LOW);
+        free(frame);
+    }
+
+    return 0;
+}
+
+// Pass the recipient's progress on to the sender, the first one accepts the offer
+// Args: the transfer, the number of bytes received
+// or only the transfer when the recipient declines or cancels it
+static int acknowledge(struct client* client, struct prot_msg* msg) {
+
+    Uint64 id, acked = 0;
+    if (parse_num(msg->args[0], &id) < 0 || (msg->status == 2 && parse_num(msg->args[1], &acked) < 0))
+        return -1;
+
+    struct transfer* transfer = transfer_find((unsigned long)id);
+    if (!transfer || transfer->recipient != client->id)
+        return 0;
+
+    if (msg->status == 1 || acked < transfer->acked || acked > transfer->size) {
+        cancel_transfer(transfer);
+        return 0;
+    }
+
+    transfer->acked = acked;
+    transfer->accepted = 1;
+
+    char sender_id[24];
+    snprintf(sender_id, sizeof(sender_id), "%llu", (unsigned long long)transfer->sender_id);
+    send_msg(find_client(transfer->sender), prot_make_msg("ACK", 2, sender_id, msg->args[1]));
+
+    if (acked == transfer->size) {
+        fprintf(stdout, "The client %s has received a whole file\n", client->nick);
+        transfer_remove(transfer);
+    }
 
     return 0;
 }
@@ -46,12 +450,196 @@ static int broadcast_message(struct client* client, const char* msg) {
 static void disconnect_client(struct client* client) {
 
     fprintf(stdout, "Client %s disconnected.\n", client->nick);
-    broadcast_message(client, "Disconnected");
+    capture_add(CAPTURE_DISCONNECT, client->id, NULL, 0);
+    if (client->announced)
+        broadcast_message(client, "Disconnected");
 
+    // The transfers can't go on without it
+    struct transfer* transfer;
+    while ((transfer = transfer_next_of(client->id, NULL)))
+        cancel_transfer(transfer);
+
+    // The outbox closes the socket once its thread is done
     SDLNet_TCP_DelSocket(socks, client->socket);
-    SDLNet_TCP_Close(client->socket);
+    outbox_quit(client->outbox);
+    client->outbox = NULL;
     client->socket = NULL;
 
+    prot_shm_close(client->shm);
+    client->shm = NULL;
+    client->shm_active = 0;
+    client->compressed = 0;
+
+    // Now the others can forget the nick
+    if (client->announced)
+        broadcast_presence(client, NULL);
+    client->announced = 0;
+}
+
+// Tell everyone about the client, a resumed session isn't announced as a new connection
+static void announce_client(struct client* client, const int resumed) {
+
+    // Tell the client who is here first, it learns about itself from the change that everyone gets
+    // Only now, so that it's already compressed for a client that has asked for it right away
+    send_presence(client);
+
+    client->announced = 1;
+    broadcast_presence(client, client->nick);
+
+    if (!resumed)
+        broadcast_message(client, "Connected");
+}
+
+// Whether the nick can be used, the client is told its current nick if it can't
+static int check_nick(struct client* client, char* nick) {
+
+    // Nicks are shown everywhere, so refuse them instead of silently changing them
+    long len = utf8_sanitize(nick, strlen(nick), UTF8_REJECT);
+    int actions = len < 0 ? FILTER_REJECT : filter_run(nick, (size_t)len);
+
+    if (actions & FILTER_FLAG)
+        fprintf(stdout, "Flagged the nickname %s of the client %s\n", nick, client->nick);
+
+    if (actions & FILTER_REJECT) {
+        fprintf(stdout, "The client %s was refused a nickname\n", client->nick);
+        send_msg(client, prot_make_msg("NIC", 1, client->nick));
+        return 0;
+    }
+
+    return 1;
+}
+
+// Change the client's nick, let everyone know and confirm it to the client
+static void change_nick(struct client* client, char* nick) {
+
+    if (!check_nick(client, nick))
+        return;
+
+    fprintf(stdout, "The client %s changed his nickname to %s\n", client->nick, nick);          
+
+    // Let others know too
+    char buf[SERV_MAX_MSG_LEN]; // Be safe!
+    snprintf(buf, sizeof(buf), "Changed nickname to <%s>", nick);
+    broadcast_message(client, buf);
+
+    // Update the nick
+    strcpy(client->nick, nick);
+    broadcast_presence(client, client->nick);
+
+    // Send a confirmation back to the client
+    // This message exists in order to filter nicknames, bad characters
+    // and also for sending the initial nick at the beginning
+    send_msg(client, prot_make_msg("NIC", 1, client->nick));
+}
+
+// Send the client all the remembered messages newer than last_seq,
+// except for the ones sent by itself, either in this connection or
+// in the previous one (previous_id)
+static void replay_history(struct client* client, const unsigned long last_seq, const unsigned long previous_id) {
+
+    // The senders of the replayed messages might not be connected anymore or
+    // they might have had a different nick back then, so the client is told
+    // about the nick that each of them had at the time
+    static struct {
+        unsigned long id;
+        const char* nick;
+    } announced[SERV_HISTORY_LEN];
+    size_t num_announced = 0;
+
+    // The oldest message that is still remembered
+    unsigned long seq = next_seq > SERV_HISTORY_LEN ? next_seq - SERV_HISTORY_LEN : 1;
+    if (seq <= last_seq)
+        seq = last_seq + 1;
+
+    for (; seq < next_seq; seq++) {
+        const struct history_entry* entry = &history[seq % SERV_HISTORY_LEN];
+        // Since a restart, the sequence numbers continue from the archive, but the entries are empty
+        if (entry->seq != seq || entry->client_id == client->id || entry->client_id == previous_id) continue;
+
+        size_t i = 0;
+        while (i < num_announced && announced[i].id != entry->client_id) i++;
+
+        if (i == num_announced || strcmp(announced[i].nick, entry->nick)) {
+            if (send_user(client, entry->client_id, entry->nick) < 0)
+                return;
+
+            announced[i].id = entry->client_id;
+            announced[i].nick = entry->nick;
+            if (i == num_announced) num_announced++;
+        }
+
+        char seq_str[24], id_str[24];
+        snprintf(seq_str, sizeof(seq_str), "%lu", entry->seq);
+        snprintf(id_str, sizeof(id_str), "%lu", entry->client_id);
+
+        if (send_msg(client, prot_make_msg("MSG", 3, seq_str, id_str, entry->text)) < 0)
+            return;
+    }
+
+    // Put the nicks back the way they are now, the ones that aren't connected are forgotten
+    for (size_t i = 0; i < num_announced; i++) {
+        const char* nick = NULL;
+        for (size_t j = 0; j < SERV_MAX_CLIENTS; j++)
+            if (clients[j].socket != NULL && clients[j].id == announced[i].id)
+                nick = clients[j].nick;
+
+        send_user(client, announced[i].id, nick);
+    }
+}
+
+// Negotiate the shared memory with a client on the same machine
+// Without an argument, the client asks for it and gets the name of a new segment,
+// with the name, the client has opened it and everything else is sent there
+static void handle_shm(struct client* client, const struct prot_msg* msg) {
+
+    if (msg->status == 0) {
+
+        // It has to be local and only one segment is offered
+        IPaddress* addr = SDLNet_TCP_GetPeerAddress(client->socket);
+        if (client->shm || !addr || addr->host != SDL_SwapBE32(0x7F000001))
+            return;
+
+        // The client just keeps using the socket if we don't answer
+        client->shm = prot_shm_create();
+        if (!client->shm) {
+            fprintf(stderr, "Failed to create shared memory for the client %s\n", client->nick);
+            return;
+        }
+
+        send_msg(client, prot_make_msg("SHM", 1, prot_shm_name(client->shm)));
+        return;
+    }
+
+    if (!client->shm || client->shm_active || strcmp(msg->args[0], prot_shm_name(client->shm)) != 0)
+        return;
+
+    // Both ends have it open, the name isn't needed anymore
+    prot_shm_unlink(client->shm);
+
+    // The last message sent through the socket, after everything queued for it,
+    // the client then switches to the shared memory, what's written there in the meantime waits for it
+    if (send_switch(client, "SHM") < 0)
+        return;
+    client->shm_active = 1;
+
+    fprintf(stdout, "The client %s receives through shared memory\n", client->nick);
+}
+
+// The client wants everything that follows compressed, it has seen that we can do it in ACC
+// Through shared memory, there's nothing to gain
+static void handle_compression(struct client* client) {
+
+    if (client->compressed || client->shm_active)
+        return;
+
+    // The last message that isn't in a block, after everything queued so far (the file chunks
+    // in the other lane too), the client starts with the empty dictionary
+    if (send_switch(client, "CMP") < 0)
+        return;
+    client->compressed = 1;
+    client->dict_epoch = 0;
+
+    fprintf(stdout, "The client %s receives compressed\n", client->nick);
 }
 
 // Handle any sort of incoming data from a client
@@ -60,57 +648,122 @@ static void disconnect_client(struct client* client) {
 static int handle_message(struct client* client) {
 
     // Receive the data, protlib packages it up nicely
-    struct prot_msg msg = prot_recv(client->socket);
+    // The arguments point into the client's reader
+    struct prot_msg msg = prot_read(&client->reader);
     if (msg.status < 0) {
         disconnect_client(client); 
         return -1;
     }
 
+    // The bytes as they came, before anything changes the arguments
+    capture_add(CAPTURE_FRAME, client->id, &client->reader.buf[client->reader.start - client->reader.last], client->reader.last);
+
+    // Anything but RES starts a new session, the compression is asked for before it
+    int started = !client->announced && prot_head_id(msg.head) != SERV_RES_IN && prot_head_id(msg.head) != SERV_CMP_IN;
+    if (started)
+        announce_client(client, 0);
+
     int ret = 0;
     // Handle the message based on the head
-    if (!strncmp(msg.head, "MSG", PROT_HEAD_SIZE)) {
+    // protlib has already checked the number of arguments and their lengths (see messages.h)
+    switch (prot_head_id(msg.head)) {
+        case SERV_MSG_IN: {
 
-        // Checks for the correct number of arguments and the argument length
-        if (msg.status != 1) {
-            ret = -1;
-            goto err;
-        }
+            // Remove the control characters, but a client sending invalid UTF-8 is broken
+            long len = utf8_sanitize(msg.args[0], strlen(msg.args[0]), UTF8_STRIP);
+            if (len < 0) {
+                ret = -1;
+                goto err;
+            }
 
-        if (strlen(msg.args[0])+1 > SERV_MAX_MSG_LEN) {
-            ret = -1;
-            goto err;
-        }
-        
-        fprintf(stdout, "<%s> : %s\n", client->nick, msg.args[0]);
-        broadcast_message(client, msg.args[0]);
-        
-    } else
-    if (!strncmp(msg.head, "NIC", PROT_HEAD_SIZE)) {
+            // Nothing left to show, an empty argument couldn't be sent anyway
+            if (len == 0) break;
 
-        if (msg.status != 1) {
-            ret = -1;
-            goto err;
-        }
+            int actions = filter_run(msg.args[0], (size_t)len);
+            if (actions & FILTER_FLAG)
+                fprintf(stdout, "Flagged a message from %s: %s\n", client->nick, msg.args[0]);
+            if (actions & FILTER_REJECT) {
+                fprintf(stdout, "Rejected a message from %s\n", client->nick);
+                break;
+            }
 
-        if (strlen(msg.args[0])+1 > SERV_MAX_NICK_LEN) {
-            ret = -1;
-            goto err;
-        }
+            fprintf(stdout, "<%s> : %s\n", client->nick, msg.args[0]);
+            broadcast_message(client, msg.args[0]);
+        } break;
+        case SERV_NIC_IN:
+
+            change_nick(client, msg.args[0]);
+        break;
+        case SERV_RES_IN: {
+
+            // A reconnecting client resumes its previous session, only as its first message
+            // Args: the last sequence number it has received, the id of its previous connection,
+            // the run of the server it was in, its nick
+            Uint64 last_seq, previous_id, run;
+            if (client->announced || parse_num(msg.args[0], &last_seq) < 0 || parse_num(msg.args[1], &previous_id) < 0 ||
+                parse_num(msg.args[2], &run) < 0) {
+                ret = -1;
+                goto err;
+            }
+
+            // The session of an earlier run is gone, nobody here has seen it, it starts
+            // a new one, but still gets the messages it has missed since the restart
+            int resumed = (unsigned long)run == run_id;
+            if (!resumed)
+                previous_id = 0;
+
+            // The nick is simply restored, nobody is told that it has changed
+            fprintf(stdout, "The client %s %s from message %lu as %s\n", client->nick, resumed ? "resumes" : "returns after a restart",
+                    (unsigned long)last_seq, msg.args[3]);
+            if (check_nick(client, msg.args[3])) {
+                snprintf(client->nick, sizeof(client->nick), "%s", msg.args[3]);
+                send_msg(client, prot_make_msg("NIC", 1, client->nick));
+            }
+
+            announce_client(client, resumed);
+            replay_history(client, (unsigned long)last_seq, (unsigned long)previous_id);
+        } break;
+        case SERV_QRY_IN: {
+
+            // Search the archive, the query is run on the archive thread
+            // Args: page, query
+            struct archive_query query;
+            char* end;
+            query.client_id = client->id;
+            query.page = strtoul(msg.args[0], &end, 10);
+
+            // Without the total, the query was refused, the query is typed by the user,
+            // so one that can't be parsed isn't the client's fault
+            if (*end != '\0' || archive_parse_query(msg.args[1], &query) < 0 || archive_query(&query) < 0)
+                send_msg(client, prot_make_msg("END", 1, msg.args[0]));
+        } break;
+        case SERV_SHM_IN:
+
+            handle_shm(client, &msg);
+        break;
+        case SERV_CMP_IN:
 
-        fprintf(stdout, "The client %s changed his nickname to %s\n", client->nick, msg.args[0]);          
+            handle_compression(client);
+        break;
+        case SERV_ONL_IN:
 
-        // Let others know too
-        char buf[SERV_MAX_MSG_LEN]; // Be safe!
-        snprintf(buf, sizeof(buf), "Changed nickname to <%s>", msg.args[0]);
-        broadcast_message(client, buf);
+            // The client has missed a change and needs the whole list again,
+            // unless it has just got it by starting the session
+            if (!started)
+                send_presence(client);
+        break;
+        case SERV_OFR_IN:
 
-        // Update the nick
-        strcpy(client->nick, msg.args[0]);
+            ret = offer_file(client, &msg);
+        break;
+        case SERV_CHK_IN:
 
-        // Send a confirmation back to the client
-        // This message exists in order to potentially filter nicknames, 
-        // bad characters, and also for sending the initial nick at the beginning
-        prot_send(client->socket, prot_make_msg("NIC", 1, client->nick));
+            ret = relay_chunk(client, &msg);
+        break;
+        case SERV_ACK_IN:
+
+            ret = acknowledge(client, &msg);
+        break;
     }
 
     err:
@@ -118,13 +771,62 @@ static int handle_message(struct client* client) {
     if (ret != 0)
         disconnect_client(client);
 
-    // Free the dynamically allocated arguments
-    for (size_t i = 0; i < (size_t)msg.status; i++) 
-        free(msg.args[i]);
-
     return ret;
 }
 
+// Send the finished search results to the clients that asked for them
+static void send_results() {
+
+    // Only one byte is sent for any number of results, but read everything that is there
+    char buf[64];
+    if (SDLNet_TCP_Recv(wake_receiver, buf, sizeof(buf)) <= 0) {
+        fprintf(stderr, "Lost the wakeup connection\n");
+        SDLNet_TCP_DelSocket(socks, wake_receiver);
+        SDLNet_TCP_Close(wake_receiver);
+        wake_receiver = NULL;
+        return;
+    }
+
+    struct archive_result* result = archive_take_results();
+    while (result) {
+        struct archive_result* next = result->next;
+
+        // The client may have disconnected meanwhile
+        for (size_t i = 0; i < SERV_MAX_CLIENTS; i++)
+            if (clients[i].socket != NULL && clients[i].id == result->client_id)
+                send_raw(&clients[i], result->data, result->size, OUTBOX_HIGH);
+
+        free(result);
+        result = next;
+    }
+}
+
+// Open a connection to ourselves for the archive thread to wake up the main loop
+static int open_wakeup() {
+
+    IPaddress addr;
+    if (SDLNet_ResolveHost(&addr, "127.0.0.1", SERV_PORT) < 0)
+        return -1;
+
+    wake_sender = SDLNet_TCP_Open(&addr);
+    if (!wake_sender)
+        return -1;
+
+    // The server socket doesn't block, so give it a moment
+    for (int tries = 0; tries < 100 && !wake_receiver; tries++) {
+        wake_receiver = SDLNet_TCP_Accept(server_socket);
+        if (!wake_receiver) SDL_Delay(10);
+    }
+
+    if (!wake_receiver) {
+        SDLNet_TCP_Close(wake_sender);
+        return -1;
+    }
+
+    SDLNet_TCP_AddSocket(socks, wake_receiver);
+    return 0;
+}
+
 // Handles a new incomming connection
 static int handle_connection() {
     fprintf(stdout, "Handling connection\n");
@@ -148,8 +850,16 @@ static int handle_connection() {
         fprintf(stderr, "Cannot accept client, max number of clients reached\n");
         prot_send(connection, prot_make_msg("REF", 0));
         return -1;
-    } else 
-        prot_send(connection, prot_make_msg("ACC", 0));
+    }
+
+    // Args: the sequence number of the last broadcast message, the id of the connection, the run, the features
+    // The client needs the first three to resume the session later
+    char seq[24], id[24], run[24];
+    clients[i].id = next_client_id++;
+    snprintf(seq, sizeof(seq), "%lu", next_seq - 1);
+    snprintf(id, sizeof(id), "%lu", clients[i].id);
+    snprintf(run, sizeof(run), "%lu", run_id);
+    prot_send(connection, prot_make_msg("ACC", 4, seq, id, run, SERV_FEATURE_COMPRESSION));
 
 
     // Send a request to the client to change his local nickname
@@ -159,19 +869,36 @@ static int handle_connection() {
         return -1;
     }    
 
+    // From now on, everything is written by the outbox's thread
+    clients[i].outbox = outbox_create(connection);
+    if (!clients[i].outbox) {
+        fprintf(stderr, "Failed to create an outbox for the incoming connection\n");
+        SDLNet_TCP_Close(connection);
+        return -1;
+    }
+
     // Register the client
     clients[i].socket = connection;
+    clients[i].announced = 0;
+    prot_reader_reset(&clients[i].reader, connection);
     SDLNet_TCP_AddSocket(socks, connection);
+    capture_add(CAPTURE_CONNECT, clients[i].id, NULL, 0);
 
     fprintf(stdout, "Client %s connected.\n", clients[i].nick);
-    broadcast_message(&clients[i], "Connected");
 
     return 0;
 }
 
 int main(int argc, char *argv[]) {
 
-    (void)argc; (void)argv;
+    // The only option is recording the incoming traffic
+    const char* capture_path = NULL;
+    if (argc == 3 && !strcmp(argv[1], "--capture"))
+        capture_path = argv[2];
+    else if (argc != 1) {
+        fprintf(stderr, "Usage: %s [--capture <file>]\n", argv[0]);
+        exit(1);
+    }
 	
 	// Initialize SDL
 	if(SDL_Init(0) < 0) {
@@ -186,8 +913,8 @@ int main(int argc, char *argv[]) {
 	}
 
     // Initialise the socket set
-    // +1 for the server socket
-    socks = SDLNet_AllocSocketSet(SERV_MAX_CLIENTS + 1);
+    // +2 for the server socket and the wakeup connection
+    socks = SDLNet_AllocSocketSet(SERV_MAX_CLIENTS + 2);
     if (!socks) {
         fprintf(stderr, "SDLNet_AllocSocketSet: %s\n", SDLNet_GetError());
         exit(1);
@@ -210,6 +937,31 @@ int main(int argc, char *argv[]) {
     // Add the server socket to the set
     SDLNet_TCP_AddSocket(socks, server_socket);
 
+    for (size_t i = 0; i < SERV_MAX_CLIENTS; i++)
+        if (prot_reader_init(&clients[i].reader, NULL) < 0) {
+            fprintf(stderr, "Failed to allocate the receive buffers\n");
+            exit(1);
+        }
+
+    // Let protlib check the messages from the clients
+    prot_set_schema(serv_schema, SDL_arraysize(serv_schema), SERV_DIR_IN);
+
+    // Two runs started in the same second still differ in the performance counter
+    run_id = (unsigned long)((Uint64)time(NULL) ^ SDL_GetPerformanceCounter());
+
+    // Open the archive, the server works without it, only searching isn't possible
+    if (open_wakeup() < 0)
+        fprintf(stderr, "Failed to open the wakeup connection, the archive is disabled\n");
+    else if (archive_init(SERV_LOG_PATH, wake_sender, &next_seq) < 0)
+        fprintf(stderr, "Failed to open the archive, searching is disabled\n");
+
+    // The messages are still checked for invalid text without it
+    if (patterns_init(SERV_FILTER_PATH) < 0)
+        fprintf(stderr, "Failed to start the content filter\n");
+
+    if (capture_path && capture_init(capture_path) < 0)
+        exit(1);
+
     while (1) {
         
         // If there is socket activity...
@@ -217,6 +969,10 @@ int main(int argc, char *argv[]) {
         // I can do this because there is literally no other work to do
         if (SDLNet_CheckSockets(socks, -1) > 0) {
 
+            // ..Are there search results?
+            if (wake_receiver && SDLNet_SocketReady(wake_receiver))
+                send_results();
+
             // ..Is it an incomming connection?
             if (SDLNet_SocketReady(server_socket))
                 handle_connection();
@@ -225,12 +981,20 @@ int main(int argc, char *argv[]) {
                 for (size_t i = 0; i < SERV_MAX_CLIENTS; i++) {
                     if (clients[i].socket == NULL) continue;
 
-                    if (SDLNet_SocketReady(clients[i].socket))
-                        handle_message(&clients[i]);
+                    // Handle all the messages that one receive has brought in
+                    if (SDLNet_SocketReady(clients[i].socket)) {
+                        do handle_message(&clients[i]);
+                        while (clients[i].socket != NULL && prot_reader_ready(&clients[i].reader));
+                    }
                 }
 
             }
 
+            // Disconnect the clients that don't read what they are sent
+            for (size_t i = 0; i < SERV_MAX_CLIENTS; i++)
+                if (clients[i].socket != NULL && outbox_failed(clients[i].outbox))
+                    disconnect_client(&clients[i]);
+
         }
 
     }    
@@ -238,8 +1002,19 @@ int main(int argc, char *argv[]) {
     // Note that this code is currently unreachable, although it's nice to have it here
 
     // Close all the client sockets
-    for (size_t i = 0; i < SERV_MAX_CLIENTS; i++)
-        SDLNet_TCP_Close(clients[i].socket);
+    for (size_t i = 0; i < SERV_MAX_CLIENTS; i++) {
+        if (clients[i].socket != NULL)
+            outbox_quit(clients[i].outbox);
+        prot_reader_free(&clients[i].reader);
+    }
+
+    patterns_quit();
+    capture_quit();
+
+    // Archive the last messages
+    archive_quit();
+    SDLNet_TCP_Close(wake_sender);
+    SDLNet_TCP_Close(wake_receiver);
 
     // Close the server socket
     SDLNet_TCP_Close(server_socket);
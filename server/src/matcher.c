@@ -0,0 +1,211 @@
+#include "matcher.h"
+
+#include <stdlib.h>
+#include <string.h>
+
+static Uint8 fold(const Uint8 c) {
+    return (c >= 'A' && c <= 'Z') ? (Uint8)(c - 'A' + 'a') : c;
+}
+
+void matcher_init(struct matcher* matcher) {
+    memset(matcher, 0, sizeof(*matcher));
+}
+
+int matcher_add(struct matcher* matcher, const char* pattern, const size_t len, const int value) {
+
+    if (len == 0) return -1;
+
+    if (matcher->num_patterns == matcher->patterns_capacity) {
+        size_t capacity = matcher->patterns_capacity ? matcher->patterns_capacity*2 : 64;
+        struct matcher_pattern* patterns = realloc(matcher->patterns, capacity * sizeof(*patterns));
+        if (!patterns) return -1;
+        matcher->patterns = patterns;
+        matcher->patterns_capacity = capacity;
+    }
+
+    char* text = malloc(len);
+    if (!text) return -1;
+    memcpy(text, pattern, len);
+
+    struct matcher_pattern* added = &matcher->patterns[matcher->num_patterns++];
+    added->text = text;
+    added->len = len;
+    added->value = value;
+
+    return 0;
+}
+
+int matcher_compile(struct matcher* matcher) {
+
+    // Only the bytes that are in some pattern get their own column, the upper case
+    // letters share theirs with the lower case ones
+    Uint8 used[256] = {0};
+    size_t max_states = 1;
+    for (size_t i = 0; i < matcher->num_patterns; i++) {
+        const struct matcher_pattern* pattern = &matcher->patterns[i];
+        for (size_t j = 0; j < pattern->len; j++)
+            used[fold((Uint8)pattern->text[j])] = 1;
+        max_states += pattern->len;
+    }
+
+    memset(matcher->classes, 0, sizeof(matcher->classes));
+    Uint32 num_classes = 1;
+    for (int c = 0; c < 256; c++)
+        if (used[c]) matcher->classes[c] = (Uint16)num_classes++;
+    for (int c = 'A'; c <= 'Z'; c++)
+        matcher->classes[c] = matcher->classes[fold((Uint8)c)];
+
+    // The index of a row has to fit next to the output bit
+    if (max_states > (MATCHER_OUTPUT - 1) / num_classes) return -1;
+
+    Uint32* table = calloc(max_states * num_classes, sizeof(*table));
+    Sint32* output = malloc(max_states * sizeof(*output));
+    Uint32* next_output = calloc(max_states, sizeof(*next_output));
+    Uint32* fail = calloc(max_states, sizeof(*fail));
+    Uint32* queue = malloc(max_states * sizeof(*queue));
+    if (!table || !output || !next_output || !fail || !queue) {
+        free(table); free(output); free(next_output); free(fail); free(queue);
+        return -1;
+    }
+
+    // Build a trie of the patterns first, the table holds the children's
+    // state numbers and 0 means there is no child yet (the root is nobody's child)
+    Uint32 num_states = 1;
+    output[0] = -1;
+    for (size_t i = 0; i < matcher->num_patterns; i++) {
+        const struct matcher_pattern* pattern = &matcher->patterns[i];
+
+        Uint32 state = 0;
+        for (size_t j = 0; j < pattern->len; j++) {
+            Uint32* next = &table[state*num_classes + matcher->classes[(Uint8)pattern->text[j]]];
+            if (*next == 0) {
+                output[num_states] = -1;
+                *next = num_states++;
+            }
+            state = *next;
+        }
+
+        if (output[state] < 0 || matcher->patterns[output[state]].value < pattern->value)
+            output[state] = (Sint32)i;
+    }
+
+    // Then go through it breadth-first, every state's failure link (the longest suffix
+    // that is also in the trie) is always closer to the root, so its row is already
+    // complete and the missing transitions can be copied from it
+    size_t head = 0, tail = 0;
+    for (Uint32 c = 0; c < num_classes; c++)
+        if (table[c] != 0)
+            queue[tail++] = table[c];
+
+    while (head < tail) {
+        const Uint32 state = queue[head++];
+        const Uint32* fallback = &table[fail[state]*num_classes];
+        Uint32* row = &table[state*num_classes];
+
+        for (Uint32 c = 0; c < num_classes; c++) {
+            if (row[c] == 0) {
+                row[c] = fallback[c];
+                continue;
+            }
+
+            const Uint32 child = row[c];
+            fail[child] = fallback[c];
+            next_output[child] = output[fail[child]] >= 0 ? fail[child] : next_output[fail[child]];
+            queue[tail++] = child;
+        }
+    }
+
+    // Finally, number the states breadth-first, so that the rows of the short prefixes,
+    // which the text visits most of the time, are close together in the memory
+    // The failure links aren't needed anymore, they make room for the new numbers
+    Uint32* number = fail;
+    number[0] = 0;
+    for (size_t i = 0; i < tail; i++)
+        number[queue[i]] = (Uint32)i + 1;
+
+    Uint32* ordered = malloc((size_t)num_states * num_classes * sizeof(*ordered));
+    Sint32* ordered_output = malloc(num_states * sizeof(*ordered_output));
+    Uint32* ordered_next = malloc(num_states * sizeof(*ordered_next));
+    if (!ordered || !ordered_output || !ordered_next) {
+        free(table); free(output); free(next_output); free(fail); free(queue);
+        free(ordered); free(ordered_output); free(ordered_next);
+        return -1;
+    }
+
+    // Also turn the state numbers into row offsets and mark the states with an output,
+    // so that scanning doesn't have to look anywhere else most of the time
+    for (Uint32 state = 0; state < num_states; state++) {
+        const Uint32* row = &table[state*num_classes];
+        Uint32* ordered_row = &ordered[number[state]*num_classes];
+
+        for (Uint32 c = 0; c < num_classes; c++) {
+            ordered_row[c] = number[row[c]] * num_classes;
+            if (output[row[c]] >= 0 || next_output[row[c]] != 0)
+                ordered_row[c] |= MATCHER_OUTPUT;
+        }
+
+        ordered_output[number[state]] = output[state];
+        ordered_next[number[state]] = number[next_output[state]];
+    }
+
+    free(table);
+    free(output);
+    free(next_output);
+    free(fail);
+    free(queue);
+    table = ordered;
+    output = ordered_output;
+    next_output = ordered_next;
+
+    free(matcher->table);
+    free(matcher->output);
+    free(matcher->next_output);
+    matcher->table = table;
+    matcher->output = output;
+    matcher->next_output = next_output;
+    matcher->num_states = num_states;
+    matcher->num_classes = num_classes;
+
+    return 0;
+}
+
+// Report all the patterns ending at the given position in the given state
+static void report(const struct matcher* matcher, Uint32 state, const size_t end,
+                   matcher_callback callback, void* data) {
+
+    for (; state != 0; state = matcher->next_output[state]) {
+        if (matcher->output[state] < 0) continue;
+
+        const struct matcher_pattern* pattern = &matcher->patterns[matcher->output[state]];
+        callback(data, end + 1 - pattern->len, pattern);
+    }
+}
+
+void matcher_scan(const struct matcher* matcher, const char* text, const size_t len,
+                  matcher_callback callback, void* data) {
+
+    if (!matcher->table) return;
+
+    const Uint32* table = matcher->table;
+    const Uint16* classes = matcher->classes;
+
+    Uint32 state = 0;
+    for (size_t i = 0; i < len; i++) {
+        state = table[(state & ~MATCHER_OUTPUT) + classes[(Uint8)text[i]]];
+
+        if (state & MATCHER_OUTPUT)
+            report(matcher, (state & ~MATCHER_OUTPUT) / matcher->num_classes, i, callback, data);
+    }
+}
+
+void matcher_free(struct matcher* matcher) {
+
+    for (size_t i = 0; i < matcher->num_patterns; i++)
+        free(matcher->patterns[i].text);
+
+    free(matcher->patterns);
+    free(matcher->table);
+    free(matcher->output);
+    free(matcher->next_output);
+    matcher_init(matcher);
+}
@@ -0,0 +1,291 @@
+#include "outbox.h"
+
+#include <stdlib.h>
+#include <string.h>
+
+static void free_low(struct outbox* outbox) {
+
+    while (outbox->low_head) {
+        struct outbox_frame* next = outbox->low_head->next;
+        free(outbox->low_head);
+        outbox->low_head = next;
+    }
+
+    outbox->low_tail = NULL;
+    outbox->low_used = 0;
+    outbox->barriers = 0;
+}
+
+static int write_thread(void* data) {
+
+    struct outbox* outbox = data;
+
+    // The high priority lane is swapped with this buffer and written from it
+    char* writing = NULL;
+    size_t writing_size = 0;
+
+    SDL_LockMutex(outbox->lock);
+
+    while (1) {
+
+        while (!outbox->stop && outbox->high_used == 0 && !outbox->low_head)
+            SDL_CondWait(outbox->cond, outbox->lock);
+
+        if (outbox->stop)
+            break;
+
+        int ok = 1;
+
+        if (outbox->high_used > 0 && outbox->barriers == 0) {
+
+            // Take the whole lane and let the main loop fill the other buffer in the meantime
+            char* lane = outbox->high;
+            size_t used = outbox->high_used;
+            size_t size = outbox->high_size;
+            outbox->high = writing;
+            outbox->high_size = writing_size;
+            outbox->high_used = 0;
+            writing = lane;
+            writing_size = size;
+
+            SDL_UnlockMutex(outbox->lock);
+            ok = SDLNet_TCP_Send(outbox->socket, writing, (int)used) == (int)used;
+            SDL_LockMutex(outbox->lock);
+        } else {
+
+            // Take a slice of the low priority lane, a whole number of messages,
+            // so that the high priority ones can go in between
+            struct outbox_frame* slice = outbox->low_head;
+            struct outbox_frame* last = slice;
+            size_t size = last->size;
+            while (last->next && size + last->next->size <= SERV_OUTBOX_SLICE) {
+                last = last->next;
+                size += last->size;
+            }
+
+            outbox->low_head = last->next;
+            if (!outbox->low_head) outbox->low_tail = NULL;
+            outbox->low_used -= size;
+            last->next = NULL;
+
+            // Nothing is written in between anymore
+            for (struct outbox_frame* frame = slice; frame; frame = frame->next)
+                if (frame->barrier) outbox->barriers--;
+
+            SDL_UnlockMutex(outbox->lock);
+            while (slice) {
+                struct outbox_frame* next = slice->next;
+                if (ok) ok = SDLNet_TCP_Send(outbox->socket, slice->data, (int)slice->size) == (int)slice->size;
+                free(slice);
+                slice = next;
+            }
+            SDL_LockMutex(outbox->lock);
+        }
+
+        if (!ok) {
+            SDL_AtomicSet(&outbox->failed, 1);
+            outbox->high_used = 0;
+            free_low(outbox);
+        }
+    }
+
+    SDL_UnlockMutex(outbox->lock);
+
+    // Nobody else uses the outbox anymore (see outbox_quit)
+    SDLNet_TCP_Close(outbox->socket);
+    free(writing);
+    free_low(outbox);
+    free(outbox->high);
+    SDL_DestroyCond(outbox->cond);
+    SDL_DestroyMutex(outbox->lock);
+    free(outbox);
+
+    return 0;
+}
+
+struct outbox* outbox_create(TCPsocket socket) {
+
+    struct outbox* outbox = calloc(1, sizeof(*outbox));
+    if (!outbox) return NULL;
+
+    outbox->socket = socket;
+    outbox->lock = SDL_CreateMutex();
+    outbox->cond = SDL_CreateCond();
+    if (!outbox->lock || !outbox->cond)
+        goto err;
+
+    outbox->thread = SDL_CreateThread(write_thread, "Outbox", outbox);
+    if (!outbox->thread)
+        goto err;
+
+    return outbox;
+
+    err:
+
+    SDL_DestroyCond(outbox->cond);
+    SDL_DestroyMutex(outbox->lock);
+    free(outbox);
+    return NULL;
+}
+
+struct outbox_frame* outbox_frame_create(const size_t size) {
+
+    struct outbox_frame* frame = malloc(sizeof(*frame) + size);
+    if (!frame) return NULL;
+
+    frame->next = NULL;
+    frame->barrier = 0;
+    frame->size = size;
+    return frame;
+}
+
+int outbox_push_frame(struct outbox* outbox, struct outbox_frame* frame) {
+
+    SDL_LockMutex(outbox->lock);
+
+    int ret = -1;
+    if (SDL_AtomicGet(&outbox->failed)) {
+        free(frame);
+        goto out;
+    }
+
+    if (outbox->low_used + frame->size > SERV_OUTBOX_SIZE) {
+        // The client isn't reading
+        SDL_AtomicSet(&outbox->failed, 1);
+        free(frame);
+        goto out;
+    }
+
+    frame->next = NULL;
+    if (outbox->low_tail) outbox->low_tail->next = frame;
+    else outbox->low_head = frame;
+    outbox->low_tail = frame;
+    outbox->low_used += frame->size;
+
+    SDL_CondBroadcast(outbox->cond);
+    ret = 0;
+
+    out:
+
+    SDL_UnlockMutex(outbox->lock);
+    return ret;
+}
+
+int outbox_push(struct outbox* outbox, const enum outbox_lane lane, const char* data, const size_t size) {
+
+    if (lane == OUTBOX_LOW) {
+        struct outbox_frame* frame = outbox_frame_create(size);
+        if (!frame) {
+            SDL_AtomicSet(&outbox->failed, 1);
+            return -1;
+        }
+
+        memcpy(frame->data, data, size);
+        return outbox_push_frame(outbox, frame);
+    }
+
+    SDL_LockMutex(outbox->lock);
+
+    int ret = -1;
+    if (SDL_AtomicGet(&outbox->failed))
+        goto out;
+
+    if (outbox->high_used + size > SERV_OUTBOX_SIZE)
+        goto full;
+
+    if (outbox->high_used + size > outbox->high_size) {
+        size_t new_size = outbox->high_size ? outbox->high_size : 4096;
+        while (new_size < outbox->high_used + size) new_size *= 2;
+
+        char* high = realloc(outbox->high, new_size);
+        if (!high) goto full;
+        outbox->high = high;
+        outbox->high_size = new_size;
+    }
+
+    memcpy(&outbox->high[outbox->high_used], data, size);
+    outbox->high_used += size;
+
+    SDL_CondBroadcast(outbox->cond);
+    ret = 0;
+    goto out;
+
+    full:
+
+    // The client isn't reading
+    SDL_AtomicSet(&outbox->failed, 1);
+
+    out:
+
+    SDL_UnlockMutex(outbox->lock);
+    return ret;
+}
+
+int outbox_push_switch(struct outbox* outbox, const char* data, const size_t size) {
+
+    SDL_LockMutex(outbox->lock);
+
+    int ret = -1;
+    if (SDL_AtomicGet(&outbox->failed))
+        goto out;
+
+    // What waits in the high priority lane goes to the end of the low priority one,
+    // the order of the lanes between each other doesn't matter
+    struct outbox_frame* high = NULL;
+    if (outbox->high_used > 0) {
+        high = outbox_frame_create(outbox->high_used);
+        if (!high) goto fail;
+        memcpy(high->data, outbox->high, outbox->high_used);
+    }
+
+    struct outbox_frame* frame = outbox_frame_create(size);
+    if (!frame) {
+        free(high);
+        goto fail;
+    }
+    memcpy(frame->data, data, size);
+    frame->barrier = 1;
+
+    if (high) {
+        high->next = frame;
+        outbox->high_used = 0;
+    }
+
+    struct outbox_frame* first = high ? high : frame;
+    if (outbox->low_tail) outbox->low_tail->next = first;
+    else outbox->low_head = first;
+    outbox->low_tail = frame;
+    outbox->low_used += (high ? high->size : 0) + frame->size;
+    outbox->barriers++;
+
+    SDL_CondBroadcast(outbox->cond);
+    ret = 0;
+    goto out;
+
+    fail:
+
+    SDL_AtomicSet(&outbox->failed, 1);
+
+    out:
+
+    SDL_UnlockMutex(outbox->lock);
+    return ret;
+}
+
+int outbox_failed(struct outbox* outbox) {
+    return SDL_AtomicGet(&outbox->failed);
+}
+
+void outbox_quit(struct outbox* outbox) {
+
+    // The thread might be in the middle of a write to a client that doesn't read, SDL_net can't
+    // cut it short, so the thread is left to finish it on its own, the main loop never waits for it
+    SDL_DetachThread(outbox->thread);
+
+    SDL_LockMutex(outbox->lock);
+    outbox->stop = 1;
+    outbox->high_used = 0;
+    free_low(outbox);
+    SDL_CondBroadcast(outbox->cond);
+    SDL_UnlockMutex(outbox->lock);
+}
@@ -0,0 +1,222 @@
+#include "patterns.h"
+
+#include <SDL.h>
+#include <stdio.h>
+#include <stdlib.h>
+#include <string.h>
+#include <sys/stat.h>
+#include <sys/types.h>
+
+#include "filter.h"
+#include "matcher.h"
+#include "server.h"
+
+// What the file looked like when it was last loaded
+struct stamp {
+    int exists;
+    Sint64 mtime;
+    Sint64 size;
+};
+
+static int running = 0;
+
+static const char* file_path;
+static struct stamp loaded;
+static SDL_sem* stop;
+static SDL_Thread* watch_thread;
+
+// The patterns used by the main thread
+static struct matcher* current;
+// New patterns loaded by the watching thread that the main thread hasn't picked up yet,
+// whichever thread swaps them out of here owns them
+static void* pending;
+
+static struct stamp get_stamp(const char* path) {
+
+    struct stamp stamp = {0, 0, 0};
+    struct stat info;
+    if (stat(path, &info) == 0) {
+        stamp.exists = 1;
+        stamp.mtime = (Sint64)info.st_mtime;
+        stamp.size = (Sint64)info.st_size;
+    }
+
+    return stamp;
+}
+
+static void discard(struct matcher* matcher) {
+
+    if (!matcher) return;
+    matcher_free(matcher);
+    free(matcher);
+}
+
+static int parse_action(const char* str) {
+    if (strcmp(str, "flag") == 0) return FILTER_FLAG;
+    if (strcmp(str, "mask") == 0) return FILTER_MASK;
+    if (strcmp(str, "reject") == 0) return FILTER_REJECT;
+    return 0;
+}
+
+// Read and compile the patterns, the bad lines are skipped
+// Returns NULL on failure
+static struct matcher* load(const char* path) {
+
+    struct matcher* matcher = malloc(sizeof(*matcher));
+    if (!matcher) return NULL;
+    matcher_init(matcher);
+
+    // Without the file there are no patterns
+    FILE* file = fopen(path, "rb");
+    if (file) {
+        // A pattern longer than a message could never be found anyway
+        char line[SERV_MAX_MSG_LEN + 16];
+        unsigned long number = 0;
+
+        while (fgets(line, sizeof(line), file)) {
+            number++;
+
+            size_t len = strlen(line);
+            if (len == sizeof(line)-1 && line[len-1] != '\n' && !feof(file)) {
+                fprintf(stderr, "%s:%lu: The line is too long\n", path, number);
+                int c;
+                while ((c = fgetc(file)) != EOF && c != '\n');
+                continue;
+            }
+
+            while (len > 0 && (line[len-1] == '\n' || line[len-1] == '\r'))
+                line[--len] = '\0';
+            if (len == 0 || line[0] == '#') continue;
+
+            char* pattern = strchr(line, ' ');
+            int action = 0;
+            if (pattern) {
+                *pattern++ = '\0';
+                action = parse_action(line);
+            }
+
+            if (action == 0 || *pattern == '\0') {
+                fprintf(stderr, "%s:%lu: Expected an action (flag, mask or reject) and a pattern\n", path, number);
+                continue;
+            }
+
+            if (matcher_add(matcher, pattern, strlen(pattern), action) < 0) {
+                fclose(file);
+                discard(matcher);
+                return NULL;
+            }
+        }
+
+        fclose(file);
+    }
+
+    if (matcher_compile(matcher) < 0) {
+        discard(matcher);
+        return NULL;
+    }
+
+    fprintf(stdout, "Loaded %lu filter patterns from %s\n", (unsigned long)matcher->num_patterns, path);
+    return matcher;
+}
+
+static int watch(void* data) {
+
+    (void)data;
+
+    // Wake up every interval until patterns_quit
+    while (SDL_SemWaitTimeout(stop, SERV_FILTER_RELOAD_INTERVAL) == SDL_MUTEX_TIMEDOUT) {
+
+        const struct stamp stamp = get_stamp(file_path);
+        if (stamp.exists == loaded.exists && stamp.mtime == loaded.mtime && stamp.size == loaded.size)
+            continue;
+        loaded = stamp;
+
+        // Keep the old patterns if the new ones can't be loaded
+        struct matcher* matcher = load(file_path);
+        if (!matcher) {
+            fprintf(stderr, "Failed to reload the filter patterns\n");
+            continue;
+        }
+
+        discard(SDL_AtomicSetPtr(&pending, matcher));
+    }
+
+    return 0;
+}
+
+// The state of one matcher_scan
+struct scan {
+    char* text;
+    int actions;
+};
+
+static void found(void* data, size_t start, const struct matcher_pattern* pattern) {
+
+    struct scan* scan = data;
+    if (pattern->value == FILTER_MASK)
+        memset(scan->text + start, '*', pattern->len);
+    scan->actions |= pattern->value;
+}
+
+static int apply(void* data, char* text, const size_t len) {
+
+    (void)data;
+
+    // Swap in the reloaded patterns
+    struct matcher* matcher = SDL_AtomicSetPtr(&pending, NULL);
+    if (matcher) {
+        discard(current);
+        current = matcher;
+    }
+
+    struct scan scan = { text, 0 };
+    matcher_scan(current, text, len, found, &scan);
+    return scan.actions;
+}
+
+static const struct filter patterns_filter = { "patterns", apply, NULL };
+
+int patterns_init(const char* path) {
+
+    file_path = path;
+    loaded = get_stamp(path);
+    current = load(path);
+    if (!current) {
+        fprintf(stderr, "Failed to load the filter patterns from %s\n", path);
+        return -1;
+    }
+
+    stop = SDL_CreateSemaphore(0);
+    if (!stop) {
+        fprintf(stderr, "Failed to create a semaphore: %s\n", SDL_GetError());
+        discard(current);
+        return -1;
+    }
+
+    watch_thread = SDL_CreateThread(watch, "Filter patterns", NULL);
+    if (!watch_thread) {
+        fprintf(stderr, "Failed to create the thread watching %s: %s\n", path, SDL_GetError());
+        SDL_DestroySemaphore(stop);
+        discard(current);
+        return -1;
+    }
+
+    filter_add(&patterns_filter);
+    running = 1;
+    return 0;
+}
+
+void patterns_quit() {
+
+    if (!running) return;
+    running = 0;
+
+    SDL_SemPost(stop);
+    SDL_WaitThread(watch_thread, NULL);
+    SDL_DestroySemaphore(stop);
+
+    filter_remove(&patterns_filter);
+    discard(current);
+    discard(SDL_AtomicSetPtr(&pending, NULL));
+    current = NULL;
+}
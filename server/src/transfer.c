@@ -0,0 +1,56 @@
+#include "transfer.h"
+
+static struct transfer transfers[SERV_MAX_TRANSFERS];
+
+// The id of the next transfer
+static unsigned long next_id = 1;
+
+struct transfer* transfer_add(const unsigned long sender, const Uint64 sender_id, const unsigned long recipient, const Uint64 size) {
+
+    for (size_t i = 0; i < SERV_MAX_TRANSFERS; i++) {
+        struct transfer* transfer = &transfers[i];
+        if (transfer->id != 0) continue;
+
+        transfer->id = next_id++;
+        transfer->sender = sender;
+        transfer->sender_id = sender_id;
+        transfer->recipient = recipient;
+        transfer->size = size;
+        transfer->acked = 0;
+        transfer->accepted = 0;
+        return transfer;
+    }
+
+    return NULL;
+}
+
+struct transfer* transfer_find(const unsigned long id) {
+
+    for (size_t i = 0; i < SERV_MAX_TRANSFERS; i++)
+        if (id != 0 && transfers[i].id == id)
+            return &transfers[i];
+
+    return NULL;
+}
+
+struct transfer* transfer_find_sent(const unsigned long sender, const Uint64 sender_id) {
+
+    for (size_t i = 0; i < SERV_MAX_TRANSFERS; i++)
+        if (transfers[i].id != 0 && transfers[i].sender == sender && transfers[i].sender_id == sender_id)
+            return &transfers[i];
+
+    return NULL;
+}
+
+struct transfer* transfer_next_of(const unsigned long client, struct transfer* prev) {
+
+    for (size_t i = prev ? (size_t)(prev - transfers) + 1 : 0; i < SERV_MAX_TRANSFERS; i++)
+        if (transfers[i].id != 0 && (transfers[i].sender == client || transfers[i].recipient == client))
+            return &transfers[i];
+
+    return NULL;
+}
+
+void transfer_remove(struct transfer* transfer) {
+    transfer->id = 0;
+}
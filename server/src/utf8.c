@@ -0,0 +1,126 @@
+#include "utf8.h"
+
+#include <string.h>
+
+#if defined(__SSE2__) || defined(_M_X64)
+#include <emmintrin.h>
+#define UTF8_SSE2
+#endif
+
+// The length of the sequence that starts with the byte c, 0 if c can't start one
+static size_t sequence_len(const unsigned char c) {
+    if (c >= 0xC2 && c <= 0xDF) return 2;
+    if (c >= 0xE0 && c <= 0xEF) return 3;
+    if (c >= 0xF0 && c <= 0xF4) return 4;
+    return 0;
+}
+
+// Decode the multi-byte sequence at str (at most len bytes long)
+// Returns the code point and its length in *size, or -1 if it's invalid,
+// overlong, a surrogate or above U+10FFFF
+static long decode(const unsigned char* str, const size_t len, size_t* size) {
+
+    size_t n = sequence_len(str[0]);
+    if (n == 0 || n > len) return -1;
+
+    long cp = str[0] & (0x7F >> n);
+    for (size_t i = 1; i < n; i++) {
+        if ((str[i] & 0xC0) != 0x80) return -1;
+        cp = cp << 6 | (str[i] & 0x3F);
+    }
+
+    // 2-byte overlongs are already excluded by sequence_len
+    if ((n == 3 && cp < 0x800) || (n == 4 && cp < 0x10000) ||
+        (cp >= 0xD800 && cp <= 0xDFFF) || cp > 0x10FFFF)
+        return -1;
+
+    *size = n;
+    return cp;
+}
+
+static int is_kept_control(const long cp) {
+    return cp == '\t' || cp == '\n' || cp == '\v' || cp == '\r';
+}
+
+// The number of printable ASCII characters at the start of str, that's nearly all the text
+static size_t plain_prefix(const char* str, const size_t len) {
+
+    size_t n = 0;
+
+#ifdef UTF8_SSE2
+    // Bytes from 0x80 up are negative as signed, so one comparison finds both
+    // them and the C0 controls, DEL is the only one left
+    const __m128i space = _mm_set1_epi8(0x20);
+    const __m128i del = _mm_set1_epi8(0x7F);
+
+    if (len >= 16) {
+        while (1) {
+            // The last chunk overlaps with the previous one instead of being shorter
+            const size_t at = n + 16 <= len ? n : len - 16;
+            const __m128i chunk = _mm_loadu_si128((const __m128i*)&str[at]);
+            unsigned int mask = (unsigned int)_mm_movemask_epi8(_mm_or_si128(_mm_cmplt_epi8(chunk, space), _mm_cmpeq_epi8(chunk, del)));
+
+            // Ignore the bytes that were already checked
+            mask >>= n - at;
+
+            if (mask != 0) {
+                while (!(mask & 1)) {
+                    mask >>= 1;
+                    n++;
+                }
+                return n;
+            }
+
+            n = at + 16;
+            if (n == len) return n;
+        }
+    }
+#endif
+
+    while (n < len && (unsigned char)str[n] >= 0x20 && (unsigned char)str[n] < 0x7F)
+        n++;
+
+    return n;
+}
+
+long utf8_sanitize(char* str, const size_t len, const enum utf8_mode mode) {
+
+    // Bytes are read at r and written at w, they only differ after something was stripped
+    size_t r = 0, w = 0;
+
+    while (r < len) {
+
+        const size_t plain = plain_prefix(&str[r], len - r);
+        if (w != r)
+            memmove(&str[w], &str[r], plain);
+        r += plain;
+        w += plain;
+
+        if (r == len) break;
+
+        // Anything else is a control character or a multi-byte sequence
+        const unsigned char c = (unsigned char)str[r];
+
+        long cp = c;
+        size_t size = 1;
+        if (c >= 0x80 && (cp = decode((const unsigned char*)&str[r], len - r, &size)) < 0)
+            return -1;
+
+        if (cp < 0x20 || (cp >= 0x7F && cp <= 0x9F)) {
+            if (mode == UTF8_REJECT) return -1;
+
+            // Stripped
+            if (!is_kept_control(cp)) {
+                r += size;
+                continue;
+            }
+        }
+
+        memmove(&str[w], &str[r], size);
+        r += size;
+        w += size;
+    }
+
+    str[w] = '\0';
+    return (long)w;
+}